@@ -53,9 +53,10 @@ config_apply()
 
 load_base_config()
 {
-    local drop_anonymous src_dev
+    local drop_anonymous src_dev bridge
     config_get drop_anonymous "global" "drop_anonymous" "0"
     config_get src_dev "global" "src_dev"
+    config_get bridge "global" "bridge" "0"
     config_get UPDATE_TIME "global" "update_time"
     config_get UPDATE_URL "global" "update_url"
     config_get UPDATE_EN "global" "auto_update" "0"
@@ -65,6 +66,7 @@ load_base_config()
     json_add_object "data"
     json_add_int "drop_anonymous" $drop_anonymous
     json_add_string "src_dev" "$src_dev"
+    json_add_int "bridge" $bridge
     json_str=`json_dump`
     config_apply "$json_str"
     json_cleanup
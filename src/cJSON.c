@@ -124,7 +124,7 @@ static const char *parse_number(cJSON *item, const char *num)
     if (*num == '0') num++;			/* is zero */
     if (*num >= '1' && *num <= '9')	do	n = (n * 10) + (*num++ -'0');
         while (*num >= '0' && *num <= '9');	/* Number? */
-    item->valueint = (int)n;
+    item->valueint = sign * n;
     item->type = cJSON_Number;
     return num;
 }
@@ -1,73 +1,172 @@
+#include <linux/module.h>
 #include <linux/version.h>
 #include <linux/proc_fs.h>
 #include <linux/inet.h>
 #include <linux/if_ether.h>
 #include <linux/etherdevice.h>
+#include <linux/rculist.h>
+#include <linux/vmalloc.h>
 #include "pc_policy.h"
 #include "pc_utils.h"
-struct list_head pc_app_head = LIST_HEAD_INIT(pc_app_head);
 
-DEFINE_RWLOCK(pc_app_lock);
+#define PC_STR_CHUNK_SIZE 4096
 
-static void __set_app_feature(pc_app_t *node, int appid, const char *name, int proto, int src_port,
-                              port_info_t dport_info, char *host_url, char *request_url, char *dict)
+/*
+ * The feature table is built once when the module is loaded and stays
+ * unchanged until it is unloaded, the data path walks it under RCU.
+ */
+static pc_app_table_t pc_app_empty;
+pc_app_table_t __rcu *pc_app_table = &pc_app_empty;
+EXPORT_SYMBOL_GPL(pc_app_table);
+
+// blacklists hold a few entries, only the app library needs vmalloc
+pc_app_table_t *pc_new_app_table(int size)
+{
+    size_t len = sizeof(pc_app_table_t) + size * sizeof(pc_app_t);
+    pc_app_table_t *t;
+
+    BUILD_BUG_ON(offsetof(pc_app_t, pos_info) > 64);
+    if (len <= PAGE_SIZE)
+        t = kzalloc(len, GFP_KERNEL);
+    else
+        t = vzalloc(len);
+    if (!t)
+        return NULL;
+    t->size = size;
+    return t;
+}
+
+static void pc_app_table_clean(pc_app_table_t *t)
+{
+    pc_str_chunk_t *c;
+    pc_app_t *app;
+
+    pc_for_each_app(app, t) {
+        if (app->host_re)
+            regexp_release(app->host_re);
+        if (app->request_re)
+            regexp_release(app->request_re);
+    }
+    while (t->strs) {
+        c = t->strs;
+        t->strs = c->next;
+        kfree(c);
+    }
+    t->num = 0;
+}
+
+void pc_free_app_table(pc_app_table_t *t)
+{
+    if (!t)
+        return;
+    pc_app_table_clean(t);
+    kvfree(t);
+}
+
+// copy a string into the arena of the table, the empty string is shared
+static const char *pc_app_str(pc_app_table_t *t, const char *str)
+{
+    int len = strlen(str) + 1;
+    pc_str_chunk_t *c = t->strs;
+    char *p;
+
+    if (len == 1)
+        return "";
+    if (!c || c->used + len > PC_STR_CHUNK_SIZE - sizeof(pc_str_chunk_t)) {
+        c = kmalloc(PC_STR_CHUNK_SIZE, GFP_KERNEL);
+        if (!c)
+            return NULL;
+        c->next = t->strs;
+        c->used = 0;
+        t->strs = c;
+    }
+    p = c->buf + c->used;
+    memcpy(p, str, len);
+    c->used += len;
+    return p;
+}
+
+static void pc_add_pos_info(pc_app_t *node, const char *str)
+{
+    int index = 0;
+    int value = 0;
+
+    if (node->pos_num < MAX_POS_INFO_PER_FEATURE &&
+            k_sscanf(str, "%d:%x", &index, &value) == 2 &&
+            index >= -32768 && index <= 32767) {
+        node->pos_info[node->pos_num].pos = index;
+        node->pos_info[node->pos_num].value = value;
+        node->pos_num++;
+    }
+}
+
+static int __set_app_feature(pc_app_table_t *t, pc_app_t *node, int appid, const char *name, int proto,
+                             int src_port, port_info_t dport_info, char *host_url, char *request_url, char *dict)
 {
     char *p = dict;
     char *begin = dict;
     char pos[32] = {0};
-    int index = 0;
-    int value = 0;
     node->app_id = appid;
-    strcpy(node->app_name, name);
+    // the features of an app are added one after another and share its name
+    if (node > t->apps && !strcmp(node[-1].app_name, name))
+        node->app_name = node[-1].app_name;
+    else
+        node->app_name = pc_app_str(t, name);
     node->proto = proto;
     node->dport_info = dport_info;
     node->sport = src_port;
-    strcpy(node->host_url, host_url);
-    strcpy(node->request_url, request_url);
+    node->host_url = pc_app_str(t, host_url);
+    node->request_url = pc_app_str(t, request_url);
+    if (!node->app_name || !node->host_url || !node->request_url) {
+        PC_ERROR("id %d malloc feature string error\n", appid);
+        return -1;
+    }
+    if (node->host_url[0]) {
+        node->host_re = regexp_compile(node->host_url);
+        if (!node->host_re)
+            PC_ERROR("id %d invalid host url %s\n", appid, node->host_url);
+    }
+    if (node->request_url[0]) {
+        node->request_re = regexp_compile(node->request_url);
+        if (!node->request_re)
+            PC_ERROR("id %d invalid request url %s\n", appid, node->request_url);
+    }
     // 00:0a-01:11
-    p = dict;
-    begin = dict;
-    index = 0;
-    value = 0;
     while (*p++) {
         if (*p == '|') {
             memset(pos, 0x0, sizeof(pos));
-            strncpy(pos, begin, p - begin);
+            memcpy(pos, begin, min(p - begin, sizeof(pos) - 1));
             begin = p + 1;
-            if (k_sscanf(pos, "%d:%x", &index, &value) == 2) {
-                node->pos_info[node->pos_num].pos = index;
-                node->pos_info[node->pos_num].value = value;
-                node->pos_num++;
-            }
+            pc_add_pos_info(node, pos);
         }
     }
-
-    if (begin != dict)
-        strncpy(pos, begin, p - begin);
+    memset(pos, 0x0, sizeof(pos));
+    memcpy(pos, begin, min(p - begin, sizeof(pos) - 1));
+    pc_add_pos_info(node, pos);
+
+    if (node->host_url[0] || node->request_url[0])
+        node->match = PC_APP_MATCH_URL;
+    else if (node->pos_num > 0)
+        node->match = PC_APP_MATCH_POS;
     else
-        strcpy(pos, dict);
-
-    if (k_sscanf(pos, "%d:%x", &index, &value) == 2) {
-        node->pos_info[node->pos_num].pos = index;
-        node->pos_info[node->pos_num].value = value;
-        node->pos_num++;
-    }
+        node->match = PC_APP_MATCH_PORT;
+    return 0;
 }
 
-static int __add_app_feature(int appid, const char *name, int proto, int src_port,
+static int __add_app_feature(pc_app_table_t *t, int appid, const char *name, int proto, int src_port,
                              port_info_t dport_info, char *host_url, char *request_url, char *dict)
 {
-    pc_app_t *node = NULL;
-    node = kzalloc(sizeof(pc_app_t), GFP_KERNEL);
-    if (node == NULL) {
-        printk("malloc feature memory error\n");
+    pc_app_t *node;
+
+    if (t->num >= t->size) {
+        PC_ERROR("feature table is full, drop a feature of app %d\n", appid);
         return -1;
-    } else {
-        __set_app_feature(node, appid, name, proto, src_port, dport_info, host_url, request_url, dict);
-        pc_app_write_lock();
-        list_add(&(node->head), &pc_app_head);
-        pc_app_write_unlock();
     }
+    node = &t->apps[t->num];
+    memset(node, 0, sizeof(pc_app_t));
+    if (__set_app_feature(t, node, appid, name, proto, src_port, dport_info, host_url, request_url, dict))
+        return -1;
+    t->num++;
     return 0;
 }
 static int validate_range_value(char *range_str)
@@ -115,6 +214,8 @@ static int parse_range_value(char *range_str, range_value_t *range)
             return -1;
         end = start;
     }
+    if (start < 0 || end > 65535 || start > end)
+        return -1;
     range->start = start;
     range->end = end;
     return 0;
@@ -135,7 +236,8 @@ static int parse_port_info(char *port_str, port_info_t *info)
             continue;
         memset(one_port_buf, 0x0, sizeof(one_port_buf));
         strncpy(one_port_buf, begin, p - begin);
-        if (0 == parse_range_value(one_port_buf, &info->range_list[info->num])) {
+        if (info->num < MAX_PORT_RANGE_NUM &&
+                0 == parse_range_value(one_port_buf, &info->range_list[info->num])) {
             info->num++;
         }
         param_num++;
@@ -143,14 +245,15 @@ static int parse_port_info(char *port_str, port_info_t *info)
     }
     memset(one_port_buf, 0x0, sizeof(one_port_buf));
     strncpy(one_port_buf, begin, p - begin);
-    if (0 == parse_range_value(one_port_buf, &info->range_list[info->num])) {
+    if (info->num < MAX_PORT_RANGE_NUM &&
+            0 == parse_range_value(one_port_buf, &info->range_list[info->num])) {
         info->num++;
     }
     return 0;
 }
 
 //[tcp;;443;baidu.com;;]
-static int parse_app_str(pc_app_t *app, int appid, const char *name, const char *feature)
+static int parse_app_str(pc_app_table_t *t, int appid, const char *name, const char *feature)
 {
     char proto_str[16] = {0};
     char src_port_str[16] = {0};
@@ -215,24 +318,15 @@ static int parse_app_str(pc_app_t *app, int appid, const char *name, const char
     sscanf(src_port_str, "%d", &src_port);
     //	sscanf(dst_port_str, "%d", &dst_port);
     parse_port_info(dst_port_str, &dport_info);
-    if (app)
-        __set_app_feature(app, appid, name, proto, src_port, dport_info, host_url, request_url, dict);
-    else
-        __add_app_feature(appid, name, proto, src_port, dport_info, host_url, request_url, dict);
-    return 0;
+    return __add_app_feature(t, appid, name, proto, src_port, dport_info, host_url, request_url, dict);
 }
 
-static int pc_add_app(int appid, const char *name, const char *feature)
+int pc_add_app_by_str(pc_app_table_t *t, int appid, const char *name, const char *feature)
 {
-    return parse_app_str(NULL, appid, name, feature);
+    return parse_app_str(t, appid, name, feature);
 }
 
-int pc_set_app_by_str(pc_app_t *app, int appid, const char *name, const char *feature)
-{
-    return parse_app_str(app, appid, name, feature);
-}
-
-static void pc_init_feature(char *feature_str)
+static void pc_init_feature(pc_app_table_t *t, char *feature_str)
 {
     int app_id;
     char app_name[128] = {0};
@@ -268,14 +362,14 @@ static void pc_init_feature(char *feature_str)
             memset(feature, 0x0, sizeof(feature));
             strncpy((char *)feature, begin, p - begin);
 
-            pc_add_app(app_id, app_name, feature);
+            pc_add_app_by_str(t, app_id, app_name, feature);
             begin = p + 1;
         }
     }
     if (p != begin) {
         memset(feature, 0x0, sizeof(feature));
         strncpy((char *)feature, begin, p - begin);
-        pc_add_app(app_id, app_name, feature);
+        pc_add_app_by_str(t, app_id, app_name, feature);
     }
 }
 
@@ -299,7 +393,7 @@ static void load_feature_buf_from_file(char **config_buf)
     if (size == 0) {
         return;
     }
-    *config_buf = (char *)kzalloc(sizeof(char) * size, GFP_KERNEL);
+    *config_buf = (char *)kzalloc(sizeof(char) * (size + 1), GFP_KERNEL);
     if (NULL == *config_buf) {
         PC_ERROR("alloc buf fail\n");
         filp_close(fp, NULL);
@@ -323,17 +417,43 @@ static void load_feature_buf_from_file(char **config_buf)
     filp_close(fp, NULL);
 }
 
-int pc_load_app_feature_list(void)
+static void pc_set_app_table(pc_app_table_t *t)
 {
-    char *feature_buf = NULL;
+    pc_app_table_t *old = rcu_dereference_protected(pc_app_table, 1);
+
+    rcu_assign_pointer(pc_app_table, t);
+    if (old != &pc_app_empty) {
+        synchronize_rcu();
+        pc_free_app_table(old);
+    }
+}
+
+// a feature ends at a ',' or at the end of its line
+static int pc_count_feature(const char *feature_buf)
+{
+    const char *p;
+    int num = 1;
+
+    for (p = feature_buf; *p; p++) {
+        if (*p == ',' || *p == '\n')
+            num++;
+    }
+    return num;
+}
+
+// build the feature table from a NUL terminated app_feature.cfg buffer
+int pc_load_app_feature_buf(char *feature_buf)
+{
+    pc_app_table_t *t, *tight;
     char *p;
     char *begin;
     char line[MAX_FEATURE_LINE_LEN] = {0};
+    int i, j;
 
-    load_feature_buf_from_file(&feature_buf);
-    if (!feature_buf) {
-        PC_ERROR("no app feature load\n");
-        return 0;
+    t = pc_new_app_table(pc_count_feature(feature_buf));
+    if (!t) {
+        PC_ERROR("malloc feature table error\n");
+        return -1;
     }
     p = begin = feature_buf;
     while (*p++) {
@@ -344,63 +464,180 @@ int pc_load_app_feature_list(void)
             }
             memset(line, 0x0, sizeof(line));
             strncpy(line, begin, p - begin);
-            pc_init_feature(line);
+            pc_init_feature(t, line);
             begin = p + 1;
         }
     }
-    if (p != begin) {
-        if (p - begin < MIN_FEATURE_LINE_LEN || p - begin > MAX_FEATURE_LINE_LEN)
-            return 0;
+    if (p != begin && p - begin >= MIN_FEATURE_LINE_LEN && p - begin <= MAX_FEATURE_LINE_LEN) {
         memset(line, 0x0, sizeof(line));
         strncpy(line, begin, p - begin);
-        pc_init_feature(line);
+        pc_init_feature(t, line);
         begin = p + 1;
     }
-    if (feature_buf)
-        kfree(feature_buf);
+    if (t->num == 0) {
+        pc_free_app_table(t);
+        return 0;
+    }
+    // the later lines of the file take precedence, they are tried first
+    for (i = 0, j = t->num - 1; i < j; i++, j--)
+        swap(t->apps[i], t->apps[j]);
+    // give back the slots counted for comments and invalid features
+    tight = pc_new_app_table(t->num);
+    if (tight) {
+        memcpy(tight->apps, t->apps, t->num * sizeof(pc_app_t));
+        tight->num = t->num;
+        tight->strs = t->strs;
+        kvfree(t);
+        t = tight;
+    }
+    pc_set_app_table(t);
     return 0;
 }
 
-void pc_clean_app_feature_list(void)
+int pc_load_app_feature_list(void)
 {
-    pc_app_t *node;
-    pc_app_write_lock();
-    while (!list_empty(&pc_app_head)) {
-        node = list_first_entry(&pc_app_head, pc_app_t, head);
-        list_del(&(node->head));
-        kfree(node);
+    char *feature_buf = NULL;
+    int ret;
+
+    load_feature_buf_from_file(&feature_buf);
+    if (!feature_buf) {
+        PC_ERROR("no app feature load\n");
+        return 0;
     }
-    pc_app_write_unlock();
+    ret = pc_load_app_feature_buf(feature_buf);
+    kfree(feature_buf);
+    return ret;
+}
+
+void pc_clean_app_feature_list(void)
+{
+    pc_set_app_table(&pc_app_empty);
 }
 
 int app_proc_show(struct seq_file *s, void *v)
 {
-    pc_app_t *app = NULL, *n;
+    pc_app_table_t *t;
+    pc_app_t *app = NULL;
     range_value_t port_range;
     int i = 0;
     seq_printf(s, "ID\tName\tProto\tSport\tDport\tHost_url\tRequest_url\tDataDictionary\n");
-    pc_app_read_lock();
-    if (!list_empty(&pc_app_head)) {
-        list_for_each_entry_safe(app, n, &pc_app_head, head) {
-            seq_printf(s, "%d\t%s\t%d\t%d\t", app->app_id, app->app_name, app->proto, app->sport);
-            for (i = 0; i < app->dport_info.num; i++) {
-                port_range = app->dport_info.range_list[i];
-                (i == 0) ? seq_printf(s, "%s", port_range.not ? "!" : "") :
-                seq_printf(s, "%s", port_range.not ? "|!" : "|");
-                (port_range.start == port_range.end) ?
-                seq_printf(s, "%d", port_range.start) :
-                seq_printf(s, "%d-%d", port_range.start, port_range.end);
-            }
-            if (app->dport_info.num)
-                seq_printf(s, "\t");
-            seq_printf(s, "%s\t%s", app->host_url, app->request_url);
+    rcu_read_lock();
+    t = rcu_dereference(pc_app_table);
+    pc_for_each_app(app, t) {
+        seq_printf(s, "%d\t%s\t%d\t%d\t", app->app_id, app->app_name, app->proto, app->sport);
+        for (i = 0; i < app->dport_info.num; i++) {
+            port_range = app->dport_info.range_list[i];
+            (i == 0) ? seq_printf(s, "%s", port_range.not ? "!" : "") :
+            seq_printf(s, "%s", port_range.not ? "|!" : "|");
+            (port_range.start == port_range.end) ?
+            seq_printf(s, "%d", port_range.start) :
+            seq_printf(s, "%d-%d", port_range.start, port_range.end);
+        }
+        if (app->dport_info.num)
+            seq_printf(s, "\t");
+        seq_printf(s, "%s\t%s", app->host_url, app->request_url);
 
-            for (i = 0; i < app->pos_num; i++) {
-                seq_printf(s, "%s[%d]=0x%x", (i == 0) ? "\t" : "&&", app->pos_info[i].pos, app->pos_info[i].value);
-            }
-            seq_printf(s, "\n");
+        for (i = 0; i < app->pos_num; i++) {
+            seq_printf(s, "%s[%d]=0x%x", (i == 0) ? "\t" : "&&", app->pos_info[i].pos, app->pos_info[i].value);
         }
+        seq_printf(s, "\n");
     }
-    pc_app_read_unlock();
+    rcu_read_unlock();
     return 0;
-}
\ No newline at end of file
+}
+
+static void pc_test_app_reset(pc_app_table_t *t)
+{
+    pc_app_table_clean(t);
+    memset(t->apps, 0, t->size * sizeof(pc_app_t));
+}
+
+static void pc_test_app_flow(flow_info_t *flow, unsigned char *data, int len)
+{
+    memset(flow, 0, sizeof(flow_info_t));
+    flow->l4_protocol = IPPROTO_UDP;
+    flow->l4_data = data;
+    flow->l4_len = len;
+    flow->total_len = len;
+}
+
+void TEST_app(void)
+{
+    pc_app_table_t *t;
+    pc_app_t *app;
+    flow_info_t flow;
+    unsigned char data[32] = {0x73, 0xea, 0x68, 0xfb};
+
+    t = pc_new_app_table(2);
+    if (!PC_TEST(t != NULL))
+        return;
+    app = &t->apps[0];
+
+    // host and request url
+    PC_TEST(pc_add_app_by_str(t, 8001, "Google", "tcp;;;www.google.com;/search;") == 0);
+    PC_TEST(app->app_id == 8001 && app->proto == IPPROTO_TCP && app->sport == 0);
+    PC_TEST(!strcmp(app->host_url, "www.google.com") && app->host_re != NULL);
+    PC_TEST(!strcmp(app->request_url, "/search") && app->request_re != NULL);
+    PC_TEST(app->dport_info.num == 0 && app->pos_num == 0 && app->match == PC_APP_MATCH_URL);
+    PC_TEST(pc_match_port(&app->dport_info, 443));
+
+    // the features of an app share its name, a full table takes no more
+    PC_TEST(pc_add_app_by_str(t, 8001, "Google", "tcp;;443;;;") == 0);
+    PC_TEST(t->num == 2 && t->apps[1].app_name == app->app_name && t->apps[1].host_url[0] == '\0');
+    PC_TEST(t->apps[1].match == PC_APP_MATCH_PORT);
+    PC_TEST(pc_add_app_by_str(t, 8001, "Google", "tcp;;80;;;") != 0 && t->num == 2);
+    pc_test_app_reset(t);
+
+    // port ranges and a source port
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "udp;8001;8000-8010|9000;;;") == 0);
+    PC_TEST(app->proto == IPPROTO_UDP && app->sport == 8001 && app->dport_info.num == 2);
+    PC_TEST(pc_match_port(&app->dport_info, 8000) && pc_match_port(&app->dport_info, 8010));
+    PC_TEST(pc_match_port(&app->dport_info, 9000));
+    PC_TEST(!pc_match_port(&app->dport_info, 7999) && !pc_match_port(&app->dport_info, 8011));
+    pc_test_app_reset(t);
+
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "tcp;;!80|!443;;;") == 0);
+    PC_TEST(!pc_match_port(&app->dport_info, 80) && !pc_match_port(&app->dport_info, 443));
+    PC_TEST(pc_match_port(&app->dport_info, 8080));
+    pc_test_app_reset(t);
+
+    // more ranges than a feature holds are dropped
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "tcp;;1|2|3|4|5|6|7|8;;;") == 0);
+    PC_TEST(app->dport_info.num == MAX_PORT_RANGE_NUM);
+    pc_test_app_reset(t);
+
+    // data dictionary, -1 is the last byte of the payload
+    PC_TEST(pc_add_app_by_str(t, 4005, "mogu", "udp;;;;;00:73|01:ea|-1:03") == 0);
+    PC_TEST(app->pos_num == 3 && app->pos_info[2].pos == -1 && app->pos_info[2].value == 0x03);
+    PC_TEST(app->match == PC_APP_MATCH_POS);
+    data[sizeof(data) - 1] = 0x03;
+    pc_test_app_flow(&flow, data, sizeof(data));
+    PC_TEST(pc_match_by_pos(&flow, app));
+    PC_TEST_BENCH("pc_match_by_pos", 1000000, pc_test_sink = pc_match_by_pos(&flow, app));
+    flow.total_len = sizeof(data) + 100;
+    PC_TEST(!pc_match_by_pos(&flow, app));
+    pc_test_app_flow(&flow, data, 1);
+    PC_TEST(!pc_match_by_pos(&flow, app));
+    data[1] = 0;
+    pc_test_app_flow(&flow, data, sizeof(data));
+    PC_TEST(!pc_match_by_pos(&flow, app));
+    pc_test_app_reset(t);
+
+    PC_TEST(pc_add_app_by_str(t, 1, "a",
+                              "tcp;;;;;0:1|1:1|2:1|3:1|4:1|5:1|6:1|7:1|8:1|9:1|10:1|11:1|12:1|13:1|14:1|15:1|16:1|17:1") == 0);
+    PC_TEST(app->pos_num == MAX_POS_INFO_PER_FEATURE);
+    pc_test_app_reset(t);
+
+    // invalid features
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "icmp;;;;;") != 0);
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "tcp;;80;baidu.com") != 0);
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "tcp;;70000;;;") == 0 && app->dport_info.num == 0);
+    pc_test_app_reset(t);
+
+    PC_TEST(pc_add_app_by_str(t, 1, "a", "tcp;;80|443|8000-9000;;;") == 0);
+    PC_TEST_BENCH("pc_match_port", 1000000, pc_test_sink = pc_match_port(&app->dport_info, 8443));
+    pc_test_app_reset(t);
+    PC_TEST_BENCH("parse_app_str", 10000,
+                  pc_test_sink = parse_app_str(t, 1, "a", "tcp;;443;googlevideo.com;;"); pc_test_app_reset(t));
+    pc_free_app_table(t);
+}
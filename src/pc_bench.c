@@ -0,0 +1,618 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/ctype.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/netfilter.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <linux/udp.h>
+#include "pc_policy.h"
+
+/*
+ * Synthetic load generator for the filter hook. It builds TLS ClientHellos,
+ * HTTP requests and payloads matching the pos features of the loaded apps,
+ * plus bulk data, and feeds them to pc_filter_hook_handle() from one kthread
+ * per CPU with BHs disabled, the way the FORWARD hook runs. The skbs carry
+ * no conntrack, so every packet takes the full MAC lookup, DPI and match.
+ *
+ *   echo "<seconds> [cpus]" > /proc/parental-control/bench
+ *   cat /proc/parental-control/bench
+ *
+ * A run is repeated with 1, 2, 4 ... cpus to show how the hook scales. The
+ * source MAC must be in a group, otherwise the hooks stay off and nothing
+ * but the static key is measured.
+ */
+#define PC_BENCH_SAMPLES 64
+#define PC_BENCH_BULK_LEN 1200
+#define PC_BENCH_MIN_POS_LEN 64
+#define PC_BENCH_MAX_POS_LEN 512
+#define PC_BENCH_MAX_SECONDS 600
+#define PC_BENCH_MAX_STEPS 16
+
+static char *pc_bench_mac = "02:00:00:00:be:0c";
+module_param_named(mac, pc_bench_mac, charp, 0444);
+MODULE_PARM_DESC(mac, "source MAC of the generated packets");
+static char *pc_bench_devname = "lo";
+module_param_named(dev, pc_bench_devname, charp, 0444);
+MODULE_PARM_DESC(dev, "device the packets arrive on, must be in src_dev if it is set");
+
+enum pc_bench_kind {
+    PC_BENCH_TLS,
+    PC_BENCH_HTTP,
+    PC_BENCH_POS,
+    PC_BENCH_BULK,
+    PC_BENCH_KIND_MAX,
+};
+
+static const char *pc_bench_kind_names[PC_BENCH_KIND_MAX] = {
+    "tls", "http", "pos", "bulk",
+};
+
+typedef struct pc_bench_sample {
+    int kind;
+    u8 proto;
+    u16 sport;
+    u16 dport;
+    int len;
+    char host[MAX_URL_MATCH_LEN];
+    u8 data[PC_BENCH_MAX_POS_LEN];
+} pc_bench_sample_t;
+
+typedef struct pc_bench_worker {
+    struct task_struct *task;
+    int cpu;
+    int err;
+    u64 packets;
+    u64 drops;
+    u64 ns;
+} ____cacheline_aligned_in_smp pc_bench_worker_t;
+
+typedef struct pc_bench_step {
+    int cpus;
+    u64 pps;
+    u64 drops;
+    u64 packets;
+} pc_bench_step_t;
+
+static DEFINE_MUTEX(pc_bench_mutex);
+static u8 pc_bench_smac[ETH_ALEN];
+static struct net_device *pc_bench_dev;
+static struct sk_buff **pc_bench_tmpl;
+static int pc_bench_tmpl_num;
+static int pc_bench_kind_num[PC_BENCH_KIND_MAX];
+static atomic_t pc_bench_ready;
+static int pc_bench_go;
+static int pc_bench_stop;
+
+// results of the last run, shown by the proc file
+static pc_bench_step_t pc_bench_steps[PC_BENCH_MAX_STEPS];
+static int pc_bench_step_num;
+static u64 *pc_bench_cpu_pps;
+static int pc_bench_seconds;
+
+static int pc_bench_app_port(port_info_t *info, int def)
+{
+    if (info->num > 0 && info->mode == 0 && !info->range_list[0].not)
+        return info->range_list[0].start;
+    return def;
+}
+
+// the regex syntax of a host feature is dropped, what is left is matched as a substring
+static int pc_bench_app_host(char *host, const char *url)
+{
+    int n = 0;
+    for (; *url && n < MAX_URL_MATCH_LEN - 1; url++) {
+        if (isalnum(*url) || *url == '.' || *url == '-')
+            host[n++] = *url;
+    }
+    host[n] = '\0';
+    return n;
+}
+
+static int pc_bench_app_pos(pc_bench_sample_t *s, pc_app_t *app)
+{
+    int i, len = PC_BENCH_MIN_POS_LEN;
+
+    for (i = 0; i < app->pos_num; i++) {
+        if (app->pos_info[i].pos >= len)
+            len = app->pos_info[i].pos + 1;
+        else if (-app->pos_info[i].pos > len)
+            len = -app->pos_info[i].pos;
+    }
+    if (len > PC_BENCH_MAX_POS_LEN)
+        return -1;
+    get_random_bytes(s->data, len);
+    for (i = 0; i < app->pos_num; i++) {
+        if (app->pos_info[i].pos < 0)
+            s->data[len + app->pos_info[i].pos] = app->pos_info[i].value;
+        else
+            s->data[app->pos_info[i].pos] = app->pos_info[i].value;
+    }
+    s->len = len;
+    return 0;
+}
+
+static int pc_bench_add(pc_bench_sample_t *samples, int num, int kind)
+{
+    if (pc_bench_kind_num[kind] >= PC_BENCH_SAMPLES)
+        return num;
+    samples[num].kind = kind;
+    pc_bench_kind_num[kind]++;
+    return num + 1;
+}
+
+// pick the samples from the loaded features, at most PC_BENCH_SAMPLES of each kind
+static int pc_bench_collect(pc_bench_sample_t *samples)
+{
+    pc_app_table_t *t;
+    pc_app_t *app;
+    pc_bench_sample_t *s;
+    int num = 0, kind;
+
+    memset(pc_bench_kind_num, 0, sizeof(pc_bench_kind_num));
+    rcu_read_lock();
+    t = rcu_dereference(pc_app_table);
+    pc_for_each_app(app, t) {
+        s = &samples[num];
+        memset(s, 0, sizeof(*s));
+        s->sport = app->sport;
+        if (app->host_url[0]) {
+            if (pc_bench_app_host(s->host, app->host_url) == 0)
+                continue;
+            // alternate the apps between https and http
+            kind = PC_BENCH_TLS;
+            if (pc_bench_kind_num[PC_BENCH_TLS] > pc_bench_kind_num[PC_BENCH_HTTP])
+                kind = PC_BENCH_HTTP;
+            s->proto = IPPROTO_TCP;
+            s->dport = pc_bench_app_port(&app->dport_info, kind == PC_BENCH_TLS ? 443 : 80);
+            num = pc_bench_add(samples, num, kind);
+        } else if (app->pos_num > 0 && !app->request_url[0]) {
+            if (pc_bench_app_pos(s, app))
+                continue;
+            s->proto = app->proto == IPPROTO_TCP ? IPPROTO_TCP : IPPROTO_UDP;
+            s->dport = pc_bench_app_port(&app->dport_info, 40000);
+            num = pc_bench_add(samples, num, PC_BENCH_POS);
+        }
+        if (num == PC_BENCH_SAMPLES * (PC_BENCH_KIND_MAX - 1))
+            break;
+    }
+    rcu_read_unlock();
+
+    while (pc_bench_kind_num[PC_BENCH_BULK] < PC_BENCH_SAMPLES) {
+        s = &samples[num];
+        memset(s, 0, sizeof(*s));
+        s->proto = IPPROTO_TCP;
+        s->dport = 443;
+        num = pc_bench_add(samples, num, PC_BENCH_BULK);
+    }
+    return num;
+}
+
+static void pc_bench_put_u16(u8 *p, int v)
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static int pc_bench_tls_hello(u8 *p, const char *host)
+{
+    int hlen = strlen(host);
+    int ext_len = 9 + hlen;
+    int hs_len = 2 + 32 + 1 + 4 + 2 + 2 + ext_len;
+    u8 *q = p;
+
+    // record
+    *q++ = 0x16;
+    *q++ = 0x03;
+    *q++ = 0x01;
+    pc_bench_put_u16(q, 4 + hs_len);
+    q += 2;
+    // handshake
+    *q++ = 0x01;
+    *q++ = 0;
+    pc_bench_put_u16(q, hs_len);
+    q += 2;
+    *q++ = 0x03;
+    *q++ = 0x03;
+    get_random_bytes(q, 32);
+    q += 32;
+    *q++ = 0;
+    // cipher suites, compression
+    pc_bench_put_u16(q, 2);
+    q += 2;
+    *q++ = 0x13;
+    *q++ = 0x01;
+    *q++ = 1;
+    *q++ = 0;
+    // server_name extension
+    pc_bench_put_u16(q, ext_len);
+    q += 2;
+    pc_bench_put_u16(q, 0);
+    pc_bench_put_u16(q + 2, 5 + hlen);
+    pc_bench_put_u16(q + 4, 3 + hlen);
+    q[6] = 0;
+    pc_bench_put_u16(q + 7, hlen);
+    q += 9;
+    memcpy(q, host, hlen);
+    q += hlen;
+    return q - p;
+}
+
+static struct sk_buff *pc_bench_build_skb(pc_bench_sample_t *s, int idx, u8 *payload)
+{
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    struct iphdr *iph;
+    struct tcphdr *tcph;
+    struct udphdr *udph;
+    int l4_hlen, len;
+
+    switch (s->kind) {
+        case PC_BENCH_TLS:
+            len = pc_bench_tls_hello(payload, s->host);
+            break;
+        case PC_BENCH_HTTP:
+            len = scnprintf(payload, PC_BENCH_BULK_LEN,
+                            "GET / HTTP/1.1\r\nHost: %s\r\nUser-Agent: pc_bench\r\nAccept: */*\r\n\r\n", s->host);
+            break;
+        case PC_BENCH_POS:
+            len = s->len;
+            memcpy(payload, s->data, len);
+            break;
+        default:
+            len = PC_BENCH_BULK_LEN;
+            get_random_bytes(payload, len);
+            // TLS application data
+            payload[0] = 0x17;
+            break;
+    }
+
+    l4_hlen = s->proto == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr);
+    skb = alloc_skb(NET_IP_ALIGN + ETH_HLEN + sizeof(struct iphdr) + l4_hlen + len, GFP_KERNEL);
+    if (!skb)
+        return NULL;
+    skb_reserve(skb, NET_IP_ALIGN);
+
+    eth = (struct ethhdr *)skb_put(skb, ETH_HLEN);
+    eth_broadcast_addr(eth->h_dest);
+    memcpy(eth->h_source, pc_bench_smac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+    skb_reset_mac_header(skb);
+    skb_pull(skb, ETH_HLEN);
+
+    skb_reset_network_header(skb);
+    iph = (struct iphdr *)skb_put(skb, sizeof(struct iphdr));
+    memset(iph, 0, sizeof(struct iphdr));
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = s->proto;
+    iph->tot_len = htons(sizeof(struct iphdr) + l4_hlen + len);
+    iph->saddr = htonl(0xc0a80800 | (100 + idx % 100));    // 192.168.8.x
+    iph->daddr = htonl(0xcb007100 | (idx & 0xff));          // 203.0.113.x
+    ip_send_check(iph);
+
+    skb_set_transport_header(skb, sizeof(struct iphdr));
+    if (s->proto == IPPROTO_TCP) {
+        tcph = (struct tcphdr *)skb_put(skb, sizeof(struct tcphdr));
+        memset(tcph, 0, sizeof(struct tcphdr));
+        tcph->source = htons(s->sport ? s->sport : 32768 + idx);
+        tcph->dest = htons(s->dport);
+        tcph->seq = htonl(idx << 16);
+        tcph->doff = 5;
+        tcph->ack = 1;
+        tcph->psh = 1;
+        tcph->window = htons(502);
+    } else {
+        udph = (struct udphdr *)skb_put(skb, sizeof(struct udphdr));
+        udph->source = htons(s->sport ? s->sport : 32768 + idx);
+        udph->dest = htons(s->dport);
+        udph->len = htons(sizeof(struct udphdr) + len);
+        udph->check = 0;
+    }
+    memcpy(skb_put(skb, len), payload, len);
+    skb->protocol = htons(ETH_P_IP);
+    skb->dev = pc_bench_dev;
+    return skb;
+}
+
+static void pc_bench_free_skbs(struct sk_buff **skbs, int num)
+{
+    int i;
+    if (!skbs)
+        return;
+    for (i = 0; i < num; i++)
+        kfree_skb(skbs[i]);
+    kfree(skbs);
+}
+
+static int pc_bench_build(void)
+{
+    pc_bench_sample_t *samples;
+    u8 *payload;
+    int i, num;
+
+    samples = vmalloc(sizeof(pc_bench_sample_t) * PC_BENCH_SAMPLES * PC_BENCH_KIND_MAX);
+    payload = kmalloc(PC_BENCH_BULK_LEN, GFP_KERNEL);
+    if (!samples || !payload) {
+        vfree(samples);
+        kfree(payload);
+        return -ENOMEM;
+    }
+    num = pc_bench_collect(samples);
+    pc_bench_tmpl = kcalloc(num, sizeof(struct sk_buff *), GFP_KERNEL);
+    if (!pc_bench_tmpl) {
+        vfree(samples);
+        kfree(payload);
+        return -ENOMEM;
+    }
+    // interleave the kinds, the way they arrive from many clients
+    for (i = 0; i < num; i++) {
+        pc_bench_tmpl[i] = pc_bench_build_skb(&samples[(i * 7) % num], i, payload);
+        if (!pc_bench_tmpl[i])
+            break;
+    }
+    pc_bench_tmpl_num = i;
+    vfree(samples);
+    kfree(payload);
+    return i == num ? 0 : -ENOMEM;
+}
+
+static int pc_bench_thread(void *data)
+{
+    pc_bench_worker_t *w = data;
+    struct sk_buff **skbs;
+    u64 packets = 0, drops = 0;
+    ktime_t start;
+    int i, copied, n = pc_bench_tmpl_num;
+
+    // every CPU works on its own copies, allocated on its node
+    skbs = kcalloc(n, sizeof(struct sk_buff *), GFP_KERNEL);
+    for (copied = 0; skbs && copied < n; copied++) {
+        skbs[copied] = skb_copy(pc_bench_tmpl[copied], GFP_KERNEL);
+        if (!skbs[copied])
+            break;
+    }
+    if (!skbs || copied < n)
+        w->err = -ENOMEM;
+    atomic_inc(&pc_bench_ready);
+
+    while (!READ_ONCE(pc_bench_go) && !kthread_should_stop())
+        usleep_range(50, 100);
+    start = ktime_get();
+    while (!w->err && !READ_ONCE(pc_bench_stop)) {
+        local_bh_disable();
+        for (i = 0; i < n; i++) {
+            if (pc_filter_hook_handle(skbs[i], pc_bench_dev) == NF_DROP)
+                drops++;
+        }
+        local_bh_enable();
+        packets += n;
+        cond_resched();
+    }
+    w->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    w->packets = packets;
+    w->drops = drops;
+    pc_bench_free_skbs(skbs, copied);
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+    return 0;
+}
+
+static int pc_bench_run(int cpus, int seconds, pc_bench_step_t *step)
+{
+    pc_bench_worker_t *workers;
+    int cpu, i, n = 0, err = 0;
+
+    workers = kcalloc(cpus, sizeof(pc_bench_worker_t), GFP_KERNEL);
+    if (!workers)
+        return -ENOMEM;
+    atomic_set(&pc_bench_ready, 0);
+    WRITE_ONCE(pc_bench_go, 0);
+    WRITE_ONCE(pc_bench_stop, 0);
+
+    for_each_online_cpu(cpu) {
+        if (n == cpus)
+            break;
+        workers[n].cpu = cpu;
+        workers[n].task = kthread_create_on_node(pc_bench_thread, &workers[n], cpu_to_node(cpu),
+                          "pc_bench/%d", cpu);
+        if (IS_ERR(workers[n].task)) {
+            err = PTR_ERR(workers[n].task);
+            break;
+        }
+        kthread_bind(workers[n].task, cpu);
+        wake_up_process(workers[n].task);
+        n++;
+    }
+    if (!err) {
+        while (atomic_read(&pc_bench_ready) < n)
+            msleep(1);
+        WRITE_ONCE(pc_bench_go, 1);
+        msleep_interruptible(seconds * 1000);
+    }
+    WRITE_ONCE(pc_bench_stop, 1);
+    for (i = 0; i < n; i++)
+        kthread_stop(workers[i].task);
+
+    memset(step, 0, sizeof(*step));
+    step->cpus = n;
+    for (i = 0; i < n; i++) {
+        if (workers[i].err)
+            err = workers[i].err;
+        if (!workers[i].ns)
+            continue;
+        pc_bench_cpu_pps[workers[i].cpu] = div64_u64(workers[i].packets * NSEC_PER_SEC, workers[i].ns);
+        step->pps += pc_bench_cpu_pps[workers[i].cpu];
+        step->packets += workers[i].packets;
+        step->drops += workers[i].drops;
+    }
+    kfree(workers);
+    return err;
+}
+
+static ssize_t pc_bench_proc_write(struct file *file, const char __user *buffer, size_t count, loff_t *pos)
+{
+    char buf[32] = {0};
+    int seconds, cpus = 0, n, err;
+
+    if (copy_from_user(buf, buffer, min(count, sizeof(buf) - 1)))
+        return -EFAULT;
+    n = sscanf(buf, "%d %d", &seconds, &cpus);
+    if (n < 1 || seconds <= 0 || seconds > PC_BENCH_MAX_SECONDS)
+        return -EINVAL;
+    if (cpus <= 0 || cpus > num_online_cpus())
+        cpus = num_online_cpus();
+    if (!mutex_trylock(&pc_bench_mutex))
+        return -EBUSY;
+
+    pc_bench_dev = dev_get_by_name(&init_net, pc_bench_devname);
+    if (!pc_bench_dev) {
+        PC_ERROR("pc_bench: no device %s\n", pc_bench_devname);
+        err = -ENODEV;
+        goto unlock;
+    }
+    err = pc_bench_build();
+    if (err)
+        goto free;
+
+    pc_bench_step_num = 0;
+    pc_bench_seconds = seconds;
+    memset(pc_bench_cpu_pps, 0, sizeof(u64) * nr_cpu_ids);
+    for (n = 1; pc_bench_step_num < PC_BENCH_MAX_STEPS; n = min(n * 2, cpus)) {
+        PC_INFO("pc_bench: %d packets on %d cpus for %ds\n", pc_bench_tmpl_num, n, seconds);
+        err = pc_bench_run(n, seconds, &pc_bench_steps[pc_bench_step_num]);
+        if (err)
+            break;
+        pc_bench_step_num++;
+        if (n == cpus || signal_pending(current))
+            break;
+    }
+
+free:
+    pc_bench_free_skbs(pc_bench_tmpl, pc_bench_tmpl_num);
+    pc_bench_tmpl = NULL;
+    pc_bench_tmpl_num = 0;
+    dev_put(pc_bench_dev);
+    pc_bench_dev = NULL;
+unlock:
+    mutex_unlock(&pc_bench_mutex);
+    return err ? err : count;
+}
+
+static void pc_bench_show_mpps(struct seq_file *s, u64 pps)
+{
+    seq_printf(s, "%llu.%03llu", pps / 1000000, (pps % 1000000) / 1000);
+}
+
+static int pc_bench_proc_show(struct seq_file *s, void *v)
+{
+    pc_bench_step_t *step;
+    int i, cpu;
+
+    mutex_lock(&pc_bench_mutex);
+    if (!pc_bench_step_num) {
+        seq_printf(s, "no result, echo \"<seconds> [cpus]\" to run\n");
+        goto out;
+    }
+    seq_printf(s, "mac %pM dev %s, %ds per step\n", pc_bench_smac, pc_bench_devname, pc_bench_seconds);
+    seq_printf(s, "packets:");
+    for (i = 0; i < PC_BENCH_KIND_MAX; i++)
+        seq_printf(s, " %s %d", pc_bench_kind_names[i], pc_bench_kind_num[i]);
+    seq_printf(s, "\n\ncpus\tMpps\tMpps/cpu\tscaling\tdrop\n");
+    for (i = 0; i < pc_bench_step_num; i++) {
+        step = &pc_bench_steps[i];
+        seq_printf(s, "%d\t", step->cpus);
+        pc_bench_show_mpps(s, step->pps);
+        seq_printf(s, "\t");
+        pc_bench_show_mpps(s, div_u64(step->pps, step->cpus));
+        seq_printf(s, "\t\t%llu%%\t%llu%%\n",
+                   pc_bench_steps[0].pps ? div64_u64(step->pps * 100, pc_bench_steps[0].pps * step->cpus) : 0,
+                   step->packets ? div64_u64(step->drops * 100, step->packets) : 0);
+    }
+    seq_printf(s, "\ncpu\tMpps\n");
+    for_each_possible_cpu(cpu) {
+        if (!pc_bench_cpu_pps[cpu])
+            continue;
+        seq_printf(s, "%d\t", cpu);
+        pc_bench_show_mpps(s, pc_bench_cpu_pps[cpu]);
+        seq_printf(s, "\n");
+    }
+out:
+    mutex_unlock(&pc_bench_mutex);
+    return 0;
+}
+
+static int pc_bench_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, pc_bench_proc_show, NULL);
+}
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 5, 0)
+static const struct file_operations pc_bench_fops = {
+    .owner = THIS_MODULE,
+    .open = pc_bench_proc_open,
+    .read = seq_read,
+    .write = pc_bench_proc_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+#else
+static const struct proc_ops pc_bench_fops = {
+    .proc_read = seq_read,
+    .proc_write = pc_bench_proc_write,
+    .proc_open = pc_bench_proc_open,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+#endif
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("parental control filter benchmark");
+
+static int __init pc_bench_init(void)
+{
+    if (!mac_pton(pc_bench_mac, pc_bench_smac)) {
+        PC_ERROR("pc_bench: invalid mac %s\n", pc_bench_mac);
+        return -EINVAL;
+    }
+    pc_bench_cpu_pps = kcalloc(nr_cpu_ids, sizeof(u64), GFP_KERNEL);
+    if (!pc_bench_cpu_pps)
+        return -ENOMEM;
+    if (!proc_create("parental-control/bench", 0644, NULL, &pc_bench_fops)) {
+        PC_ERROR("pc_bench: can't create /proc/parental-control/bench\n");
+        kfree(pc_bench_cpu_pps);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void __exit pc_bench_exit(void)
+{
+    remove_proc_entry("parental-control/bench", NULL);
+    kfree(pc_bench_cpu_pps);
+}
+
+module_init(pc_bench_init);
+module_exit(pc_bench_exit);
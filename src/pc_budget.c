@@ -0,0 +1,170 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <net/netfilter/nf_conntrack.h>
+#include "pc_policy.h"
+
+/*
+ * DPI budget of the flows under inspection: the number of packets handed
+ * to DPI in each direction. A flow that has not matched an app after
+ * MAX_DPI_PKT_NUM of them is finished as unknown.
+ *
+ * Entries are keyed by the conntrack and its original tuple and hold no
+ * reference, a conntrack freed and reallocated at the same address for
+ * another connection does not find the old entry. An entry goes away when
+ * its flow gets a verdict, or after PC_BUDGET_IDLE without a packet for DPI.
+ * When the table is full a new flow is inspected without a budget.
+ */
+#define PC_BUDGET_HASH_BITS 8
+#define PC_BUDGET_MAX_NUM 4096
+#define PC_BUDGET_IDLE (30 * HZ)
+
+typedef struct pc_budget {
+    struct hlist_node node;
+    struct nf_conn *ct;
+    struct nf_conntrack_tuple tuple;
+    unsigned long last;
+    u_int16_t packets[IP_CT_DIR_MAX];
+} pc_budget_t;
+
+typedef struct pc_budget_bucket {
+    spinlock_t lock;
+    struct hlist_head head;
+} ____cacheline_aligned_in_smp pc_budget_bucket_t;
+
+static pc_budget_bucket_t pc_budget_hash[1 << PC_BUDGET_HASH_BITS];
+static atomic_t pc_budget_num = ATOMIC_INIT(0);
+
+static void pc_budget_gc(struct work_struct *work);
+static DECLARE_DELAYED_WORK(pc_budget_gc_work, pc_budget_gc);
+
+static inline pc_budget_bucket_t *pc_budget_bucket(struct nf_conn *ct)
+{
+    return &pc_budget_hash[hash_ptr(ct, PC_BUDGET_HASH_BITS)];
+}
+
+// called with the bucket lock held
+static pc_budget_t *pc_budget_find(pc_budget_bucket_t *b, struct nf_conn *ct)
+{
+    pc_budget_t *e;
+    hlist_for_each_entry(e, &b->head, node) {
+        if (e->ct == ct && nf_ct_tuple_equal(&e->tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple))
+            return e;
+    }
+    return NULL;
+}
+
+static void pc_budget_free(pc_budget_t *e)
+{
+    hlist_del(&e->node);
+    atomic_dec(&pc_budget_num);
+    kfree(e);
+}
+
+static void pc_budget_gc(struct work_struct *work)
+{
+    pc_budget_bucket_t *b;
+    pc_budget_t *e;
+    struct hlist_node *n;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pc_budget_hash); i++) {
+        b = &pc_budget_hash[i];
+        if (hlist_empty(&b->head))
+            continue;
+        spin_lock_bh(&b->lock);
+        hlist_for_each_entry_safe(e, n, &b->head, node) {
+            if (time_after(jiffies, e->last + PC_BUDGET_IDLE))
+                pc_budget_free(e);
+        }
+        spin_unlock_bh(&b->lock);
+    }
+    if (atomic_read(&pc_budget_num))
+        schedule_delayed_work(&pc_budget_gc_work, PC_BUDGET_IDLE);
+}
+
+void pc_budget_init(void)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(pc_budget_hash); i++) {
+        spin_lock_init(&pc_budget_hash[i].lock);
+        INIT_HLIST_HEAD(&pc_budget_hash[i].head);
+    }
+}
+
+/*
+ * Count a packet of the flow that is about to go through DPI.
+ * Return PC_FALSE when the flow already used its budget in this direction.
+ */
+int pc_budget_take(struct nf_conn *ct, int dir)
+{
+    pc_budget_bucket_t *b = pc_budget_bucket(ct);
+    pc_budget_t *e;
+    int ret = PC_TRUE;
+
+    spin_lock_bh(&b->lock);
+    e = pc_budget_find(b, ct);
+    if (!e) {
+        if (atomic_inc_return(&pc_budget_num) > PC_BUDGET_MAX_NUM) {
+            atomic_dec(&pc_budget_num);
+            spin_unlock_bh(&b->lock);
+            PC_LMT_DEBUG("dpi budget table full\n");
+            return PC_TRUE;
+        }
+        e = kzalloc(sizeof(pc_budget_t), GFP_ATOMIC);
+        if (!e) {
+            atomic_dec(&pc_budget_num);
+            spin_unlock_bh(&b->lock);
+            return PC_TRUE;
+        }
+        e->ct = ct;
+        e->tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+        hlist_add_head(&e->node, &b->head);
+        schedule_delayed_work(&pc_budget_gc_work, PC_BUDGET_IDLE);
+    }
+    e->last = jiffies;
+    if (e->packets[dir] >= MAX_DPI_PKT_NUM)
+        ret = PC_FALSE;
+    else
+        e->packets[dir]++;
+    spin_unlock_bh(&b->lock);
+    return ret;
+}
+
+// the flow has a verdict and is not inspected any more
+void pc_budget_done(struct nf_conn *ct)
+{
+    pc_budget_bucket_t *b = pc_budget_bucket(ct);
+    pc_budget_t *e;
+
+    if (!atomic_read(&pc_budget_num) || hlist_empty(&b->head))
+        return;
+    spin_lock_bh(&b->lock);
+    e = pc_budget_find(b, ct);
+    if (e)
+        pc_budget_free(e);
+    spin_unlock_bh(&b->lock);
+}
+
+void pc_budget_exit(void)
+{
+    pc_budget_bucket_t *b;
+    pc_budget_t *e;
+    struct hlist_node *n;
+    int i;
+
+    cancel_delayed_work_sync(&pc_budget_gc_work);
+    for (i = 0; i < ARRAY_SIZE(pc_budget_hash); i++) {
+        b = &pc_budget_hash[i];
+        spin_lock_bh(&b->lock);
+        hlist_for_each_entry_safe(e, n, &b->head, node)
+            pc_budget_free(e);
+        spin_unlock_bh(&b->lock);
+    }
+}
@@ -41,7 +41,7 @@ enum PC_CONFIG_CMD {
 
 static int pc_set_base_config(cJSON *data_obj)
 {
-    cJSON *aouobj = NULL, *srcobj = NULL;
+    cJSON *aouobj = NULL, *srcobj = NULL, *bridgeobj = NULL;
     if (!data_obj) {
         PC_ERROR("data obj is null\n");
         return -1;
@@ -58,7 +58,11 @@ static int pc_set_base_config(cJSON *data_obj)
         PC_ERROR("srcobj obj is null\n");
         return -1;
     }
-    strncpy(pc_src_dev, srcobj->valuestring, MAX_SRC_DEVNAME_SIZE - 1);
+    pc_filter_set_src_dev(srcobj->valuestring);
+
+    bridgeobj = cJSON_GetObjectItem(data_obj, "bridge");
+    pc_filter_set_bridge(bridgeobj ? bridgeobj->valueint : 0);
+    pc_policy_changed();
     return 0;
 }
 
@@ -0,0 +1,735 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/in.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+#include <linux/udp.h>
+#include "pc_policy.h"
+
+/*
+ * Packet parsing, HTTP/TLS extraction and app matching. Nothing in here
+ * touches netfilter, so the same code also builds in userspace for
+ * tools/pc-bench.
+ */
+DEFINE_PER_CPU_ALIGNED(struct pc_stats, pc_stats);
+
+/*
+ * With GRO and scatter-gather the payload is often not in the linear area,
+ * the first PC_DPI_WINDOW_LEN bytes of it are then copied here, which is
+ * all the parsers look at. Only used from the hook in softirq context.
+ */
+struct pc_dpi_window {
+    unsigned char data[PC_DPI_WINDOW_LEN];
+};
+static DEFINE_PER_CPU(struct pc_dpi_window, pc_dpi_window);
+
+static int pc_flow_payload(struct sk_buff *skb, flow_info_t *flow, int off, int len)
+{
+    unsigned char *buf;
+
+    if (len > skb->len - off)
+        len = skb->len - off;
+    if (len <= 0) {
+        flow->l4_data = NULL;
+        flow->l4_len = 0;
+        return 0;
+    }
+    flow->total_len = len;
+    if (len > PC_DPI_WINDOW_LEN)
+        len = PC_DPI_WINDOW_LEN;
+    if (off + len <= skb_headlen(skb)) {
+        flow->l4_data = skb->data + off;
+        flow->l4_len = len;
+        return 0;
+    }
+    buf = this_cpu_ptr(&pc_dpi_window)->data;
+    if (skb_copy_bits(skb, off, buf, len))
+        return -1;
+    flow->l4_data = buf;
+    flow->l4_len = len;
+    return 0;
+}
+
+// off: transport header offset, len: transport length from the IP header
+static int parse_flow_l4(struct sk_buff *skb, flow_info_t *flow, int off, int len)
+{
+    struct tcphdr _tcph, *tcph = NULL;
+    struct udphdr _udph, *udph = NULL;
+    switch (flow->l4_protocol) {
+        case IPPROTO_TCP:
+            tcph = skb_header_pointer(skb, off, sizeof(_tcph), &_tcph);
+            if (!tcph || tcph->doff < 5)
+                return -1;
+            flow->dport = htons(tcph->dest);
+            flow->sport = htons(tcph->source);
+            flow->seq = ntohl(tcph->seq);
+            flow->syn = tcph->syn && !tcph->ack;
+            return pc_flow_payload(skb, flow, off + tcph->doff * 4, len - tcph->doff * 4);
+        case IPPROTO_UDP:
+            udph = skb_header_pointer(skb, off, sizeof(_udph), &_udph);
+            if (!udph)
+                return -1;
+            flow->dport = htons(udph->dest);
+            flow->sport = htons(udph->source);
+            return pc_flow_payload(skb, flow, off + sizeof(_udph),
+                                   min_t(int, len, ntohs(udph->len)) - (int)sizeof(_udph));
+        default:
+            return -1;
+    }
+}
+
+#if IS_ENABLED(CONFIG_IPV6)
+static int parse_flow_proto6(struct sk_buff *skb, flow_info_t *flow)
+{
+    struct ipv6hdr *ip6h = ipv6_hdr(skb);
+    u8 nexthdr;
+    __be16 frag_off;
+    int off, len;
+    if (!ip6h)
+        return -1;
+    flow->family = NFPROTO_IPV6;
+    flow->src6 = ip6h->saddr;
+    flow->dst6 = ip6h->daddr;
+    nexthdr = ip6h->nexthdr;
+    off = ipv6_skip_exthdr(skb, skb_network_offset(skb) + sizeof(struct ipv6hdr), &nexthdr, &frag_off);
+    // later fragments carry no transport header
+    if (off < 0 || (frag_off & htons(~0x7)))
+        return -1;
+    flow->l4_protocol = nexthdr;
+    len = ntohs(ip6h->payload_len) + sizeof(struct ipv6hdr) - (off - skb_network_offset(skb));
+    return parse_flow_l4(skb, flow, off, len);
+}
+#else
+static int parse_flow_proto6(struct sk_buff *skb, flow_info_t *flow)
+{
+    return -1;
+}
+#endif
+
+int parse_flow_proto(struct sk_buff *skb, flow_info_t *flow)
+{
+    struct iphdr *iph = NULL;
+    if (!skb)
+        return -1;
+    iph = ip_hdr(skb);
+    if (!iph)
+        return -1;
+    if (iph->version == 6)
+        return parse_flow_proto6(skb, flow);
+    if (iph->version != 4 || iph->ihl < 5)
+        return -1;
+    // later fragments carry no transport header
+    if (iph->frag_off & htons(IP_OFFSET))
+        return -1;
+    flow->family = NFPROTO_IPV4;
+    flow->src = iph->saddr;
+    flow->dst = iph->daddr;
+    flow->l4_protocol = iph->protocol;
+    return parse_flow_l4(skb, flow, skb_network_offset(skb) + iph->ihl * 4,
+                         ntohs(iph->tot_len) - iph->ihl * 4);
+}
+
+static inline int tls_get_u16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline int tls_get_u24(const unsigned char *p)
+{
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+// server_name extension: list_len(2) { name_type(1) name_len(2) name }
+static void tls_parse_sni(flow_info_t *flow, unsigned char *p, int len)
+{
+    int list_len, name_len;
+
+    if (len < 2)
+        return;
+    list_len = tls_get_u16(p);
+    p += 2;
+    len = min(len - 2, list_len);
+    while (len >= 3) {
+        name_len = tls_get_u16(p + 1);
+        if (name_len > len - 3)
+            return;
+        if (p[0] == TLS_SNI_HOST_NAME && name_len > 0) {
+            flow->https.match = PC_TRUE;
+            flow->https.url_pos = (char *)p + 3;
+            flow->https.url_len = name_len;
+            return;
+        }
+        p += 3 + name_len;
+        len -= 3 + name_len;
+    }
+}
+
+// alpn extension: list_len(2) { proto_len(1) proto }, keep the first protocol
+static void tls_parse_alpn(flow_info_t *flow, unsigned char *p, int len)
+{
+    int list_len;
+
+    if (len < 3)
+        return;
+    list_len = tls_get_u16(p);
+    if (list_len > len - 2 || p[2] == 0 || p[2] > list_len - 1)
+        return;
+    flow->https.alpn_pos = (char *)p + 3;
+    flow->https.alpn_len = p[2];
+}
+
+/*
+ * Walk a ClientHello handshake message field by field down to the
+ * extensions. It may be cut short by the end of the packet, extensions
+ * past len are ignored, everything before them is still used.
+ */
+int dpi_tls_client_hello(flow_info_t *flow, unsigned char *p, int len)
+{
+    unsigned char *end = p + len;
+    int ext_type;
+
+    // handshake: type(1) length(3)
+    if (len < TLS_HANDSHAKE_HDR_LEN || p[0] != TLS_HANDSHAKE_CLIENT_HELLO)
+        return -1;
+    len = tls_get_u24(p + 1);
+    p += TLS_HANDSHAKE_HDR_LEN;
+    if (len < end - p)
+        end = p + len;
+
+    // client_version(2) random(32) session_id(1 + n)
+    p += 2 + TLS_RANDOM_LEN;
+    if (end - p < 1)
+        return -1;
+    p += 1 + p[0];
+    // cipher_suites(2 + n)
+    if (end - p < 2)
+        return -1;
+    p += 2 + tls_get_u16(p);
+    // compression_methods(1 + n)
+    if (end - p < 1)
+        return -1;
+    p += 1 + p[0];
+    // extensions(2 + n)
+    if (end - p < 2)
+        return -1;
+    len = tls_get_u16(p);
+    p += 2;
+    if (len < end - p)
+        end = p + len;
+
+    while (end - p >= 4) {
+        ext_type = tls_get_u16(p);
+        len = tls_get_u16(p + 2);
+        p += 4;
+        if (len > end - p)
+            break;
+        if (ext_type == TLS_EXT_SERVER_NAME)
+            tls_parse_sni(flow, p, len);
+        else if (ext_type == TLS_EXT_ALPN)
+            tls_parse_alpn(flow, p, len);
+        p += len;
+    }
+    if (flow->https.match != PC_TRUE)
+        return -1;
+    PC_LMT_DEBUG("https sni len %d alpn len %d\n", flow->https.url_len, flow->https.alpn_len);
+    return 0;
+}
+
+int dpi_https_proto(flow_info_t *flow)
+{
+    unsigned char *p;
+    int data_len;
+    int len;
+
+    if (NULL == flow) {
+        PC_ERROR("flow is NULL\n");
+        return -1;
+    }
+    p = flow->l4_data;
+    data_len = flow->l4_len;
+
+    if (NULL == p || data_len < TLS_RECORD_HDR_LEN + TLS_HANDSHAKE_HDR_LEN)
+        return -1;
+    // record: type(1) version(2) length(2), any 3.x version
+    if (p[0] != TLS_RECORD_HANDSHAKE || p[1] != 0x03 || p[2] > 0x04)
+        return -1;
+    len = tls_get_u16(p + 3);
+    return dpi_tls_client_hello(flow, p + TLS_RECORD_HDR_LEN, min(len, data_len - TLS_RECORD_HDR_LEN));
+}
+
+void dpi_http_proto(flow_info_t *flow)
+{
+    int i = 0;
+    int start = 0;
+    int line_len;
+    char *data = NULL;
+    int data_len = 0;
+    if (!flow) {
+        PC_ERROR("flow is null\n");
+        return;
+    }
+    if (flow->l4_protocol != IPPROTO_TCP) {
+        return;
+    }
+
+    data = (char *)flow->l4_data;
+    data_len = flow->l4_len;
+    if (data_len < MIN_HTTP_DATA_LEN) {
+        return;
+    }
+    if (flow->sport != 80 && flow->dport != 80)
+        return;
+    for (i = 0; i + 1 < data_len; i++) {
+        if (data[i] == 0x0d && data[i + 1] == 0x0a) {
+            // a short line may end the data, never compare past it
+            line_len = i - start;
+            if (line_len >= 5 && 0 == memcmp(&data[start], "POST ", 5)) {
+                flow->http.match = PC_TRUE;
+                flow->http.method = HTTP_METHOD_POST;
+                flow->http.url_pos = data + start + 5;
+                flow->http.url_len = i - start - 5;
+            } else if (line_len >= 4 && 0 == memcmp(&data[start], "GET ", 4)) {
+                flow->http.match = PC_TRUE;
+                flow->http.method = HTTP_METHOD_GET;
+                flow->http.url_pos = data + start + 4;
+                flow->http.url_len = i - start - 4;
+            } else if (line_len >= 6 && 0 == memcmp(&data[start], "Host:", 5)) {
+                flow->http.host_pos = data + start + 6;
+                flow->http.host_len = i - start - 6;
+            }
+            if (i + 3 < data_len && data[i + 2] == 0x0d && data[i + 3] == 0x0a) {
+                flow->http.data_pos = data + i + 4;
+                flow->http.data_len = data_len - i - 4;
+                break;
+            }
+            // 0x0d 0x0a
+            start = i + 2;
+        }
+    }
+}
+
+int pc_match_port(port_info_t *info, int port)
+{
+    int i;
+    int with_not = 0;
+    if (info->num == 0)
+        return 1;
+    for (i = 0; i < info->num; i++) {
+        if (info->range_list[i].not) {
+            with_not = 1;
+            break;
+        }
+    }
+    for (i = 0; i < info->num; i++) {
+        if (with_not) {
+            if (info->range_list[i].not && port >= info->range_list[i].start
+                    && port <= info->range_list[i].end) {
+                return 0;
+            }
+        } else {
+            if (port >= info->range_list[i].start
+                    && port <= info->range_list[i].end) {
+                return 1;
+            }
+        }
+    }
+    if (with_not)
+        return 1;
+    else
+        return 0;
+}
+
+int pc_match_by_pos(flow_info_t *flow, pc_app_t *node)
+{
+    int i;
+    unsigned int pos = 0;
+
+    if (!flow || !node)
+        return PC_FALSE;
+    if (node->pos_num > 0) {
+        for (i = 0; i < node->pos_num; i++) {
+            // -1, counted from the end of the whole payload
+            if (node->pos_info[i].pos < 0) {
+                if (flow->total_len != flow->l4_len)
+                    return PC_FALSE;
+                pos = flow->l4_len + node->pos_info[i].pos;
+            } else {
+                pos = node->pos_info[i].pos;
+            }
+            if (pos >= flow->l4_len) {
+                return PC_FALSE;
+            }
+            if (flow->l4_data[pos] != node->pos_info[i].value) {
+                return PC_FALSE;
+            }
+        }
+        PC_DEBUG("match by pos, appid=%d\n", node->app_id);
+        return PC_TRUE;
+    }
+    return PC_FALSE;
+}
+
+/*
+ * Copy the host (or https url) and the request url out of the packet once,
+ * every feature then matches against the same NUL terminated buffers.
+ */
+static void pc_copy_url(char *buf, const char *src, int len)
+{
+    if (len >= MAX_URL_MATCH_LEN)
+        len = MAX_URL_MATCH_LEN - 1;
+    if (len < 0)
+        len = 0;
+    strncpy(buf, src, len);
+    buf[len] = '\0';
+}
+
+static void pc_prepare_url_buf(flow_info_t *flow)
+{
+    flow->host_buf[0] = '\0';
+    flow->url_buf[0] = '\0';
+    if (flow->https.match == PC_TRUE && flow->https.url_pos)
+        pc_copy_url(flow->host_buf, flow->https.url_pos, flow->https.url_len);
+    else if (flow->http.match == PC_TRUE && flow->http.host_pos)
+        pc_copy_url(flow->host_buf, flow->http.host_pos, flow->http.host_len);
+    if (flow->http.match == PC_TRUE && flow->http.url_pos)
+        pc_copy_url(flow->url_buf, flow->http.url_pos, flow->http.url_len);
+}
+
+static int pc_regexp_exec(struct RE *re, char *str)
+{
+    PC_STAT_INC(PC_STAT_REGEXP);
+    return regexp_exec(re, str);
+}
+
+int pc_match_by_url(flow_info_t *flow, pc_app_t *node)
+{
+    if (!flow || !node)
+        return PC_FALSE;
+    // match host or https url
+    if (flow->host_buf[0] && node->host_re && pc_regexp_exec(node->host_re, flow->host_buf)) {
+        PC_DEBUG("match url:%s	 reg = %s, appid=%d\n",
+                 flow->host_buf, node->host_url, node->app_id);
+        return PC_TRUE;
+    }
+
+    // match request url
+    if (flow->url_buf[0] && node->request_re && pc_regexp_exec(node->request_re, flow->url_buf)) {
+        PC_DEBUG("match request:%s   reg:%s appid=%d\n",
+                 flow->url_buf, node->request_url, node->app_id);
+        return PC_TRUE;
+    }
+    return PC_FALSE;
+}
+
+int pc_match_one(flow_info_t *flow, pc_app_t *node)
+{
+    int ret = PC_FALSE;
+    if (!flow || !node) {
+        PC_ERROR("node or flow is NULL\n");
+        return PC_FALSE;
+    }
+    PC_STAT_INC(PC_STAT_MATCH_APP);
+    if (node->proto > 0 && flow->l4_protocol != node->proto)
+        return PC_FALSE;
+    if (flow->l4_len == 0)
+        return PC_FALSE;
+
+    if (node->sport != 0 && flow->sport != node->sport) {
+        return PC_FALSE;
+    }
+
+    if (!pc_match_port(&node->dport_info, flow->dport)) {
+        return PC_FALSE;
+    }
+
+    switch (node->match) {
+        case PC_APP_MATCH_URL:
+            ret = pc_match_by_url(flow, node);
+            break;
+        case PC_APP_MATCH_POS:
+            ret = pc_match_by_pos(flow, node);
+            break;
+        default:
+            PC_DEBUG("node is empty, match sport:%d,dport:%d, appid = %d\n",
+                     node->sport, flow->dport, node->app_id);
+            return PC_TRUE;
+    }
+    return ret;
+}
+
+static void pc_blist_matched(flow_info_t *flow, pc_rule_t *rule, pc_app_t *app)
+{
+    flow->app_id = app->app_id;
+    flow->drop = PC_TRUE;
+    PC_LMT_DEBUG("rule %s match blist app %s from mac %pM\n", rule->id, app->app_name, flow->smac);
+}
+
+static void pc_app_matched(flow_info_t *flow, pc_rule_t *rule, pc_app_t *node)
+{
+    if (rule->action == PC_POLICY_DROP) {
+        flow->drop = PC_TRUE;
+    } else {
+        flow->drop = PC_FALSE;
+    }
+    strcpy((char *)flow->app_name, node->app_name);
+    flow->app_id = node->app_id;
+    PC_LMT_DEBUG("match app %d from mac %pM, policy is %s\n", node->app_id, flow->smac, flow->drop ? "DROP" : "ACCEPT");
+}
+
+/* the rule has no matcher: walk its blacklist, then the whole feature list */
+static int pc_match_rule_list(flow_info_t *flow, pc_rule_t *rule)
+{
+    pc_app_table_t *t = rcu_dereference(pc_app_table);
+    pc_app_t *node;
+    if (rule->blist) {
+        pc_for_each_app(node, rule->blist) {
+            if (pc_match_one(flow, node)) {
+                pc_blist_matched(flow, rule, node);
+                return PC_TRUE;
+            }
+        }
+    }
+    pc_for_each_app(node, t) {
+        if (!pc_rule_has_app(rule, node->app_id))
+            continue;
+        if (pc_match_one(flow, node)) {
+            pc_app_matched(flow, rule, node);
+            return PC_TRUE;
+        }
+    }
+    return PC_FALSE;
+}
+
+/*
+ * Visit the entries of the port bucket, the any bucket and the host
+ * candidates. The lists are disjoint and sorted by position, merging them
+ * keeps the order of a full walk.
+ */
+static int pc_match_rule_matcher(flow_info_t *flow, pc_rule_t *rule, pc_matcher_t *m)
+{
+    const u_int16_t *lists[3];
+    int nums[3], pos[3] = {0};
+    pc_port_index_t *pi;
+    pc_app_t *node;
+    int i, k, idx;
+
+    if (flow->l4_protocol == IPPROTO_TCP)
+        pi = &m->tcp;
+    else if (flow->l4_protocol == IPPROTO_UDP)
+        pi = &m->udp;
+    else
+        return PC_FALSE;
+    nums[0] = pc_port_index_lookup(pi, flow->dport, &lists[0]);
+    lists[1] = pi->any;
+    nums[1] = pi->any_num;
+    lists[2] = NULL;
+    nums[2] = 0;
+    if (flow->host_buf[0] && m->host_num > 0) {
+        pc_matcher_scan_host(m, flow);
+        if (flow->host_cand_num >= 0) {
+            lists[2] = flow->host_cand;
+            nums[2] = flow->host_cand_num;
+        } else {
+            lists[2] = m->host_all;
+            nums[2] = m->host_num;
+        }
+    }
+    for (;;) {
+        k = -1;
+        for (i = 0; i < 3; i++) {
+            if (pos[i] < nums[i] && (k < 0 || lists[i][pos[i]] < lists[k][pos[k]]))
+                k = i;
+        }
+        if (k < 0)
+            break;
+        idx = lists[k][pos[k]++];
+        node = m->apps[idx];
+        if (!pc_match_one(flow, node))
+            continue;
+        if (idx < m->nblist)
+            pc_blist_matched(flow, rule, node);
+        else
+            pc_app_matched(flow, rule, node);
+        return PC_TRUE;
+    }
+    return PC_FALSE;
+}
+
+/* must be called under rcu_read_lock() */
+int app_filter_match(flow_info_t *flow, pc_rule_t *rule)
+{
+    int matched;
+    if (rule == NULL || flow == NULL)
+        return 0;
+    PC_STAT_INC(PC_STAT_MATCH);
+    pc_prepare_url_buf(flow);
+    if (rule->matcher)
+        matched = pc_match_rule_matcher(flow, rule, rule->matcher);
+    else
+        matched = pc_match_rule_list(flow, rule);
+    if (!matched)
+        flow->drop = PC_FALSE;
+    return 0;
+}
+
+int dpi_main(struct sk_buff *skb, flow_info_t *flow)
+{
+    PC_STAT_INC(PC_STAT_DPI);
+    if (flow->l4_protocol == IPPROTO_UDP) {
+        dpi_quic_proto(flow);
+        if (flow->https.match == PC_TRUE)
+            PC_STAT_INC(PC_STAT_QUIC);
+        return 0;
+    }
+    dpi_http_proto(flow);
+    dpi_https_proto(flow);
+    if (flow->http.match == PC_TRUE)
+        PC_STAT_INC(PC_STAT_HTTP);
+    if (flow->https.match == PC_TRUE)
+        PC_STAT_INC(PC_STAT_TLS);
+    /*if (TEST_MODE())
+    	dump_flow_info(flow);*/
+    return 0;
+}
+
+// openssl s_client -tls1_2 -servername www.youtube.com -alpn h2,http/1.1
+static const unsigned char pc_test_client_hello[] = {
+    0x16, 0x03, 0x01, 0x00, 0x7b, 0x01, 0x00, 0x00, 0x77, 0x03, 0x03, 0xdd,
+    0x52, 0xe3, 0xda, 0xfe, 0x79, 0x12, 0xa2, 0x84, 0xe7, 0x38, 0xe0, 0x47,
+    0xa2, 0x49, 0xe0, 0x22, 0x97, 0x70, 0xed, 0x91, 0xf8, 0x34, 0x53, 0x2e,
+    0xe8, 0xb4, 0xa5, 0x85, 0x18, 0xf3, 0x11, 0x00, 0x00, 0x04, 0xc0, 0x2f,
+    0x00, 0xff, 0x01, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x14, 0x00, 0x12,
+    0x00, 0x00, 0x0f, 0x77, 0x77, 0x77, 0x2e, 0x79, 0x6f, 0x75, 0x74, 0x75,
+    0x62, 0x65, 0x2e, 0x63, 0x6f, 0x6d, 0x00, 0x0b, 0x00, 0x04, 0x03, 0x00,
+    0x01, 0x02, 0x00, 0x0a, 0x00, 0x04, 0x00, 0x02, 0x00, 0x1d, 0x00, 0x10,
+    0x00, 0x0e, 0x00, 0x0c, 0x02, 0x68, 0x32, 0x08, 0x68, 0x74, 0x74, 0x70,
+    0x2f, 0x31, 0x2e, 0x31, 0x00, 0x16, 0x00, 0x00, 0x00, 0x17, 0x00, 0x00,
+    0x00, 0x0d, 0x00, 0x04, 0x00, 0x02, 0x04, 0x01,
+};
+// low byte of the server name length
+#define PC_TEST_SNI_LEN_OFF 62
+
+static const char pc_test_http_get[] =
+    "GET /browse?jbv=80117470 HTTP/1.1\r\nHost: www.netflix.com\r\n"
+    "User-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n";
+
+static const char pc_test_http_post[] =
+    "POST /upload HTTP/1.1\r\nHost: a.com\r\nContent-Length: 4\r\n\r\nabcd";
+
+// cut after short lines, an empty Host: and one shorter than any keyword
+static const char pc_test_http_short[] = "GET /a HTTP/1.1\r\nHost:\r\nX\r\n";
+
+static void pc_test_flow(flow_info_t *flow, int dport, unsigned char *data, int len)
+{
+    memset(flow, 0, sizeof(flow_info_t));
+    flow->l4_protocol = IPPROTO_TCP;
+    flow->sport = 50000;
+    flow->dport = dport;
+    flow->l4_data = data;
+    flow->l4_len = len;
+    flow->total_len = len;
+}
+
+void TEST_dpi(void)
+{
+    flow_info_t flow;
+    unsigned char *buf;
+    int len, cut, ok;
+
+    // every buffer is exactly as long as its payload so that overreads show up
+    buf = kmalloc(sizeof(pc_test_client_hello), GFP_KERNEL);
+    if (!PC_TEST(buf != NULL))
+        return;
+    memcpy(buf, pc_test_client_hello, sizeof(pc_test_client_hello));
+    pc_test_flow(&flow, 443, buf, sizeof(pc_test_client_hello));
+    PC_TEST(dpi_https_proto(&flow) == 0);
+    PC_TEST(flow.https.match == PC_TRUE && flow.https.url_len == 15 &&
+            !memcmp(flow.https.url_pos, "www.youtube.com", 15));
+    PC_TEST(flow.https.alpn_len == 2 && !memcmp(flow.https.alpn_pos, "h2", 2));
+    PC_TEST_BENCH("dpi_https_proto", 100000,
+                  pc_test_flow(&flow, 443, buf, sizeof(pc_test_client_hello));
+                  pc_test_sink = dpi_https_proto(&flow));
+
+    // a ClientHello cut anywhere never yields a name outside the data
+    ok = 1;
+    for (len = 0; len < sizeof(pc_test_client_hello); len++) {
+        pc_test_flow(&flow, 443, buf, len);
+        if (dpi_https_proto(&flow) == 0 &&
+                (char *)flow.https.url_pos + flow.https.url_len > (char *)buf + len)
+            ok = 0;
+    }
+    PC_TEST(ok);
+    pc_test_flow(&flow, 443, buf, 60);
+    PC_TEST(dpi_https_proto(&flow) != 0);
+
+    buf[PC_TEST_SNI_LEN_OFF] = 0x40;
+    pc_test_flow(&flow, 443, buf, sizeof(pc_test_client_hello));
+    PC_TEST(dpi_https_proto(&flow) != 0);
+    buf[PC_TEST_SNI_LEN_OFF] = pc_test_client_hello[PC_TEST_SNI_LEN_OFF];
+    buf[0] = 0x17;
+    pc_test_flow(&flow, 443, buf, sizeof(pc_test_client_hello));
+    PC_TEST(dpi_https_proto(&flow) != 0);
+    kfree(buf);
+
+    len = strlen(pc_test_http_get);
+    buf = kmalloc(len, GFP_KERNEL);
+    if (!PC_TEST(buf != NULL))
+        return;
+    memcpy(buf, pc_test_http_get, len);
+    pc_test_flow(&flow, 80, buf, len);
+    dpi_http_proto(&flow);
+    PC_TEST(flow.http.match == PC_TRUE && flow.http.method == HTTP_METHOD_GET);
+    PC_TEST(flow.http.url_len == 29 && !memcmp(flow.http.url_pos, "/browse?jbv=80117470", 20));
+    PC_TEST(flow.http.host_len == 15 && !memcmp(flow.http.host_pos, "www.netflix.com", 15));
+    PC_TEST(flow.http.data_len == 0);
+    PC_TEST_BENCH("dpi_http_proto", 100000,
+                  pc_test_flow(&flow, 80, buf, len); dpi_http_proto(&flow);
+                  pc_test_sink = flow.http.host_len);
+
+    // only port 80 is parsed
+    pc_test_flow(&flow, 8080, buf, len);
+    dpi_http_proto(&flow);
+    PC_TEST(flow.http.match != PC_TRUE);
+
+    kfree(buf);
+
+    // headers cut in the final line end
+    for (cut = 1; cut <= 3; cut++) {
+        buf = kmalloc(len - cut, GFP_KERNEL);
+        if (!PC_TEST(buf != NULL))
+            return;
+        memcpy(buf, pc_test_http_get, len - cut);
+        pc_test_flow(&flow, 80, buf, len - cut);
+        dpi_http_proto(&flow);
+        PC_TEST(flow.http.match == PC_TRUE && flow.http.data_pos == NULL);
+        kfree(buf);
+    }
+
+    len = strlen(pc_test_http_post);
+    buf = kmalloc(len, GFP_KERNEL);
+    if (!PC_TEST(buf != NULL))
+        return;
+    memcpy(buf, pc_test_http_post, len);
+    pc_test_flow(&flow, 80, buf, len);
+    dpi_http_proto(&flow);
+    PC_TEST(flow.http.match == PC_TRUE && flow.http.method == HTTP_METHOD_POST);
+    PC_TEST(flow.http.host_len == 5 && !memcmp(flow.http.host_pos, "a.com", 5));
+    PC_TEST(flow.http.data_len == 4 && !memcmp(flow.http.data_pos, "abcd", 4));
+    kfree(buf);
+
+    len = strlen(pc_test_http_short);
+    buf = kmalloc(len, GFP_KERNEL);
+    if (!PC_TEST(buf != NULL))
+        return;
+    memcpy(buf, pc_test_http_short, len);
+    pc_test_flow(&flow, 80, buf, len);
+    dpi_http_proto(&flow);
+    PC_TEST(flow.http.match == PC_TRUE && flow.http.url_len == 11);
+    PC_TEST(flow.http.host_pos == NULL && flow.http.host_len == 0);
+    kfree(buf);
+}
@@ -4,358 +4,327 @@
 #include <net/tcp.h>
 #include <linux/netfilter.h>
 #include <net/netfilter/nf_conntrack.h>
-#include <net/netfilter/nf_conntrack_acct.h>
 #include <linux/skbuff.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
+#include <linux/netfilter_ipv6.h>
+#include <linux/netfilter_bridge.h>
+#include <linux/netdevice.h>
 #include <linux/types.h>
 #include <net/sock.h>
 #include <linux/etherdevice.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
 #include "pc_policy.h"
 #include "pc_utils.h"
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+static DEFINE_STATIC_KEY_FALSE(pc_filter_active);
+#define pc_filter_key_active() static_branch_unlikely(&pc_filter_active)
+#define pc_filter_key_enable() static_branch_enable(&pc_filter_active)
+#define pc_filter_key_disable() static_branch_disable(&pc_filter_active)
+#else
+static struct static_key pc_filter_active = STATIC_KEY_INIT_FALSE;
+#define pc_filter_key_active() static_key_false(&pc_filter_active)
+#define pc_filter_key_enable() do { \
+        if (!static_key_enabled(&pc_filter_active)) \
+            static_key_slow_inc(&pc_filter_active); \
+    } while (0)
+#define pc_filter_key_disable() do { \
+        if (static_key_enabled(&pc_filter_active)) \
+            static_key_slow_dec(&pc_filter_active); \
+    } while (0)
+#endif
 
-int parse_flow_proto(struct sk_buff *skb, flow_info_t *flow)
+/*
+ * The final verdict of a flow is kept in the mark_mask bits of ct->mark
+ * together with the policy generation it was made under, so packets of
+ * established flows skip the MAC lookup and DPI until the policy changes.
+ * Other users of ct->mark (CONNMARK rules, mwan3, qos scripts, ctnetlink)
+ * keep the remaining bits, the field is only ever replaced with cmpxchg.
+ *
+ * A flow is inspected until it matches an app (PC_VERDICT_DROP/ACCEPT)
+ * or runs out of its DPI budget, then it is marked PC_VERDICT_FINISH:
+ * finished as an unknown app and accepted without further inspection.
+ *
+ * The verdict belongs to the client that opened the flow, so it is only
+ * made and used for packets in the original direction. A reply comes from
+ * the server's MAC and is classified on its own, uncached.
+ */
+#if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+static inline u_int32_t pc_mark_field(u_int32_t mark)
 {
-    struct tcphdr *tcph = NULL;
-    struct udphdr *udph = NULL;
-    struct iphdr *iph = NULL;
-    if (!skb)
-        return -1;
-    iph = ip_hdr(skb);
-    if (!iph)
-        return -1;
-    flow->src = iph->saddr;
-    flow->dst = iph->daddr;
-    flow->l4_protocol = iph->protocol;
-    switch (iph->protocol) {
-        case IPPROTO_TCP:
-            tcph = (struct tcphdr *)(iph + 1);
-            flow->l4_data = skb->data + iph->ihl * 4 + tcph->doff * 4;
-            flow->l4_len = ntohs(iph->tot_len) - iph->ihl * 4 - tcph->doff * 4;
-            flow->dport = htons(tcph->dest);
-            flow->sport = htons(tcph->source);
-            return 0;
-        case IPPROTO_UDP:
-            udph = (struct udphdr *)(iph + 1);
-            flow->l4_data = skb->data + iph->ihl * 4 + 8;
-            flow->l4_len = ntohs(udph->len) - 8;
-            flow->dport = htons(udph->dest);
-            flow->sport = htons(udph->source);
-            return 0;
-        case IPPROTO_ICMP:
-            break;
-        default:
-            return -1;
-    }
-    return -1;
+    return (mark & pc_mark_mask) >> pc_mark_shift;
 }
 
-int dpi_https_proto(flow_info_t *flow)
+// replace the module's field of ct->mark, leaving the other bits alone
+static void pc_ct_update_mark(struct nf_conn *ct, u_int32_t field)
 {
-    int i;
-    short url_len = 0;
-    char *p;
-    int data_len;
+    u_int32_t old, mark;
+    do {
+        old = READ_ONCE(ct->mark);
+        mark = (old & ~pc_mark_mask) | ((field << pc_mark_shift) & pc_mark_mask);
+        if (mark == old)
+            return;
+    } while (cmpxchg(&ct->mark, old, mark) != old);
+}
 
-    if (NULL == flow) {
-        PC_ERROR("flow is NULL\n");
-        return -1;
-    }
-    p = flow->l4_data;
-    data_len = flow->l4_len;
+static u_int32_t pc_ct_get_verdict(struct nf_conn *ct, u_int32_t gen)
+{
+    u_int32_t field = pc_mark_field(READ_ONCE(ct->mark));
+    if (!(field & PC_VERDICT_MASK))
+        return 0;
+    if ((field >> PC_VERDICT_BITS) != gen)
+        return 0;
+    return field & PC_VERDICT_MASK;
+}
 
-    if (NULL == p || data_len == 0) {
-        return -1;
-    }
-    if (!(p[0] == 0x16 && p[1] == 0x03 && p[2] == 0x01))
-        return -1;
+static void pc_ct_set_verdict(struct nf_conn *ct, u_int32_t verdict, u_int32_t gen)
+{
+    if (!ct)
+        return;
+    pc_ct_update_mark(ct, verdict | (gen << PC_VERDICT_BITS));
+    pc_budget_done(ct);
+}
 
+typedef struct pc_ct_flush {
+    u_int32_t gen;
+    int keep;       // 1: clear the verdicts of every other generation, 0: of gen only
+} pc_ct_flush_t;
 
-    for (i = 0; i < data_len; i++) {
-        if (i + HTTPS_URL_OFFSET >= data_len) {
-            return -1;
-        }
+static int pc_ct_flush_one(struct nf_conn *ct, void *data)
+{
+    pc_ct_flush_t *f = data;
+    u_int32_t field = pc_mark_field(READ_ONCE(ct->mark));
+    u_int32_t gen = field >> PC_VERDICT_BITS;
 
-        if (p[i] == 0x0 && p[i + 1] == 0x0 && p[i + 2] == 0x0 && p[i + 3] != 0x0) {
-            // 2 bytes
-            memcpy(&url_len, p + i + HTTPS_LEN_OFFSET, 2);
-            if (ntohs(url_len) <= 0 || ntohs(url_len) > data_len) {
-                continue;
-            }
-            if (i + HTTPS_URL_OFFSET + ntohs(url_len) < data_len) {
-                flow->https.match = PC_TRUE;
-                flow->https.url_pos = p + i + HTTPS_URL_OFFSET;
-                flow->https.url_len = ntohs(url_len);
-                return 0;
-            }
-        }
-    }
-    return -1;
+    if (!(field & PC_VERDICT_MASK))
+        return 0;
+    if (f->keep ? gen != f->gen : gen == f->gen)
+        pc_ct_update_mark(ct, 0);
+    // never remove the entry
+    return 0;
 }
 
-void dpi_http_proto(flow_info_t *flow)
+/*
+ * Walk the conntrack table and clear cached verdicts, the generation only
+ * has a few bits so it must not come back to marks made under its last use.
+ */
+void pc_filter_flush_verdicts(u_int32_t gen, int keep)
 {
-    int i = 0;
-    int start = 0;
-    char *data = NULL;
-    int data_len = 0;
-    if (!flow) {
-        PC_ERROR("flow is null\n");
-        return;
-    }
-    if (flow->l4_protocol != IPPROTO_TCP) {
-        return;
-    }
+    pc_ct_flush_t f = {
+        .gen = gen,
+        .keep = keep,
+    };
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    struct nf_ct_iter_data d = {
+        .net = &init_net,
+        .data = &f,
+    };
+    nf_ct_iterate_cleanup_net(pc_ct_flush_one, &d);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+    nf_ct_iterate_cleanup_net(&init_net, pc_ct_flush_one, &f, 0, 0);
+#else
+    nf_ct_iterate_cleanup(&init_net, pc_ct_flush_one, &f, 0, 0);
+#endif
+}
+#else
+static u_int32_t pc_ct_get_verdict(struct nf_conn *ct, u_int32_t gen)
+{
+    return 0;
+}
 
-    data = flow->l4_data;
-    data_len = flow->l4_len;
-    if (data_len < MIN_HTTP_DATA_LEN) {
-        return;
-    }
-    if (flow->sport != 80 && flow->dport != 80)
-        return;
-    for (i = 0; i < data_len; i++) {
-        if (data[i] == 0x0d && data[i + 1] == 0x0a) {
-            if (0 == memcmp(&data[start], "POST ", 5)) {
-                flow->http.match = PC_TRUE;
-                flow->http.method = HTTP_METHOD_POST;
-                flow->http.url_pos = data + start + 5;
-                flow->http.url_len = i - start - 5;
-            } else if (0 == memcmp(&data[start], "GET ", 4)) {
-                flow->http.match = PC_TRUE;
-                flow->http.method = HTTP_METHOD_GET;
-                flow->http.url_pos = data + start + 4;
-                flow->http.url_len = i - start - 4;
-            } else if (0 == memcmp(&data[start], "Host:", 5)) {
-                flow->http.host_pos = data + start + 6;
-                flow->http.host_len = i - start - 6;
-            }
-            if (data[i + 2] == 0x0d && data[i + 3] == 0x0a) {
-                flow->http.data_pos = data + i + 4;
-                flow->http.data_len = data_len - i - 4;
-                break;
-            }
-            // 0x0d 0x0a
-            start = i + 2;
-        }
-    }
+static void pc_ct_set_verdict(struct nf_conn *ct, u_int32_t verdict, u_int32_t gen) {}
+
+void pc_filter_flush_verdicts(u_int32_t gen, int keep) {}
+#endif
+
+static u64 pc_stats_sum(int item)
+{
+    u64 sum = 0;
+    int cpu;
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(&pc_stats, cpu)->cnt[item];
+    return sum;
 }
 
-int pc_match_port(port_info_t *info, int port)
+int flow_cache_proc_show(struct seq_file *s, void *v)
 {
-    int i;
-    int with_not = 0;
-    if (info->num == 0)
-        return 1;
-    for (i = 0; i < info->num; i++) {
-        if (info->range_list[i].not) {
-            with_not = 1;
-            break;
-        }
-    }
-    for (i = 0; i < info->num; i++) {
-        if (with_not) {
-            if (info->range_list[i].not && port >= info->range_list[i].start
-                    && port <= info->range_list[i].end) {
-                return 0;
-            }
-        } else {
-            if (port >= info->range_list[i].start
-                    && port <= info->range_list[i].end) {
-                return 1;
-            }
-        }
-    }
-    if (with_not)
-        return 1;
-    else
-        return 0;
+    seq_printf(s, "Hit\tMiss\tFinish\n");
+    seq_printf(s, "%llu\t%llu\t%llu\n", (unsigned long long)pc_stats_sum(PC_STAT_CACHE_HIT),
+               (unsigned long long)pc_stats_sum(PC_STAT_CACHE_MISS),
+               (unsigned long long)pc_stats_sum(PC_STAT_FINISH));
+    return 0;
 }
 
-int pc_match_by_pos(flow_info_t *flow, pc_app_t *node)
+static const char *pc_stat_names[PC_STAT_MAX] = {
+    [PC_STAT_PACKETS] = "packets",
+    [PC_STAT_ACCEPT] = "accept",
+    [PC_STAT_DROP] = "drop",
+    [PC_STAT_CACHE_HIT] = "cache_hit",
+    [PC_STAT_CACHE_MISS] = "cache_miss",
+    [PC_STAT_FINISH] = "finish",
+    [PC_STAT_DPI] = "dpi",
+    [PC_STAT_HTTP] = "http",
+    [PC_STAT_TLS] = "tls",
+    [PC_STAT_QUIC] = "quic",
+    [PC_STAT_TLS_REASM] = "tls_reasm",
+    [PC_STAT_MATCH] = "match",
+    [PC_STAT_MATCH_APP] = "match_app",
+    [PC_STAT_REGEXP] = "regexp",
+};
+
+int stats_proc_show(struct seq_file *s, void *v)
 {
     int i;
-    unsigned int pos = 0;
-
-    if (!flow || !node)
-        return PC_FALSE;
-    if (node->pos_num > 0) {
-        for (i = 0; i < node->pos_num; i++) {
-            // -1
-            if (node->pos_info[i].pos < 0) {
-                pos = flow->l4_len + node->pos_info[i].pos;
-            } else {
-                pos = node->pos_info[i].pos;
-            }
-            if (pos >= flow->l4_len) {
-                return PC_FALSE;
-            }
-            if (flow->l4_data[pos] != node->pos_info[i].value) {
-                return PC_FALSE;
-            }
-        }
-        PC_DEBUG("match by pos, appid=%d\n", node->app_id);
-        return PC_TRUE;
-    }
-    return PC_FALSE;
+    for (i = 0; i < PC_STAT_MAX; i++)
+        seq_printf(s, "%-12s%llu\n", pc_stat_names[i], (unsigned long long)pc_stats_sum(i));
+    return 0;
 }
 
-int pc_match_by_url(flow_info_t *flow, pc_app_t *node)
-{
-    char reg_url_buf[MAX_URL_MATCH_LEN] = {0};
+/*
+ * Optional latency histograms of the hook and its stages, in log2 buckets
+ * of nanoseconds. Off by default, toggled by writing 1/0 to
+ * /proc/parental-control/latency, "clear" resets the counters.
+ */
+enum pc_lat_stage {
+    PC_LAT_TOTAL,
+    PC_LAT_MAC,
+    PC_LAT_PARSE,
+    PC_LAT_DPI,
+    PC_LAT_MATCH,
+    PC_LAT_MAX,
+};
 
-    if (!flow || !node)
-        return PC_FALSE;
-    // match host or https url
-    if (flow->https.match == PC_TRUE && flow->https.url_pos) {
-        if (flow->https.url_len >= MAX_URL_MATCH_LEN)
-            strncpy(reg_url_buf, flow->https.url_pos, MAX_URL_MATCH_LEN - 1);
-        else
-            strncpy(reg_url_buf, flow->https.url_pos, flow->https.url_len);
-    } else if (flow->http.match == PC_TRUE && flow->http.host_pos) {
-        if (flow->http.host_len >= MAX_URL_MATCH_LEN)
-            strncpy(reg_url_buf, flow->http.host_pos, MAX_URL_MATCH_LEN - 1);
-        else
-            strncpy(reg_url_buf, flow->http.host_pos, flow->http.host_len);
-    }
-    if (strlen(reg_url_buf) > 0 && strlen(node->host_url) > 0 && regexp_match(node->host_url, reg_url_buf)) {
-        PC_DEBUG("match url:%s	 reg = %s, appid=%d\n",
-                 reg_url_buf, node->host_url, node->app_id);
-        return PC_TRUE;
-    }
+#define PC_LAT_BUCKETS 32
 
-    // match request url
-    if (flow->http.match == PC_TRUE && flow->http.url_pos) {
-        memset(reg_url_buf, 0x0, sizeof(reg_url_buf));
-        if (flow->http.url_len >= MAX_URL_MATCH_LEN)
-            strncpy(reg_url_buf, flow->http.url_pos, MAX_URL_MATCH_LEN - 1);
-        else
-            strncpy(reg_url_buf, flow->http.url_pos, flow->http.url_len);
-        if (strlen(reg_url_buf) > 0 && strlen(node->request_url) && regexp_match(node->request_url, reg_url_buf)) {
-            PC_DEBUG("match request:%s   reg:%s appid=%d\n",
-                     reg_url_buf, node->request_url, node->app_id);
-            return PC_TRUE;
-        }
-    }
-    return PC_FALSE;
-}
+struct pc_lat_hist {
+    u64 cnt[PC_LAT_MAX][PC_LAT_BUCKETS];
+} ____cacheline_aligned_in_smp;
 
-int pc_match_one(flow_info_t *flow, pc_app_t *node)
-{
-    int ret = PC_FALSE;
-    if (!flow || !node) {
-        PC_ERROR("node or flow is NULL\n");
-        return PC_FALSE;
-    }
-    if (node->proto > 0 && flow->l4_protocol != node->proto)
-        return PC_FALSE;
-    if (flow->l4_len == 0)
-        return PC_FALSE;
+static DEFINE_PER_CPU_ALIGNED(struct pc_lat_hist, pc_lat_hist);
+static int pc_latency_on;
 
-    if (node->sport != 0 && flow->sport != node->sport) {
-        return PC_FALSE;
-    }
+static const char *pc_lat_names[PC_LAT_MAX] = {
+    [PC_LAT_TOTAL] = "total",
+    [PC_LAT_MAC] = "mac",
+    [PC_LAT_PARSE] = "parse",
+    [PC_LAT_DPI] = "dpi",
+    [PC_LAT_MATCH] = "match",
+};
 
-    if (!pc_match_port(&node->dport_info, flow->dport)) {
-        return PC_FALSE;
-    }
+static inline u64 pc_lat_start(void)
+{
+    if (likely(!READ_ONCE(pc_latency_on)))
+        return 0;
+    return ktime_to_ns(ktime_get());
+}
 
-    if (strlen(node->request_url) > 0 ||
-            strlen(node->host_url) > 0) {
-        ret = pc_match_by_url(flow, node);
-    } else if (node->pos_num > 0) {
-        ret = pc_match_by_pos(flow, node);
-    } else {
-        PC_DEBUG("node is empty, match sport:%d,dport:%d, appid = %d\n",
-                 node->sport, node->dport, node->app_id);
-        return PC_TRUE;
-    }
-    return ret;
+static inline void pc_lat_end(int stage, u64 start)
+{
+    u64 delta;
+    int b;
+    if (likely(!start))
+        return;
+    delta = ktime_to_ns(ktime_get()) - start;
+    b = min_t(int, fls64(delta), PC_LAT_BUCKETS - 1);
+    this_cpu_inc(pc_lat_hist.cnt[stage][b]);
 }
 
-static int app_in_rule(u_int32_t app, pc_rule_t *rule)
+// upper bound in ns of the bucket holding the given percentile
+static u64 pc_lat_percentile(u64 *hist, u64 total, int pct)
 {
-    pc_app_index_t *node, *n;
-    if (app < MAX_APP_IN_CLASS) {
-        return PC_FALSE;
-    }
-    if (!list_empty(&rule->applist)) {
-        list_for_each_entry_safe(node, n, &rule->applist, head) {
-            if (app == node->app_id)
-                return PC_TRUE;
-        }
-        app = app / MAX_APP_IN_CLASS; //如果单个应用不匹配，进一步检查是否匹配应用类型
-        list_for_each_entry_safe(node, n, &rule->applist, head) {
-            if (app == node->app_id)
-                return PC_TRUE;
-        }
+    u64 want = div_u64(total * pct + 99, 100);
+    u64 sum = 0;
+    int b;
+    for (b = 0; b < PC_LAT_BUCKETS; b++) {
+        sum += hist[b];
+        if (sum >= want)
+            break;
     }
-    return PC_FALSE;
+    return 1ULL << min(b, PC_LAT_BUCKETS - 1);
 }
 
-static int match_blist_app(flow_info_t *flow, pc_rule_t *rule)
+int latency_proc_show(struct seq_file *s, void *v)
 {
-    pc_app_t *app, *n;
-    if (!list_empty(&rule->blist)) {
-        list_for_each_entry_safe(app, n, &rule->blist, head) {
-            if (pc_match_one(flow, app)) {
-                PC_LMT_DEBUG("rule %s match blist app %s from mac %pM\n", rule->id, app->app_name, flow->smac);
-                return PC_TRUE;
-            }
+    u64 hist[PC_LAT_BUCKETS];
+    u64 total;
+    int stage, cpu, b;
+
+    seq_printf(s, "enabled: %d\n", READ_ONCE(pc_latency_on));
+    for (stage = 0; stage < PC_LAT_MAX; stage++) {
+        total = 0;
+        for (b = 0; b < PC_LAT_BUCKETS; b++) {
+            hist[b] = 0;
+            for_each_possible_cpu(cpu)
+                hist[b] += per_cpu_ptr(&pc_lat_hist, cpu)->cnt[stage][b];
+            total += hist[b];
+        }
+        seq_printf(s, "\n%s: count %llu", pc_lat_names[stage], (unsigned long long)total);
+        if (total)
+            seq_printf(s, " p50 <%lluns p99 <%lluns",
+                       (unsigned long long)pc_lat_percentile(hist, total, 50),
+                       (unsigned long long)pc_lat_percentile(hist, total, 99));
+        seq_printf(s, "\n");
+        for (b = 0; b < PC_LAT_BUCKETS; b++) {
+            if (hist[b])
+                seq_printf(s, "  <%-12llu%llu\n", 1ULL << b, (unsigned long long)hist[b]);
         }
     }
-    return PC_FALSE;
+    return 0;
 }
 
-int app_filter_match(flow_info_t *flow, pc_rule_t *rule)
+ssize_t latency_proc_write(struct file *file, const char __user *buffer, size_t count, loff_t *pos)
 {
-    pc_app_t *n, *node;
-    pc_policy_read_lock();
-    pc_app_read_lock();
-    if (rule == NULL || flow == NULL)
-        goto EXIT;
-    if (match_blist_app(flow, rule)) {
-        flow->drop = PC_TRUE;
-        PC_LMT_DEBUG("match blist from mac %pM, policy is %s\n", flow->smac, flow->drop ? "DROP" : "ACCEPT");
-        goto EXIT;
+    char buf[8] = {0};
+    int cpu;
+
+    if (copy_from_user(buf, buffer, min(count, sizeof(buf) - 1)))
+        return -EFAULT;
+    if (!strncmp(buf, "clear", 5)) {
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(&pc_lat_hist, cpu), 0, sizeof(struct pc_lat_hist));
+    } else if (buf[0] == '0' || buf[0] == '1') {
+        WRITE_ONCE(pc_latency_on, buf[0] == '1');
+    } else {
+        return -EINVAL;
     }
-    if (!list_empty(&pc_app_head)) {
-        list_for_each_entry_safe(node, n, &pc_app_head, head) {
+    return count;
+}
 
-            if (!app_in_rule(node->app_id, rule)) {
-                continue;
-            }
-            if (pc_match_one(flow, node)) {
-                if (rule->action == PC_POLICY_DROP) {
-                    flow->drop = PC_TRUE;
-                } else {
-                    flow->drop = PC_FALSE;
-                }
-                strcpy(flow->app_name, node->app_name);
-                flow->app_id = node->app_id;
-                PC_LMT_DEBUG("match app %d from mac %pM, policy is %s\n", node->app_id, flow->smac, flow->drop ? "DROP" : "ACCEPT");
-                goto EXIT;
-            }
-        }
-    }
-    flow->drop = PC_FALSE;
-EXIT:
-    pc_app_read_unlock();
-    pc_policy_read_unlock();
-    return 0;
+/*
+ * Only TLS handshakes, QUIC Initials and HTTP requests are worth parsing when
+ * they are larger than MAX_BYPASS_DPI_PKT_LEN, anything else that big is bulk data.
+ */
+static int pc_dpi_candidate(flow_info_t *flow)
+{
+    unsigned char *p = flow->l4_data;
+    if (dpi_quic_initial(flow))
+        return PC_TRUE;
+    if (flow->l4_protocol != IPPROTO_TCP || flow->l4_len < 5)
+        return PC_FALSE;
+    if (p[0] == 0x16 && p[1] == 0x03)
+        return PC_TRUE;
+    if (0 == memcmp(p, "GET ", 4) || 0 == memcmp(p, "POST ", 5))
+        return PC_TRUE;
+    return PC_FALSE;
 }
 
-int dpi_main(struct sk_buff *skb, flow_info_t *flow)
+// counts the packet against the flow's budget when it goes on to DPI
+static int pc_dpi_budget_exhausted(struct nf_conn *ct, enum ip_conntrack_info ctinfo, flow_info_t *flow)
 {
-    dpi_http_proto(flow);
-    dpi_https_proto(flow);
-    /*if (TEST_MODE())
-    	dump_flow_info(flow);*/
-    return 0;
+    if (flow->l4_len > MAX_BYPASS_DPI_PKT_LEN && !pc_dpi_candidate(flow))
+        return PC_TRUE;
+    return !pc_budget_take(ct, CTINFO2DIR(ctinfo));
 }
 
+
 void pc_get_smac(struct sk_buff *skb,  u8 smac[ETH_ALEN])
 {
     struct ethhdr *ethhdr = NULL;
@@ -366,30 +335,98 @@ void pc_get_smac(struct sk_buff *skb,  u8 smac[ETH_ALEN])
         memcpy(smac, &skb->cb[40], ETH_ALEN);*/
 }
 
-static int check_source_net_dev(struct sk_buff *skb)
+/*
+ * src_dev is resolved to a bitmap of ifindexes whenever it is set and when
+ * devices come and go (bridges are recreated with a new ifindex), so the
+ * per-packet check is a single bit test.
+ */
+typedef struct pc_src_dev_map {
+    struct rcu_head rcu;
+    int any;
+    int nbits;
+    unsigned long map[0];
+} pc_src_dev_map_t;
+
+static pc_src_dev_map_t __rcu *pc_src_dev_map;
+static DEFINE_MUTEX(pc_src_dev_mutex);
+
+static void pc_src_dev_rebuild(void)
 {
     char nstr[MAX_SRC_DEVNAME_SIZE] = {0};
-    char *ptr;
+    int ifindex[MAX_SRC_DEVNAME_SIZE / 2];
+    struct net_device *dev;
+    pc_src_dev_map_t *m, *old;
+    char *ptr = nstr;
     char *item = NULL;
-    struct net_device *netdev = skb->dev;
+    int i, num = 0, nbits = 0;
+
+    strncpy(nstr, pc_src_dev, MAX_SRC_DEVNAME_SIZE - 1);
+    rcu_read_lock();
+    while (ptr && num < ARRAY_SIZE(ifindex)) {
+        item = strsep(&ptr, " ");
+        if (!*item)
+            continue;
+        dev = dev_get_by_name_rcu(&init_net, item);
+        if (!dev)
+            continue;
+        ifindex[num++] = dev->ifindex;
+        nbits = max(nbits, dev->ifindex + 1);
+    }
+    rcu_read_unlock();
+
+    m = kzalloc(sizeof(pc_src_dev_map_t) + BITS_TO_LONGS(nbits) * sizeof(unsigned long), GFP_KERNEL);
+    if (!m) {
+        PC_ERROR("alloc src dev map failed\n");
+        return;
+    }
+    m->any = (0 == strlen(nstr));
+    m->nbits = nbits;
+    for (i = 0; i < num; i++)
+        set_bit(ifindex[i], m->map);
+    old = rcu_dereference_protected(pc_src_dev_map, lockdep_is_held(&pc_src_dev_mutex));
+    rcu_assign_pointer(pc_src_dev_map, m);
+    if (old)
+        kfree_rcu(old, rcu);
+}
+
+void pc_filter_set_src_dev(const char *devs)
+{
+    mutex_lock(&pc_src_dev_mutex);
+    strncpy(pc_src_dev, devs, MAX_SRC_DEVNAME_SIZE - 1);
+    pc_src_dev_rebuild();
+    mutex_unlock(&pc_src_dev_mutex);
+}
+
+static int pc_netdev_event(struct notifier_block *this, unsigned long event, void *ptr)
+{
+    switch (event) {
+        case NETDEV_REGISTER:
+        case NETDEV_UNREGISTER:
+        case NETDEV_CHANGENAME:
+            mutex_lock(&pc_src_dev_mutex);
+            if (strlen(pc_src_dev))
+                pc_src_dev_rebuild();
+            mutex_unlock(&pc_src_dev_mutex);
+            break;
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block pc_netdev_notifier = {
+    .notifier_call = pc_netdev_event,
+};
+
+// called under rcu_read_lock
+static int check_source_net_dev(struct net_device *netdev)
+{
+    pc_src_dev_map_t *m;
 
     if (!netdev)
         return PC_FALSE;
-    PC_LMT_DEBUG("get package from %s\n", netdev->name);
-    if (0 == strlen(pc_src_dev)) {
-        PC_LMT_DEBUG("match any netdev\n");
+    m = rcu_dereference(pc_src_dev_map);
+    if (!m || m->any)
         return PC_TRUE;
-    }
-    strcpy(nstr, pc_src_dev);
-    ptr = nstr;
-    while (ptr) {
-        item = strsep(&ptr, " ");
-        if (0 == strcmp(item, netdev->name)) {
-            PC_LMT_DEBUG("match net dev %s\n", netdev->name);
-            return PC_TRUE;
-        }
-    }
-    return PC_FALSE;
+    return netdev->ifindex < m->nbits && test_bit(netdev->ifindex, m->map);
 }
 
 u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev)
@@ -399,17 +436,45 @@ u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev)
     pc_rule_t *rule;
     enum ip_conntrack_info ctinfo;
     struct nf_conn *ct = NULL;
+    struct nf_conn *vct = NULL;     // ct when the packet may use its cached verdict
     enum pc_action action;
-    if (!check_source_net_dev(skb)) {
+    pc_policy_snap_t *snap;
+    pc_reasm_t *reasm = NULL;
+    u_int32_t gen, verdict;
+    u64 t_total, t;
+    int err, exhausted = 0;
+
+    if (!pc_filter_key_active())
+        return NF_ACCEPT;
+    PC_STAT_INC(PC_STAT_PACKETS);
+    t_total = pc_lat_start();
+    rcu_read_lock();
+    if (!check_source_net_dev(dev)) {
+        ret = NF_ACCEPT;
+        goto EXIT;
+    }
+    snap = pc_policy_get();
+    if (!snap) {
         ret = NF_ACCEPT;
         goto EXIT;
     }
     ct = nf_ct_get(skb, &ctinfo);
-    /*if (ct) {
-        PC_LMT_DEBUG("ctinfo %d\n", ctinfo);
-    } else {
-        PC_LMT_DEBUG("no ctinfo found\n");
-    }*/
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+    if (ct && nf_ct_is_untracked(ct))
+        ct = NULL;
+#endif
+    gen = snap->gen;
+    if (ct && CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL)
+        vct = ct;
+    if (vct) {
+        verdict = pc_ct_get_verdict(vct, gen);
+        if (verdict) {
+            PC_STAT_INC(PC_STAT_CACHE_HIT);
+            ret = (verdict == PC_VERDICT_DROP) ? NF_DROP : NF_ACCEPT;
+            goto EXIT;
+        }
+        PC_STAT_INC(PC_STAT_CACHE_MISS);
+    }
 
     memset((char *)&flow, 0x0, sizeof(flow_info_t));
     pc_get_smac(skb,  flow.smac);
@@ -418,18 +483,30 @@ u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev)
         goto EXIT;
     }
 
-    rule = get_rule_by_mac(flow.smac, &action);
+    t = pc_lat_start();
+    rule = get_rule_by_mac(snap, flow.smac, &action);
+    pc_lat_end(PC_LAT_MAC, t);
     switch (action) {
         case PC_DROP:
             PC_LMT_DEBUG("from mac %pM action is DROP\n", flow.smac);
+            pc_ct_set_verdict(vct, PC_VERDICT_DROP, gen);
             ret = NF_DROP;
             goto EXIT;
         case PC_ACCEPT:
             PC_LMT_DEBUG("from mac %pM action is ACCEPT\n", flow.smac);
+            pc_ct_set_verdict(vct, PC_VERDICT_ACCEPT, gen);
             ret = NF_ACCEPT;
             goto EXIT;
         case PC_DROP_ANONYMOUS:
-            if (ctinfo == IP_CT_ESTABLISHED || ctinfo == IP_CT_RELATED || ctinfo == IP_CT_IS_REPLY) {
+            if (!ct) {
+                // untracked, e.g. a bridge without nf_conntrack_bridge: only a SYN is known to be new
+                if (parse_flow_proto(skb, &flow) == 0 && flow.l4_protocol == IPPROTO_TCP && flow.syn) {
+                    PC_LMT_DEBUG("from mac %pM action is ANONYMOUS DROP, untracked syn\n", flow.smac);
+                    ret = NF_DROP;
+                } else {
+                    ret = NF_ACCEPT;
+                }
+            } else if (ctinfo == IP_CT_ESTABLISHED || ctinfo == IP_CT_RELATED || ctinfo == IP_CT_IS_REPLY) {
                 PC_LMT_DEBUG("from mac %pM action is match ct\n", flow.smac);
                 ret = NF_ACCEPT;
             } else {
@@ -452,23 +529,74 @@ u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev)
         goto EXIT;
     }
 
-    if (parse_flow_proto(skb, &flow) < 0) {
+    t = pc_lat_start();
+    err = parse_flow_proto(skb, &flow);
+    pc_lat_end(PC_LAT_PARSE, t);
+    if (err < 0) {
         PC_LMT_DEBUG("from mac %pM parese proto failed, ACCEPT\n", flow.smac);
         ret = NF_ACCEPT;
         goto EXIT;
     }
 
-    if (0 != dpi_main(skb, &flow)) {
-        PC_LMT_DEBUG("from mac %pM dpi failed, ACCEPT\n", flow.smac);
+    if (flow.l4_len <= 0) {
         ret = NF_ACCEPT;
         goto EXIT;
     }
 
+    if (ct) {
+        flow.ct = ct;
+        flow.dir = CTINFO2DIR(ctinfo);
+    }
+    if (pc_tls_reasm_feed(&flow, &reasm)) {
+        // the rest of a ClientHello, inspect it once the record is complete
+        if (!reasm) {
+            ret = NF_ACCEPT;
+            goto EXIT;
+        }
+        flow.l4_data = reasm->buf;
+        flow.l4_len = reasm->len;
+        flow.total_len = reasm->len;
+        // the whole ClientHello is inspected even when it ends the budget
+        pc_budget_take(ct, flow.dir);
+    } else if (ct && pc_dpi_budget_exhausted(ct, ctinfo, &flow)) {
+        // skip the parsers, port and data dictionary features still get a try
+        exhausted = 1;
+    }
+
+    if (!exhausted) {
+        t = pc_lat_start();
+        err = dpi_main(skb, &flow);
+        pc_lat_end(PC_LAT_DPI, t);
+        if (0 != err) {
+            PC_LMT_DEBUG("from mac %pM dpi failed, ACCEPT\n", flow.smac);
+            ret = NF_ACCEPT;
+            goto EXIT;
+        }
+
+        if (!reasm && flow.https.match != PC_TRUE && pc_tls_reasm_start(&flow))
+            PC_STAT_INC(PC_STAT_TLS_REASM);
+    }
+
+    t = pc_lat_start();
     app_filter_match(&flow, rule);
+    pc_lat_end(PC_LAT_MATCH, t);
 
     if (flow.app_id != 0) {
-        PC_LMT_DEBUG("match %s %pI4(%d)--> %pI4(%d) len = %d, %d\n ", IPPROTO_TCP == flow.l4_protocol ? "tcp" : "udp",
-                     &flow.src, flow.sport, &flow.dst, flow.dport, skb->len, flow.app_id);
+        if (flow.family == NFPROTO_IPV6)
+            PC_LMT_DEBUG("match %s %pI6c(%d)--> %pI6c(%d) len = %d, %d\n ", IPPROTO_TCP == flow.l4_protocol ? "tcp" : "udp",
+                         &flow.src6, flow.sport, &flow.dst6, flow.dport, skb->len, flow.app_id);
+        else
+            PC_LMT_DEBUG("match %s %pI4(%d)--> %pI4(%d) len = %d, %d\n ", IPPROTO_TCP == flow.l4_protocol ? "tcp" : "udp",
+                         &flow.src, flow.sport, &flow.dst, flow.dport, skb->len, flow.app_id);
+        pc_ct_set_verdict(vct, flow.drop ? PC_VERDICT_DROP : PC_VERDICT_ACCEPT, gen);
+    } else if (exhausted) {
+        PC_LMT_DEBUG("from mac %pM dpi budget exhausted, finish as unknown app\n", flow.smac);
+        PC_STAT_INC(PC_STAT_FINISH);
+        pc_ct_set_verdict(vct, PC_VERDICT_FINISH, gen);
+    } else if (flow.l4_protocol == IPPROTO_UDP && flow.https.match == PC_TRUE) {
+        // the rest of a QUIC flow is encrypted, its Initial decides once
+        PC_STAT_INC(PC_STAT_FINISH);
+        pc_ct_set_verdict(vct, PC_VERDICT_FINISH, gen);
     }
     if (flow.drop) {
         PC_LMT_DEBUG("Drop app %s flow, appid is %d\n", flow.app_name, flow.app_id);
@@ -477,9 +605,15 @@ u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev)
     }
     ret = NF_ACCEPT;
 EXIT:
+    rcu_read_unlock();
+    if (reasm)
+        pc_tls_reasm_free(reasm);
+    PC_STAT_INC(ret == NF_DROP ? PC_STAT_DROP : PC_STAT_ACCEPT);
+    pc_lat_end(PC_LAT_TOTAL, t_total);
     return ret;
 }
-
+// used by pc_bench.ko
+EXPORT_SYMBOL_GPL(pc_filter_hook_handle);
 
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
@@ -508,6 +642,14 @@ static struct nf_hook_ops pc_filter_ops[] __read_mostly = {
         .priority = NF_IP_PRI_MANGLE + 1,
 
     },
+#if IS_ENABLED(CONFIG_IPV6)
+    {
+        .hook = pc_filter_hook,
+        .pf = NFPROTO_IPV6,
+        .hooknum = NF_INET_FORWARD,
+        .priority = NF_IP6_PRI_MANGLE + 1,
+    },
+#endif
 };
 #else
 static struct nf_hook_ops pc_filter_ops[] __read_mostly = {
@@ -518,6 +660,97 @@ static struct nf_hook_ops pc_filter_ops[] __read_mostly = {
         .hooknum = NF_INET_FORWARD,
         .priority = NF_IP_PRI_MANGLE + 1,
     },
+#if IS_ENABLED(CONFIG_IPV6)
+    {
+        .hook = pc_filter_hook,
+        .owner = THIS_MODULE,
+        .pf = PF_INET6,
+        .hooknum = NF_INET_FORWARD,
+        .priority = NF_IP6_PRI_MANGLE + 1,
+    },
+#endif
+};
+#endif
+
+
+/*
+ * On a bridged AP the clients' traffic is switched by the bridge and never
+ * reaches NF_INET_FORWARD. With bridge mode on, bridged IPv4/IPv6 frames are
+ * run through the same handler from NF_BR_FORWARD, without br_netfilter.
+ * src_dev then names the bridge, so the port is mapped to its master.
+ * Without conntrack on the bridge (nf_conntrack_bridge, or br_netfilter)
+ * no verdict is cached and every packet of a policy device goes through
+ * DPI, and anonymous devices are only kept from opening TCP connections.
+ */
+static int pc_bridge_ct_warned;
+
+static u_int32_t pc_filter_bridge_handle(struct sk_buff *skb, const struct net_device *in)
+{
+    struct net_device *dev = (struct net_device *)in;
+    struct net_device *master;
+    enum ip_conntrack_info ctinfo;
+    u_int32_t ret;
+
+    switch (skb->protocol) {
+        case htons(ETH_P_IP):
+            if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+                return NF_ACCEPT;
+            break;
+#if IS_ENABLED(CONFIG_IPV6)
+        case htons(ETH_P_IPV6):
+            if (!pskb_may_pull(skb, sizeof(struct ipv6hdr)))
+                return NF_ACCEPT;
+            break;
+#endif
+        default:
+            return NF_ACCEPT;
+    }
+    skb_reset_network_header(skb);
+    if (!pc_bridge_ct_warned && !nf_ct_get(skb, &ctinfo)) {
+        pc_bridge_ct_warned = 1;
+        PC_INFO("bridged traffic is not conntracked, load nf_conntrack_bridge to cache verdicts\n");
+    }
+    rcu_read_lock();
+    master = dev ? netdev_master_upper_dev_get_rcu(dev) : NULL;
+    ret = pc_filter_hook_handle(skb, master ? master : dev);
+    rcu_read_unlock();
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+static u_int32_t pc_filter_bridge_hook(void *priv,
+                                       struct sk_buff *skb,
+                                       const struct nf_hook_state *state)
+{
+    return pc_filter_bridge_handle(skb, state->in);
+}
+
+static struct nf_hook_ops pc_filter_bridge_ops[] __read_mostly = {
+    {
+        .hook = pc_filter_bridge_hook,
+        .pf = NFPROTO_BRIDGE,
+        .hooknum = NF_BR_FORWARD,
+        .priority = NF_BR_PRI_FILTER_BRIDGED + 1,
+    },
+};
+#else
+static u_int32_t pc_filter_bridge_hook(unsigned int hook,
+                                       struct sk_buff *skb,
+                                       const struct net_device *in,
+                                       const struct net_device *out,
+                                       int (*okfn)(struct sk_buff *))
+{
+    return pc_filter_bridge_handle(skb, in);
+}
+
+static struct nf_hook_ops pc_filter_bridge_ops[] __read_mostly = {
+    {
+        .hook = pc_filter_bridge_hook,
+        .owner = THIS_MODULE,
+        .pf = NFPROTO_BRIDGE,
+        .hooknum = NF_BR_FORWARD,
+        .priority = NF_BR_PRI_FILTER_BRIDGED + 1,
+    },
 };
 #endif
 
@@ -531,6 +764,10 @@ static int pc_handle_shortcut_fe(struct sk_buff *skb)
     struct rtable *rt;
     int err;
 
+    // skip the route lookup while no policy needs the filter
+    if (!pc_filter_key_active())
+        return NET_RX_SUCCESS;
+
     rcu_read_lock();
     fast_recv = rcu_dereference(athrs_fast_nat_recv);
     rcu_read_unlock();
@@ -580,13 +817,96 @@ static void pc_rpc_pointer_init(void) {}
 static void pc_rpc_pointer_exit(void) {}
 #endif
 
-int pc_filter_init(void)
+static int pc_register_hooks(struct nf_hook_ops *ops, int n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+    return nf_register_net_hooks(&init_net, ops, n);
+#else
+    return nf_register_hooks(ops, n);
+#endif
+}
+
+static void pc_unregister_hooks(struct nf_hook_ops *ops, int n)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
-    nf_register_net_hooks(&init_net, pc_filter_ops, ARRAY_SIZE(pc_filter_ops));
+    nf_unregister_net_hooks(&init_net, ops, n);
 #else
-    nf_register_hooks(pc_filter_ops, ARRAY_SIZE(pc_filter_ops));
+    nf_unregister_hooks(ops, n);
 #endif
+}
+
+/*
+ * The hooks are only registered, and the static key only enabled, while
+ * the policy can affect a packet: some group has a MAC or anonymous
+ * devices are dropped. Idle installs cost nothing on the forwarding path.
+ */
+static DEFINE_MUTEX(pc_hook_mutex);
+static int pc_hook_ready;
+static int pc_hook_active;
+static int pc_bridge_enabled;
+static int pc_inet_registered;
+static int pc_bridge_registered;
+
+static void pc_apply_hooks(void)
+{
+    int inet = pc_hook_ready && pc_hook_active;
+    int bridge = inet && pc_bridge_enabled;
+
+    if (inet)
+        pc_filter_key_enable();
+    if (inet && !pc_inet_registered) {
+        if (pc_register_hooks(pc_filter_ops, ARRAY_SIZE(pc_filter_ops)))
+            PC_ERROR("register filter hooks failed\n");
+        else
+            pc_inet_registered = 1;
+    }
+    if (bridge && !pc_bridge_registered) {
+        if (pc_register_hooks(pc_filter_bridge_ops, ARRAY_SIZE(pc_filter_bridge_ops)))
+            PC_ERROR("register bridge hook failed\n");
+        else
+            pc_bridge_registered = 1;
+    }
+    if (!bridge && pc_bridge_registered) {
+        pc_unregister_hooks(pc_filter_bridge_ops, ARRAY_SIZE(pc_filter_bridge_ops));
+        pc_bridge_registered = 0;
+    }
+    if (!inet && pc_inet_registered) {
+        pc_unregister_hooks(pc_filter_ops, ARRAY_SIZE(pc_filter_ops));
+        pc_inet_registered = 0;
+    }
+    if (!inet)
+        pc_filter_key_disable();
+    PC_DEBUG("filter hooks %s, bridge hook %s\n", pc_inet_registered ? "on" : "off",
+             pc_bridge_registered ? "on" : "off");
+}
+
+// called by the policy whenever a new snapshot is published
+void pc_filter_sync_hooks(int active)
+{
+    mutex_lock(&pc_hook_mutex);
+    pc_hook_active = active;
+    pc_apply_hooks();
+    mutex_unlock(&pc_hook_mutex);
+}
+
+void pc_filter_set_bridge(int enable)
+{
+    mutex_lock(&pc_hook_mutex);
+    pc_bridge_enabled = enable;
+    pc_apply_hooks();
+    mutex_unlock(&pc_hook_mutex);
+}
+
+int pc_filter_init(void)
+{
+    if (register_netdevice_notifier(&pc_netdev_notifier))
+        return -1;
+    pc_tls_reasm_init();
+    pc_budget_init();
+    mutex_lock(&pc_hook_mutex);
+    pc_hook_ready = 1;
+    pc_apply_hooks();
+    mutex_unlock(&pc_hook_mutex);
     pc_rpc_pointer_init();
     return 0;
 }
@@ -594,11 +914,15 @@ int pc_filter_init(void)
 void pc_filter_exit(void)
 {
     pc_rpc_pointer_exit();
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
-    nf_unregister_net_hooks(&init_net, pc_filter_ops, ARRAY_SIZE(pc_filter_ops));
-#else
-    nf_unregister_hooks(pc_filter_ops, ARRAY_SIZE(pc_filter_ops));
-#endif
+    mutex_lock(&pc_hook_mutex);
+    pc_hook_ready = 0;
+    pc_apply_hooks();
+    mutex_unlock(&pc_hook_mutex);
+    // a later load must not pick up the verdicts of this one
+    pc_filter_flush_verdicts(PC_GEN_NONE, 1);
+    pc_tls_reasm_exit();
+    pc_budget_exit();
+    unregister_netdevice_notifier(&pc_netdev_notifier);
+    kfree(rcu_dereference_protected(pc_src_dev_map, 1));
     return;
 }
-
@@ -0,0 +1,96 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <kunit/test.h>
+#include "pc_policy.h"
+
+/*
+ * KUnit suite around the in-source TEST_xxx() self tests, built when the
+ * kernel has CONFIG_KUNIT. Every PC_TEST() that fails fails the running
+ * case, the bench case reports the PC_TEST_BENCH() timings as ns/op.
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=net/parental_control
+ *
+ * Before 6.0 a module could not hold KUnit suites next to its own
+ * module_init(), the suite is then only there when built into the kernel.
+ */
+#if !defined(MODULE) || LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+static struct kunit *pc_kunit_test;
+
+static void pc_kunit_fail(const char *expr, const char *func, int line)
+{
+    KUNIT_FAIL(pc_kunit_test, "%s:%d %s failed", func, line, expr);
+}
+
+static void pc_kunit_bench(const char *name, u64 ns_per_op)
+{
+    kunit_info(pc_kunit_test, "%-24s %llu ns/op\n", name, (unsigned long long)ns_per_op);
+}
+
+static int pc_kunit_init(struct kunit *test)
+{
+    pc_kunit_test = test;
+    pc_test_bench_on = 0;
+    pc_test_fail_hook = pc_kunit_fail;
+    pc_test_bench_hook = pc_kunit_bench;
+    return 0;
+}
+
+static void pc_kunit_exit(struct kunit *test)
+{
+    pc_test_fail_hook = NULL;
+    pc_test_bench_hook = NULL;
+    pc_test_bench_on = 0;
+    pc_kunit_test = NULL;
+}
+
+static void pc_kunit_regexp(struct kunit *test)
+{
+    TEST_regexp();
+}
+
+static void pc_kunit_app(struct kunit *test)
+{
+    TEST_app();
+}
+
+static void pc_kunit_dpi(struct kunit *test)
+{
+    TEST_dpi();
+}
+
+static void pc_kunit_quic(struct kunit *test)
+{
+    TEST_quic();
+}
+
+static void pc_kunit_bench_all(struct kunit *test)
+{
+    pc_test_bench_on = 1;
+    TEST_regexp();
+    TEST_app();
+    TEST_dpi();
+    TEST_quic();
+}
+
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW(f) KUNIT_CASE(f)
+#endif
+
+static struct kunit_case pc_kunit_cases[] = {
+    KUNIT_CASE(pc_kunit_regexp),
+    KUNIT_CASE(pc_kunit_app),
+    KUNIT_CASE(pc_kunit_dpi),
+    KUNIT_CASE(pc_kunit_quic),
+    KUNIT_CASE_SLOW(pc_kunit_bench_all),
+    {}
+};
+
+static struct kunit_suite pc_kunit_suite = {
+    .name = "parental_control",
+    .init = pc_kunit_init,
+    .exit = pc_kunit_exit,
+    .test_cases = pc_kunit_cases,
+};
+kunit_test_suite(pc_kunit_suite);
+#endif
@@ -0,0 +1,380 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/if_ether.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/in.h>
+#include "pc_policy.h"
+
+/*
+ * Per-rule matcher, built when the rule is created and immutable after.
+ * It holds the rule's blacklist entries followed by the features of the
+ * apps and classes the rule references, in feature list order. An entry is
+ * known by its position in that array and every index below keeps
+ * positions sorted, so merging them visits entries in array order and the
+ * first match is the one a full walk would find.
+ *
+ * Entries that can only match through a host_url with a literal ("host
+ * only") are found by the host prefilter: the literals go in one
+ * Aho-Corasick automaton, a single scan of the host gives the candidates.
+ * All other entries are indexed by protocol and destination port.
+ */
+struct pc_host_ac {
+    int nstates;
+    int ncls;
+    u8 cls_map[256];        // byte -> class, 0 for bytes in no literal
+    u_int16_t *next;        // nstates * ncls, complete goto function
+    u_int32_t *out_off;     // nstates + 1, outputs of state s are out[out_off[s]..out_off[s+1])
+    u_int16_t *out;         // entry positions, including those of the suffix states
+};
+typedef struct pc_host_ac pc_host_ac_t;
+
+#define MAX_HOST_AC_STATES 0xffff
+
+static void pc_free_host_ac(pc_host_ac_t *ac)
+{
+    if (!ac)
+        return;
+    vfree(ac->next);
+    kfree(ac->out_off);
+    kfree(ac->out);
+    kfree(ac);
+}
+
+static pc_host_ac_t *pc_new_host_ac(char (*lits)[MAX_HOST_URL_LEN], u_int16_t *lit_pos, int num)
+{
+    pc_host_ac_t *ac;
+    u_int16_t *own_next = NULL, *own_head = NULL;
+    u_int32_t *fail = NULL, *queue = NULL, *cnt = NULL;
+    int total = 1, i, c, s, t, head, tail, pos;
+    u8 *p;
+
+    ac = kzalloc(sizeof(pc_host_ac_t), GFP_KERNEL);
+    if (!ac)
+        return NULL;
+    for (i = 0; i < num; i++) {
+        for (p = (u8 *)lits[i]; *p; p++) {
+            if (!ac->cls_map[*p])
+                ac->cls_map[*p] = ++ac->ncls;
+            total++;
+        }
+    }
+    ac->ncls++;
+    if (total > MAX_HOST_AC_STATES)
+        goto fail;
+
+    ac->next = vzalloc(total * ac->ncls * sizeof(u_int16_t));
+    own_next = kcalloc(num, sizeof(u_int16_t), GFP_KERNEL);
+    own_head = kcalloc(total, sizeof(u_int16_t), GFP_KERNEL);
+    fail = kcalloc(total, sizeof(u_int32_t), GFP_KERNEL);
+    queue = kcalloc(total, sizeof(u_int32_t), GFP_KERNEL);
+    cnt = kcalloc(total, sizeof(u_int32_t), GFP_KERNEL);
+    ac->out_off = kcalloc(total + 1, sizeof(u_int32_t), GFP_KERNEL);
+    if (!ac->next || !own_next || !own_head || !fail || !queue || !cnt || !ac->out_off)
+        goto fail;
+
+    // trie, 0 is the root and never a child so a 0 entry means no edge yet
+    ac->nstates = 1;
+    for (i = 0; i < num; i++) {
+        s = 0;
+        for (p = (u8 *)lits[i]; *p; p++) {
+            c = ac->cls_map[*p];
+            if (!ac->next[s * ac->ncls + c])
+                ac->next[s * ac->ncls + c] = ac->nstates++;
+            s = ac->next[s * ac->ncls + c];
+        }
+        // own_head/own_next keep 1-based literal numbers per end state
+        own_next[i] = own_head[s];
+        own_head[s] = i + 1;
+    }
+
+    // breadth first: failure links, missing edges and output counts
+    head = tail = 0;
+    for (c = 0; c < ac->ncls; c++) {
+        t = ac->next[c];
+        if (t)
+            queue[tail++] = t;
+    }
+    while (head < tail) {
+        s = queue[head++];
+        for (i = own_head[s]; i; i = own_next[i - 1])
+            cnt[s]++;
+        cnt[s] += cnt[fail[s]];
+        for (c = 0; c < ac->ncls; c++) {
+            t = ac->next[s * ac->ncls + c];
+            if (t) {
+                fail[t] = ac->next[fail[s] * ac->ncls + c];
+                queue[tail++] = t;
+            } else {
+                ac->next[s * ac->ncls + c] = ac->next[fail[s] * ac->ncls + c];
+            }
+        }
+    }
+
+    for (s = 0; s < ac->nstates; s++)
+        ac->out_off[s + 1] = ac->out_off[s] + cnt[s];
+    ac->out = kcalloc(ac->out_off[ac->nstates] + 1, sizeof(u_int16_t), GFP_KERNEL);
+    if (!ac->out)
+        goto fail;
+    for (head = 0; head < tail; head++) {
+        s = queue[head];
+        pos = ac->out_off[s];
+        for (i = own_head[s]; i; i = own_next[i - 1])
+            ac->out[pos++] = lit_pos[i - 1];
+        for (i = ac->out_off[fail[s]]; i < ac->out_off[fail[s] + 1]; i++)
+            ac->out[pos++] = ac->out[i];
+    }
+    goto out;
+fail:
+    pc_free_host_ac(ac);
+    ac = NULL;
+out:
+    kfree(own_next);
+    kfree(own_head);
+    kfree(fail);
+    kfree(queue);
+    kfree(cnt);
+    return ac;
+}
+
+/*
+ * Port index: an entry whose destination ports are a few plain ports or
+ * small ranges is listed under each port, any other one (no port, a "!"
+ * port or a wide range) is in the any bucket.
+ */
+#define MAX_PORT_INDEX_SPAN 64
+
+static int pc_port_indexable(port_info_t *info)
+{
+    int i;
+    if (info->num == 0)
+        return PC_FALSE;
+    for (i = 0; i < info->num; i++) {
+        if (info->range_list[i].not)
+            return PC_FALSE;
+        if (info->range_list[i].end - info->range_list[i].start >= MAX_PORT_INDEX_SPAN)
+            return PC_FALSE;
+    }
+    return PC_TRUE;
+}
+
+static int pc_cmp_u32(const void *a, const void *b)
+{
+    u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void pc_free_port_index(pc_port_index_t *pi)
+{
+    kfree(pi->ports);
+    kfree(pi->off);
+    kfree(pi->idx);
+    kfree(pi->any);
+    memset(pi, 0x0, sizeof(pc_port_index_t));
+}
+
+static int pc_new_port_index(pc_port_index_t *pi, pc_app_t **apps, int num, u8 *skip, int proto)
+{
+    u_int32_t *pairs = NULL;
+    range_value_t *range;
+    int npairs = 0, nany = 0, i, k, port, ret = -1;
+
+    memset(pi, 0x0, sizeof(pc_port_index_t));
+    for (i = 0; i < num; i++) {
+        if (skip[i] || (apps[i]->proto > 0 && apps[i]->proto != proto))
+            continue;
+        if (!pc_port_indexable(&apps[i]->dport_info)) {
+            nany++;
+            continue;
+        }
+        for (k = 0; k < apps[i]->dport_info.num; k++) {
+            range = &apps[i]->dport_info.range_list[k];
+            if (range->end >= range->start)
+                npairs += range->end - range->start + 1;
+        }
+    }
+    // one spare entry so nothing below is a zero sized allocation
+    pairs = kcalloc(npairs + 1, sizeof(u_int32_t), GFP_KERNEL);
+    pi->any = kcalloc(nany + 1, sizeof(u_int16_t), GFP_KERNEL);
+    pi->ports = kcalloc(npairs + 1, sizeof(u_int16_t), GFP_KERNEL);
+    pi->off = kcalloc(npairs + 2, sizeof(u_int32_t), GFP_KERNEL);
+    pi->idx = kcalloc(npairs + 1, sizeof(u_int16_t), GFP_KERNEL);
+    if (!pairs || !pi->any || !pi->ports || !pi->off || !pi->idx)
+        goto EXIT;
+
+    npairs = 0;
+    for (i = 0; i < num; i++) {
+        if (skip[i] || (apps[i]->proto > 0 && apps[i]->proto != proto))
+            continue;
+        if (!pc_port_indexable(&apps[i]->dport_info)) {
+            pi->any[pi->any_num++] = i;
+            continue;
+        }
+        for (k = 0; k < apps[i]->dport_info.num; k++) {
+            range = &apps[i]->dport_info.range_list[k];
+            for (port = range->start; port <= range->end; port++)
+                pairs[npairs++] = (port & 0xffff) << 16 | i;
+        }
+    }
+    sort(pairs, npairs, sizeof(u_int32_t), pc_cmp_u32, NULL);
+
+    k = 0;
+    for (i = 0; i < npairs; i++) {
+        if (i > 0 && pairs[i] == pairs[i - 1])
+            continue;
+        if (pi->nports == 0 || pi->ports[pi->nports - 1] != pairs[i] >> 16) {
+            pi->ports[pi->nports] = pairs[i] >> 16;
+            pi->off[pi->nports++] = k;
+        }
+        pi->idx[k++] = pairs[i] & 0xffff;
+    }
+    pi->off[pi->nports] = k;
+    ret = 0;
+EXIT:
+    kfree(pairs);
+    if (ret)
+        pc_free_port_index(pi);
+    return ret;
+}
+
+/*
+ * Entries listed under port, sorted by position, the any bucket comes on
+ * top of them.
+ */
+int pc_port_index_lookup(pc_port_index_t *pi, u_int16_t port, const u_int16_t **list)
+{
+    int lo = 0, hi = pi->nports;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pi->ports[mid] == port) {
+            *list = &pi->idx[pi->off[mid]];
+            return pi->off[mid + 1] - pi->off[mid];
+        }
+        if (pi->ports[mid] < port)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *list = NULL;
+    return 0;
+}
+
+/* a host only entry is looked up by its host literal, lit gets the literal */
+static int pc_host_only(pc_app_t *app, char *lit)
+{
+    if (!app->host_re || strlen(app->request_url) > 0)
+        return PC_FALSE;
+    return regexp_literal(app->host_url, lit, MAX_HOST_URL_LEN) > 0;
+}
+
+void pc_free_matcher(pc_matcher_t *m)
+{
+    if (!m)
+        return;
+    pc_free_port_index(&m->tcp);
+    pc_free_port_index(&m->udp);
+    pc_free_host_ac(m->host);
+    kfree(m->host_all);
+    kfree(m->apps);
+    kfree(m);
+}
+
+/*
+ * apps[0..nblist) are the blacklist entries, the array is copied. May
+ * sleep, returns NULL on failure.
+ */
+pc_matcher_t *pc_new_matcher(pc_app_t **apps, int num, int nblist)
+{
+    pc_matcher_t *m;
+    char (*lits)[MAX_HOST_URL_LEN] = NULL;
+    u8 *host_only = NULL;
+    int i;
+
+    if (num > MAX_HOST_AC_STATES)
+        return NULL;
+    m = kzalloc(sizeof(pc_matcher_t), GFP_KERNEL);
+    if (!m)
+        return NULL;
+    // one spare entry so nothing below is a zero sized allocation
+    m->apps = kcalloc(num + 1, sizeof(pc_app_t *), GFP_KERNEL);
+    m->host_all = kcalloc(num + 1, sizeof(u_int16_t), GFP_KERNEL);
+    host_only = kcalloc(num + 1, sizeof(u8), GFP_KERNEL);
+    lits = vmalloc((num + 1) * sizeof(*lits));
+    if (!m->apps || !m->host_all || !host_only || !lits)
+        goto fail;
+    memcpy(m->apps, apps, num * sizeof(pc_app_t *));
+    m->num = num;
+    m->nblist = nblist;
+
+    for (i = 0; i < num; i++) {
+        if (!pc_host_only(apps[i], lits[m->host_num]))
+            continue;
+        host_only[i] = 1;
+        m->host_all[m->host_num++] = i;
+    }
+    if (m->host_num > 0) {
+        m->host = pc_new_host_ac(lits, m->host_all, m->host_num);
+        if (!m->host)
+            goto fail;
+    }
+    if (pc_new_port_index(&m->tcp, apps, num, host_only, IPPROTO_TCP))
+        goto fail;
+    if (pc_new_port_index(&m->udp, apps, num, host_only, IPPROTO_UDP))
+        goto fail;
+    vfree(lits);
+    kfree(host_only);
+    return m;
+fail:
+    vfree(lits);
+    kfree(host_only);
+    pc_free_matcher(m);
+    return NULL;
+}
+
+static int pc_host_cand_add(flow_info_t *flow, u_int16_t index)
+{
+    int lo = 0, hi = flow->host_cand_num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (flow->host_cand[mid] == index)
+            return 0;
+        if (flow->host_cand[mid] < index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (flow->host_cand_num >= MAX_HOST_CANDIDATE_NUM)
+        return -1;
+    memmove(&flow->host_cand[lo + 1], &flow->host_cand[lo],
+            (flow->host_cand_num - lo) * sizeof(u_int16_t));
+    flow->host_cand[lo] = index;
+    flow->host_cand_num++;
+    return 0;
+}
+
+/* fill the host candidates of flow, sorted positions or -1 for all */
+void pc_matcher_scan_host(pc_matcher_t *m, flow_info_t *flow)
+{
+    pc_host_ac_t *ac = m->host;
+    unsigned char *p;
+    u_int32_t i, s = 0;
+
+    flow->host_cand_num = -1;
+    if (!ac)
+        return;
+    flow->host_cand_num = 0;
+    for (p = (unsigned char *)flow->host_buf; *p; p++) {
+        s = ac->next[s * ac->ncls + ac->cls_map[*p]];
+        for (i = ac->out_off[s]; i < ac->out_off[s + 1]; i++) {
+            if (pc_host_cand_add(flow, ac->out[i])) {
+                flow->host_cand_num = -1;
+                return;
+            }
+        }
+    }
+}
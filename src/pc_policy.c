@@ -5,65 +5,143 @@
 #include <linux/inet.h>
 #include <linux/if_ether.h>
 #include <linux/etherdevice.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/bitops.h>
 #include "pc_policy.h"
 #include "cJSON.h"
 
 struct list_head pc_rule_head = LIST_HEAD_INIT(pc_rule_head);
 struct list_head pc_group_head = LIST_HEAD_INIT(pc_group_head);
 
-DEFINE_RWLOCK(pc_policy_lock);
+/*
+ * Rules and groups are only touched from process context under
+ * pc_policy_mutex. The data path never sees them directly, it reads the
+ * MAC->rule snapshot published through pc_policy_snap under RCU. Rules are
+ * immutable once a snapshot refers to them: set_pc_rule() replaces the
+ * whole rule and the old one is freed after a grace period.
+ */
+DEFINE_MUTEX(pc_policy_mutex);
+static pc_policy_snap_t __rcu *pc_policy_snap;
+static u_int32_t pc_policy_gen = 0;
+static u_int32_t pc_policy_gen_seed = 0;   // the first generation of this load
+
+static inline u32 pc_mac_hash_key(const u8 *mac)
+{
+    return jhash(mac, ETH_ALEN, 0) & (MAX_HC_CLIENT_HASH_SIZE - 1);
+}
+
+/*
+ * Build a new snapshot from pc_group_head and swap it in. Every snapshot
+ * gets a new generation, which invalidates the verdicts cached in conntrack
+ * marks. When the generation wraps to the seed, the marks made under the
+ * previous use of each value are cleared first. On return no reader can
+ * still see the previous snapshot or the rules only it referred to. Must be
+ * called with pc_policy_mutex held.
+ */
+static void pc_policy_publish(void)
+{
+    pc_policy_snap_t *snap, *old;
+    pc_group_t *group;
+    pc_mac_t *mac;
+    pc_mac_entry_t *entry;
+    u_int32_t gen = 0;
+    int num = 0, wrap = 0;
+
+    list_for_each_entry(group, &pc_group_head, head) {
+        list_for_each_entry(mac, &group->macs, head)
+            num++;
+    }
+    snap = kzalloc(sizeof(pc_policy_snap_t) + num * sizeof(pc_mac_entry_t), GFP_KERNEL);
+    if (snap == NULL) {
+        PC_ERROR("malloc policy snapshot memory error, all devices accepted\n");
+    } else {
+        gen = (pc_policy_gen + 1) & pc_gen_mask;
+        // nothing is marked with gen yet, drop what was marked under it last time
+        wrap = (gen == pc_policy_gen_seed);
+        if (wrap)
+            pc_filter_flush_verdicts(gen, 0);
+        pc_policy_gen = gen;
+        snap->gen = gen;
+        snap->num = num;
+        entry = snap->entries;
+        // reverse order so that the first group in the list wins for duplicated MACs
+        list_for_each_entry_reverse(group, &pc_group_head, head) {
+            list_for_each_entry(mac, &group->macs, head) {
+                memcpy(entry->mac, mac->mac, ETH_ALEN);
+                entry->rule = group->rule;
+                hlist_add_head(&entry->hlist, &snap->mac_hash[pc_mac_hash_key(entry->mac)]);
+                entry++;
+            }
+        }
+    }
+    old = rcu_dereference_protected(pc_policy_snap, lockdep_is_held(&pc_policy_mutex));
+    rcu_assign_pointer(pc_policy_snap, snap);
+    synchronize_rcu();
+    kfree(old);
+    // every older generation is stale now, start the new cycle clean
+    if (wrap)
+        pc_filter_flush_verdicts(gen, 1);
+    pc_filter_sync_hooks(snap && (num || READ_ONCE(pc_drop_anonymous)));
+}
+
+void pc_policy_changed(void)
+{
+    pc_policy_lock();
+    pc_policy_publish();
+    pc_policy_unlock();
+}
+
+/* must be called under rcu_read_lock(), may return NULL */
+pc_policy_snap_t *pc_policy_get(void)
+{
+    return rcu_dereference(pc_policy_snap);
+}
+
 static void rule_init_list(pc_rule_t *rule)
 {
-    rule->blist.next = &rule->blist;
-    rule->blist.prev = &rule->blist;
+    rule->blist = NULL;
     rule->applist.next = &rule->applist;
     rule->applist.prev = &rule->applist;
 }
 
 static void rule_clean_list(pc_rule_t *rule)
 {
-    pc_app_t *app;
     pc_app_index_t *index;
-    while (!list_empty(&rule->blist)) {
-        app = list_first_entry(&rule->blist, pc_app_t, head);
-        list_del(&(app->head));
-        kfree(app);
-    }
+    pc_free_app_table(rule->blist);
+    rule->blist = NULL;
     while (!list_empty(&rule->applist)) {
         index = list_first_entry(&rule->applist, pc_app_index_t, head);
         list_del(&(index->head));
         kfree(index);
     }
+    kfree(rule->app_ids);
+    rule->app_ids = NULL;
+    rule->app_num = 0;
 }
 
-static int rule_add_blist_item(pc_rule_t *rule, const char *str)
-{
-    pc_app_t *node = NULL;
-    node = kzalloc(sizeof(pc_app_t), GFP_KERNEL);
-    if (node == NULL) {
-        printk("malloc feature memory error\n");
-        return -1;
-    } else {
-        if (!pc_set_app_by_str(node, BLIST_ID, "blacklist", str)) {
-            list_add(&(node->head), &rule->blist);
-        } else {
-            kfree(node);
-            return -1;
-        }
-    }
-    return 0;
-}
-
+// the last item of the list is tried first
 static void rule_add_blist(pc_rule_t *rule, cJSON *list)
 {
     int size, j;
     cJSON *item = NULL;
     if (list) {
         size = cJSON_GetArraySize(list);
-        for (j = 0; j < size; j++) {
+        if (size <= 0)
+            return;
+        rule->blist = pc_new_app_table(size);
+        if (!rule->blist) {
+            printk("malloc feature memory error\n");
+            return;
+        }
+        for (j = size - 1; j >= 0; j--) {
             item = cJSON_GetArrayItem(list, j);
-            if (item) {
-                rule_add_blist_item(rule, item->valuestring);
+            if (item && item->valuestring) {
+                pc_add_app_by_str(rule->blist, BLIST_ID, "blacklist", item->valuestring);
             }
         }
     }
@@ -83,10 +161,17 @@ static int rule_add_applist_item(pc_rule_t *rule, u_int32_t id)
     return 0;
 }
 
+static int cmp_app_id(const void *a, const void *b)
+{
+    u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
 static void rule_add_applist(pc_rule_t *rule, cJSON *list)
 {
     int size, j;
     cJSON *item = NULL;
+    pc_app_index_t *index;
     if (list) {
         size = cJSON_GetArraySize(list);
         for (j = 0; j < size; j++) {
@@ -96,103 +181,212 @@ static void rule_add_applist(pc_rule_t *rule, cJSON *list)
             }
         }
     }
+
+    size = 0;
+    list_for_each_entry(index, &rule->applist, head)
+        size++;
+    if (size == 0)
+        return;
+    rule->app_ids = kcalloc(size, sizeof(u_int32_t), GFP_KERNEL);
+    if (!rule->app_ids) {
+        PC_ERROR("rule %s malloc app ids error\n", rule->id);
+        return;
+    }
+    list_for_each_entry(index, &rule->applist, head)
+        rule->app_ids[rule->app_num++] = index->app_id;
+    sort(rule->app_ids, rule->app_num, sizeof(u_int32_t), cmp_app_id, NULL);
+    for (size = 0, j = 0; j < rule->app_num; j++) {
+        if (size == 0 || rule->app_ids[size - 1] != rule->app_ids[j])
+            rule->app_ids[size++] = rule->app_ids[j];
+    }
+    rule->app_num = size;
 }
 
+static int rule_has_app_id(pc_rule_t *rule, u_int32_t id)
+{
+    int lo = 0, hi = rule->app_num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (rule->app_ids[mid] == id)
+            return PC_TRUE;
+        if (rule->app_ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return PC_FALSE;
+}
 
-int add_pc_rule(const char *id,  cJSON *applist, enum pc_action action,
-                cJSON *blist)
+int pc_rule_has_app(pc_rule_t *rule, u_int32_t app)
+{
+    if (app < MAX_APP_IN_CLASS) {
+        return PC_FALSE;
+    }
+    if (rule_has_app_id(rule, app))
+        return PC_TRUE;
+    //如果单个应用不匹配，进一步检查是否匹配应用类型
+    return rule_has_app_id(rule, app / MAX_APP_IN_CLASS);
+}
+
+/*
+ * The feature table does not change after load, so the matcher can keep
+ * pointers into it. Without a matcher the data path walks the blacklist
+ * and the whole feature table.
+ */
+static void rule_build_matcher(pc_rule_t *rule)
+{
+    pc_app_table_t *t = rcu_dereference_protected(pc_app_table, 1);
+    pc_app_t **apps, *app;
+    int num = 0, nblist = 0;
+
+    if (rule->blist)
+        nblist = rule->blist->num;
+    pc_for_each_app(app, t) {
+        if (pc_rule_has_app(rule, app->app_id))
+            num++;
+    }
+    apps = kcalloc(nblist + num + 1, sizeof(pc_app_t *), GFP_KERNEL);
+    if (!apps) {
+        PC_ERROR("rule %s malloc matcher error\n", rule->id);
+        return;
+    }
+    num = 0;
+    if (rule->blist) {
+        pc_for_each_app(app, rule->blist)
+            apps[num++] = app;
+    }
+    pc_for_each_app(app, t) {
+        if (pc_rule_has_app(rule, app->app_id))
+            apps[num++] = app;
+    }
+    rule->matcher = pc_new_matcher(apps, num, nblist);
+    if (!rule->matcher)
+        PC_ERROR("rule %s build matcher error\n", rule->id);
+    kfree(apps);
+}
+
+static pc_rule_t *new_pc_rule(const char *id,  cJSON *applist, enum pc_action action,
+                              cJSON *blist)
 {
     pc_rule_t *rule = NULL;
     rule = kzalloc(sizeof(pc_rule_t), GFP_KERNEL);
     if (rule == NULL) {
         printk("malloc pc_rule_t memory error\n");
-        return -1;
-    } else {
-        memcpy(rule->id, id, RULE_ID_SIZE);
-        rule->action = action;
-        rule->refer_count = 0;
-        rule_init_list(rule);
-        rule_add_blist(rule, blist);
-        rule_add_applist(rule, applist);
-        pc_policy_write_lock();
-        list_add(&rule->head, &pc_rule_head);
-        pc_policy_write_unlock();
+        return NULL;
     }
+    strncpy(rule->id, id, RULE_ID_SIZE - 1);
+    rule->action = action;
+    rule->refer_count = 0;
+    rule_init_list(rule);
+    rule_add_blist(rule, blist);
+    rule_add_applist(rule, applist);
+    rule_build_matcher(rule);
+    return rule;
+}
+
+static void free_pc_rule(pc_rule_t *rule)
+{
+    pc_free_matcher(rule->matcher);
+    rule_clean_list(rule);
+    kfree(rule);
+}
+
+int add_pc_rule(const char *id,  cJSON *applist, enum pc_action action,
+                cJSON *blist)
+{
+    pc_rule_t *rule = NULL;
+    rule = new_pc_rule(id, applist, action, blist);
+    if (rule == NULL)
+        return -1;
+    pc_policy_lock();
+    list_add(&rule->head, &pc_rule_head);
+    pc_policy_unlock();
     return 0;
 }
 
 int remove_pc_rule(const char *id)
 {
     pc_rule_t *rule = NULL, *n;
-    if (!list_empty(&pc_rule_head)) {
-        list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
-            if (strcmp(rule->id, id) == 0) {
-                if (rule->refer_count > 0) {
-                    printk("refer_count of rule != 0\n");
-                    return -1;
-                }
-                pc_policy_write_lock();
-                list_del(&rule->head);
-                rule_clean_list(rule);
-                kfree(rule);
-                pc_policy_write_unlock();
+    int ret = 0;
+    pc_policy_lock();
+    list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
+        if (strcmp(rule->id, id) == 0) {
+            if (rule->refer_count > 0) {
+                printk("refer_count of rule != 0\n");
+                ret = -1;
+                goto out;
             }
+            // no group refers to it, so neither does the current snapshot
+            list_del(&rule->head);
+            free_pc_rule(rule);
         }
     }
-    return 0;
+out:
+    pc_policy_unlock();
+    return ret;
 }
 
 int clean_pc_rule(void)
 {
     pc_rule_t *rule = NULL;
-    pc_policy_write_lock();
-    while (!list_empty(&pc_rule_head)) {
-        rule = list_first_entry(&pc_rule_head, pc_rule_t, head);
+    pc_group_t *group = NULL;
+    LIST_HEAD(old_rules);
+    pc_policy_lock();
+    list_splice_init(&pc_rule_head, &old_rules);
+    list_for_each_entry(group, &pc_group_head, head) {
+        group->rule = NULL;
+    }
+    pc_policy_publish();
+    pc_policy_unlock();
+    while (!list_empty(&old_rules)) {
+        rule = list_first_entry(&old_rules, pc_rule_t, head);
         list_del(&rule->head);
-        rule_clean_list(rule);
-        kfree(rule);
+        free_pc_rule(rule);
     }
-    pc_policy_write_unlock();
     return 0;
 }
 
 int set_pc_rule(const char *id, cJSON *applist, enum pc_action action,
                 cJSON *blist)
 {
-    pc_rule_t *rule = NULL, *n;
-    if (!list_empty(&pc_rule_head)) {
-        list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
-            if (strcmp(rule->id, id) == 0) {
-                pc_policy_write_lock();
-                memcpy(rule->id, id, RULE_ID_SIZE);
-                rule_clean_list(rule);
-                rule_init_list(rule);
-                rule_add_blist(rule, blist);
-                rule_add_applist(rule, applist);
-                rule->action = action;
-                pc_policy_write_unlock();
+    pc_rule_t *rule = NULL, *n, *new_rule;
+    pc_group_t *group = NULL;
+    LIST_HEAD(old_rules);
+    pc_policy_lock();
+    list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
+        if (strcmp(rule->id, id) == 0) {
+            new_rule = new_pc_rule(id, applist, action, blist);
+            if (new_rule == NULL)
+                continue;
+            new_rule->refer_count = rule->refer_count;
+            list_replace(&rule->head, &new_rule->head);
+            list_for_each_entry(group, &pc_group_head, head) {
+                if (group->rule == rule)
+                    group->rule = new_rule;
             }
+            list_add(&rule->head, &old_rules);
         }
     }
+    if (!list_empty(&old_rules))
+        pc_policy_publish();
+    pc_policy_unlock();
+    while (!list_empty(&old_rules)) {
+        rule = list_first_entry(&old_rules, pc_rule_t, head);
+        list_del(&rule->head);
+        free_pc_rule(rule);
+    }
     return 0;
 }
 
-pc_rule_t *find_rule_by_id(const char *id)
+/* must be called with pc_policy_mutex held */
+static pc_rule_t *find_rule_by_id(const char *id)
 {
-    pc_rule_t *rule = NULL, *n;
-    pc_rule_t *ret = NULL;
-    pc_policy_read_lock();
-    if (!list_empty(&pc_rule_head)) {
-        list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
-            if (strcmp(rule->id, id) == 0) {
-                ret = rule;
-                goto out;
-            }
-        }
+    pc_rule_t *rule = NULL;
+    list_for_each_entry(rule, &pc_rule_head, head) {
+        if (strcmp(rule->id, id) == 0)
+            return rule;
     }
-out:
-    pc_policy_read_unlock();
-    return ret;
+    return NULL;
 }
 
 static void group_init_list(pc_group_t *group)
@@ -272,17 +466,18 @@ int add_pc_group(const char *id,  cJSON *macs, const char *rule_id)
         printk("malloc pc_group_t memory error\n");
         return -1;
     } else {
-        memcpy(group->id, id, GROUP_ID_SIZE);
+        strncpy(group->id, id, GROUP_ID_SIZE - 1);
         group_init_list(group);
         group_add_macs(group, macs);
+        pc_policy_lock();
         rule = find_rule_by_id(rule_id);
         group->rule = rule;
-        pc_policy_write_lock();
         if (rule) {
             rule->refer_count += 1;//增加规则引用计数
         }
         list_add(&group->head, &pc_group_head);
-        pc_policy_write_unlock();
+        pc_policy_publish();
+        pc_policy_unlock();
     }
     return 0;
 }
@@ -291,20 +486,25 @@ int remove_pc_group(const char *id)
 {
     pc_group_t *group = NULL, *n;
     pc_rule_t *rule = NULL;
-    if (!list_empty(&pc_group_head)) {
-        list_for_each_entry_safe(group, n, &pc_group_head, head) {
-            if (strcmp(group->id, id) == 0) {
-                rule = group->rule;
-                pc_policy_write_lock();
-                if (rule)
-                    rule->refer_count -= 1;
-                group_clean_list(group);
-                list_del(&group->head);
-                kfree(group);
-                pc_policy_write_unlock();
-            }
+    LIST_HEAD(old_groups);
+    pc_policy_lock();
+    list_for_each_entry_safe(group, n, &pc_group_head, head) {
+        if (strcmp(group->id, id) == 0) {
+            rule = group->rule;
+            if (rule)
+                rule->refer_count -= 1;
+            list_move(&group->head, &old_groups);
         }
     }
+    if (!list_empty(&old_groups))
+        pc_policy_publish();
+    pc_policy_unlock();
+    while (!list_empty(&old_groups)) {
+        group = list_first_entry(&old_groups, pc_group_t, head);
+        list_del(&group->head);
+        group_clean_list(group);
+        kfree(group);
+    }
     return 0;
 }
 
@@ -312,130 +512,83 @@ int clean_pc_group(void)
 {
     pc_group_t *group = NULL;
     pc_rule_t *rule = NULL;
-    pc_policy_write_lock();
-    while (!list_empty(&pc_group_head)) {
-        group = list_first_entry(&pc_group_head, pc_group_t, head);
-        {
-            rule = group->rule;
-            if (rule)
-                rule->refer_count -= 1;
-            group_clean_list(group);
-            list_del(&group->head);
-            kfree(group);
-        }
+    LIST_HEAD(old_groups);
+    pc_policy_lock();
+    list_splice_init(&pc_group_head, &old_groups);
+    list_for_each_entry(group, &old_groups, head) {
+        rule = group->rule;
+        if (rule)
+            rule->refer_count -= 1;
+    }
+    pc_policy_publish();
+    pc_policy_unlock();
+    while (!list_empty(&old_groups)) {
+        group = list_first_entry(&old_groups, pc_group_t, head);
+        list_del(&group->head);
+        group_clean_list(group);
+        kfree(group);
     }
-    pc_policy_write_unlock();
     return 0;
 }
 
 int set_pc_group(const char *id,  cJSON *macs, const char *rule_id)
 {
-    pc_group_t *group = NULL, *n;
+    pc_group_t *group = NULL;
     pc_rule_t *rule = NULL;
+    int changed = 0;
+    pc_policy_lock();
     rule = find_rule_by_id(rule_id);
     PC_DEBUG("set rule %s for group %s\n", rule ? rule->id : "NULL", id);
-    if (!list_empty(&pc_group_head)) {
-        list_for_each_entry_safe(group, n, &pc_group_head, head) {
-            if (strcmp(group->id, id) == 0) {
-                PC_DEBUG("match group %s\n", group->id);
-                pc_policy_write_lock();
-                group_clean_list(group);
-                group_add_macs(group, macs);
-                if (group->rule)
-                    group->rule->refer_count -= 1;//减少旧规则的引用计数
-                group->rule = rule;
-                if (rule)
-                    rule->refer_count += 1;//增加被引用规则的引用计数
-                pc_policy_write_unlock();
-            }
+    list_for_each_entry(group, &pc_group_head, head) {
+        if (strcmp(group->id, id) == 0) {
+            PC_DEBUG("match group %s\n", group->id);
+            group_clean_list(group);
+            group_add_macs(group, macs);
+            if (group->rule)
+                group->rule->refer_count -= 1;//减少旧规则的引用计数
+            group->rule = rule;
+            if (rule)
+                rule->refer_count += 1;//增加被引用规则的引用计数
+            changed = 1;
         }
     }
+    if (changed)
+        pc_policy_publish();
+    pc_policy_unlock();
     return 0;
 }
 
-static pc_group_t *_find_group_by_mac(u8 mac[ETH_ALEN])
+/* must be called under rcu_read_lock(), the rule stays valid until it is dropped */
+pc_rule_t   *get_rule_by_mac(pc_policy_snap_t *snap, u8 mac[ETH_ALEN], enum pc_action *action)
 {
-    pc_group_t *group = NULL, *n;
-    pc_mac_t *nmac = NULL, *nmac_n;
-    if (!list_empty(&pc_group_head)) {
-        list_for_each_entry_safe(group, n, &pc_group_head, head) {
-            if (!list_empty(&group->macs)) {
-                list_for_each_entry_safe(nmac, nmac_n, &group->macs, head) {
-                    if (ether_addr_equal(nmac->mac, mac)) {
-                        return group;
-                    }
-                }
-            }
+    pc_mac_entry_t *entry;
+
+    hlist_for_each_entry(entry, &snap->mac_hash[pc_mac_hash_key(mac)], hlist) {
+        if (ether_addr_equal(entry->mac, mac)) {
+            if (entry->rule)
+                *action = entry->rule->action;
+            else
+                *action = PC_ACCEPT;
+            return entry->rule;
         }
     }
+    if (READ_ONCE(pc_drop_anonymous)) {//如果设备不属于任何分组则划分为匿名设备
+        PC_LMT_DEBUG("Dtetected anonymous MAC %pM\n", mac);
+        *action = PC_DROP_ANONYMOUS;
+    } else
+        *action = PC_ACCEPT;
     return NULL;
 }
 
-pc_group_t *find_group_by_mac(u8 mac[ETH_ALEN])
-{
-    pc_group_t *ret = NULL;
-    pc_policy_read_lock();
-    ret = _find_group_by_mac(mac);
-    pc_policy_read_unlock();
-    return ret;
-}
-
-enum pc_action get_action_by_mac(u8 mac[ETH_ALEN])
-{
-
-    pc_group_t *group;
-    pc_rule_t *rule;
-    enum pc_action action;
-
-    pc_policy_read_lock();
-    group = _find_group_by_mac(mac);
-    if (!group) { //TODO 设备不属于任何分组，直接通过
-        action = PC_ACCEPT;
-        goto EXIT;
-    }
-    rule = group->rule;
-    if (!rule) { //TODO 设备组没有设置任何规则，直接通过
-        action = PC_ACCEPT;
-        goto EXIT;
-    }
-    action = rule->action;
-EXIT:
-    pc_policy_read_unlock();
-    return action;
-}
-
-pc_rule_t   *get_rule_by_mac(u8 mac[ETH_ALEN], enum pc_action *action)
-{
-    pc_group_t *group;
-
-    pc_policy_read_lock();
-    group = _find_group_by_mac(mac);
-    pc_policy_read_unlock();
-    if (group) {
-        if (group->rule)
-            *action = group->rule->action;
-        else
-            *action = PC_ACCEPT;
-        return group->rule;
-    } else {
-        if (pc_drop_anonymous) {//如果设备不属于任何分组则划分为匿名设备
-            PC_LMT_DEBUG("Dtetected anonymous MAC %pM\n", mac);
-            *action = PC_DROP_ANONYMOUS;
-        } else
-            *action = PC_ACCEPT;
-        return NULL;
-    }
-}
-
 static int rule_blist_print(struct seq_file *s, pc_rule_t *rule)
 {
     range_value_t port_range;
-    pc_app_t *app = NULL, *n;
+    pc_app_t *app = NULL;
     int i;
     seq_printf(s, "Black List:\n");
     seq_printf(s, "ID\tName\tProto\tSport\tDport\tHost_url\tRequest_url\tDataDictionary\n");
-    if (!list_empty(&rule->blist)) {
-        list_for_each_entry_safe(app, n, &rule->blist, head) {
+    if (rule->blist) {
+        pc_for_each_app(app, rule->blist) {
             seq_printf(s, "%d\t%s\t%d\t%d\t", app->app_id, app->app_name, app->proto, app->sport);
             for (i = 0; i < app->dport_info.num; i++) {
                 port_range = app->dport_info.range_list[i];
@@ -463,7 +616,7 @@ static int rule_proc_show(struct seq_file *s, void *v)
     pc_rule_t *rule = NULL, *n;
     pc_app_index_t *index = NULL, *index_n;
     seq_printf(s, "ID\tAction\tRefer_count\tAPPs\n");
-    pc_policy_read_lock();
+    pc_policy_lock();
     if (!list_empty(&pc_rule_head)) {
         list_for_each_entry_safe(rule, n, &pc_rule_head, head) {
             seq_printf(s, "%s\t%d\t%d\t[ ", rule->id, rule->action, rule->refer_count);
@@ -477,7 +630,7 @@ static int rule_proc_show(struct seq_file *s, void *v)
             seq_printf(s, "=======================================================\n\n");
         }
     }
-    pc_policy_read_unlock();
+    pc_policy_unlock();
     return 0;
 }
 
@@ -491,7 +644,7 @@ static int group_proc_show(struct seq_file *s, void *v)
     pc_group_t *group = NULL, *n;
     pc_mac_t *mac = NULL, *mac_n;
     seq_printf(s, "ID\tRule_ID\tMACs\n");
-    pc_policy_read_lock();
+    pc_policy_lock();
     if (!list_empty(&pc_group_head)) {
         list_for_each_entry_safe(group, n, &pc_group_head, head) {
             seq_printf(s, "%s\t%s\t[ ", group->id, group->rule ? group->rule->id : "NULL");
@@ -503,7 +656,7 @@ static int group_proc_show(struct seq_file *s, void *v)
             seq_printf(s, "]\n");
         }
     }
-    pc_policy_read_unlock();
+    pc_policy_unlock();
     return 0;
 }
 
@@ -539,6 +692,21 @@ static int src_dev_proc_open(struct inode *inode, struct file *file)
     return single_open(file, src_dev_show, NULL);
 }
 
+static int flow_cache_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, flow_cache_proc_show, NULL);
+}
+
+static int stats_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_proc_show, NULL);
+}
+
+static int latency_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_proc_show, NULL);
+}
+
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 5, 0)
 static const struct file_operations pc_app_fops = {
     .owner = THIS_MODULE,
@@ -575,6 +743,28 @@ static const struct file_operations pc_src_dev_fops = {
     .llseek = seq_lseek,
     .release = seq_release_private,
 };
+static const struct file_operations pc_flow_cache_fops = {
+    .owner = THIS_MODULE,
+    .open = flow_cache_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release_private,
+};
+static const struct file_operations pc_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release_private,
+};
+static const struct file_operations pc_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_proc_open,
+    .read = seq_read,
+    .write = latency_proc_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 #else
 static const struct proc_ops pc_app_fops = {
     .proc_flags = PROC_ENTRY_PERMANENT,
@@ -611,6 +801,28 @@ static const struct proc_ops pc_src_dev_fops = {
     .proc_lseek = seq_lseek,
     .proc_release = seq_release_private,
 };
+static const struct proc_ops pc_flow_cache_fops = {
+    .proc_flags = PROC_ENTRY_PERMANENT,
+    .proc_read = seq_read,
+    .proc_open = flow_cache_proc_open,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release_private,
+};
+static const struct proc_ops pc_stats_fops = {
+    .proc_flags = PROC_ENTRY_PERMANENT,
+    .proc_read = seq_read,
+    .proc_open = stats_proc_open,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release_private,
+};
+static const struct proc_ops pc_latency_fops = {
+    .proc_flags = PROC_ENTRY_PERMANENT,
+    .proc_read = seq_read,
+    .proc_write = latency_proc_write,
+    .proc_open = latency_proc_open,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
 #endif
 
 
@@ -628,20 +840,125 @@ int pc_init_procfs(void)
     proc_create("app", 0644, proc, &pc_app_fops);
     proc_create("drop_anonymous", 0644, proc, &pc_drop_anonymous_fops);
     proc_create("src_dev", 0644, proc, &pc_src_dev_fops);
+    proc_create("flow_cache", 0644, proc, &pc_flow_cache_fops);
+    proc_create("stats", 0644, proc, &pc_stats_fops);
+    proc_create("latency", 0644, proc, &pc_latency_fops);
     return 0;
 }
 
+/*
+ * selftest=1 runs the TEST_xxx() checks of the parsers and matchers before
+ * anything is loaded and refuses to load if one fails, selftest=2 also
+ * reports the ns/op of the hot paths.
+ */
+static int selftest;
+module_param(selftest, int, 0444);
+MODULE_PARM_DESC(selftest, "1: run the self tests at load, 2: also time the parsers and matchers");
+
+/*
+ * ct->mark bits that cache the verdicts, the module owns them and nothing
+ * else on the router may use them. Contiguous, at least PC_MARK_MIN_BITS.
+ */
+u_int32_t pc_mark_mask = PC_MARK_MASK_DEFAULT;
+module_param_named(mark_mask, pc_mark_mask, uint, 0444);
+MODULE_PARM_DESC(mark_mask, "ct->mark bits reserved for cached verdicts, contiguous and at least 4 (default 0xff000000)");
+u_int32_t pc_mark_shift;
+u_int32_t pc_gen_mask;
+
+static int pc_mark_setup(void)
+{
+    u_int32_t field;
+
+    if (!pc_mark_mask)
+        goto invalid;
+    pc_mark_shift = __ffs(pc_mark_mask);
+    field = pc_mark_mask >> pc_mark_shift;
+    if ((field & (field + 1)) || hweight32(field) < PC_MARK_MIN_BITS)
+        goto invalid;
+    pc_gen_mask = field >> PC_VERDICT_BITS;
+    return 0;
+invalid:
+    PC_ERROR("invalid mark_mask 0x%08x\n", pc_mark_mask);
+    return -EINVAL;
+}
+
+static int pc_test_passed;
+static int pc_test_failed;
+int pc_test_bench_on;
+volatile int pc_test_sink;
+void (*pc_test_fail_hook)(const char *expr, const char *func, int line);
+void (*pc_test_bench_hook)(const char *name, u64 ns_per_op);
+
+int pc_test_check(int ok, const char *expr, const char *func, int line)
+{
+    if (ok) {
+        pc_test_passed++;
+    } else {
+        pc_test_failed++;
+        PC_ERROR("[selftest] %s:%d %s failed\n", func, line, expr);
+        if (pc_test_fail_hook)
+            pc_test_fail_hook(expr, func, line);
+    }
+    return ok;
+}
+
+u64 pc_test_now(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+void pc_test_bench_report(const char *name, u64 start, int loops)
+{
+    u64 ns = div_u64(pc_test_now() - start, loops);
+    if (pc_test_bench_hook)
+        pc_test_bench_hook(name, ns);
+    else
+        PC_INFO("[selftest] %-24s %llu ns/op\n", name, (unsigned long long)ns);
+}
+
+int pc_selftest(int bench)
+{
+    pc_test_passed = 0;
+    pc_test_failed = 0;
+    pc_test_bench_on = bench;
+    TEST_regexp();
+    TEST_app();
+    TEST_dpi();
+    TEST_quic();
+    PC_INFO("[selftest] %d passed, %d failed\n", pc_test_passed, pc_test_failed);
+    return pc_test_failed ? -1 : 0;
+}
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("luochognjun@gl-inet.com");
 MODULE_DESCRIPTION("parental control module");
 MODULE_VERSION("1.0");
 
+static void pc_policy_free_snap(void)
+{
+    pc_policy_lock();
+    kfree(rcu_dereference_protected(pc_policy_snap, lockdep_is_held(&pc_policy_mutex)));
+    RCU_INIT_POINTER(pc_policy_snap, NULL);
+    pc_policy_unlock();
+}
+
 static int __init pc_policy_init(void)
 {
+    if (selftest && pc_selftest(selftest > 1))
+        return -EINVAL;
+    if (pc_mark_setup())
+        return -EINVAL;
     if (pc_load_app_feature_list())
         return -1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+    pc_policy_gen_seed = get_random_u32() & pc_gen_mask;
+#else
+    pc_policy_gen_seed = get_random_int() & pc_gen_mask;
+#endif
+    pc_policy_gen = pc_policy_gen_seed;
+    pc_policy_changed();
     if (pc_register_dev())
-        goto free_app;
+        goto free_snap;
     if (pc_filter_init())
         goto free_dev;
     pc_init_procfs();
@@ -650,7 +967,8 @@ static int __init pc_policy_init(void)
 
 free_dev:
     pc_unregister_dev();
-free_app:
+free_snap:
+    pc_policy_free_snap();
     pc_clean_app_feature_list();
     return -1;
 }
@@ -662,6 +980,7 @@ static void pc_policy_exit(void)
     pc_unregister_dev();
     clean_pc_group();
     clean_pc_rule();
+    pc_policy_free_snap();
     pc_clean_app_feature_list();
     return;
 }
@@ -1,17 +1,25 @@
 #ifndef __PC_POLICY_H__
 #define __PC_POLICY_H__
 
+#include <linux/in6.h>
+#include <linux/percpu.h>
 #include "cJSON.h"
 
 #define PC_FEATURE_CONFIG_FILE "/tmp/pc_app_feature.cfg"
-#define NF_DROP_BIT 0x80000000
-#define NF_ACCEPT_BIT 0x40000000
+// verdict cached in the mark_mask bits of ct->mark, the generation above it
+#define PC_VERDICT_ACCEPT 1
+#define PC_VERDICT_DROP 2
+#define PC_VERDICT_FINISH 3
+#define PC_VERDICT_BITS 2
+#define PC_VERDICT_MASK ((1 << PC_VERDICT_BITS) - 1)
+#define PC_MARK_MASK_DEFAULT 0xff000000
+#define PC_MARK_MIN_BITS 4
+#define PC_GEN_NONE 0xffffffff
 #define BLIST_ID 0xffffffff
 #define MAX_HC_CLIENT_HASH_SIZE 128
 #define MAX_DPI_PKT_NUM 64
 #define MIN_HTTP_DATA_LEN 16
 #define MAX_APP_NAME_LEN 64
-#define MAX_FEATURE_NUM_PER_APP 16
 #define MIN_FEATURE_STR_LEN 8
 #define MAX_FEATURE_STR_LEN 128
 #define MAX_HOST_URL_LEN 254
@@ -21,7 +29,9 @@
 #define MAX_FEATURE_LINE_LEN 256
 #define MIN_FEATURE_LINE_LEN 16
 #define MAX_URL_MATCH_LEN 64
+#define MAX_HOST_CANDIDATE_NUM 32
 #define MAX_BYPASS_DPI_PKT_LEN 600
+#define PC_DPI_WINDOW_LEN 4096
 #define RULE_ID_SIZE 32
 #define GROUP_ID_SIZE 32
 #define MAX_PORT_RANGE_NUM 5
@@ -35,25 +45,23 @@
 #define HTTP_POST_METHOD_STR "POST"
 #define HTTP_HEADER "HTTP"
 
-#define HTTPS_URL_OFFSET		9
-#define HTTPS_LEN_OFFSET		7
+#define TLS_RECORD_HANDSHAKE		0x16
+#define TLS_HANDSHAKE_CLIENT_HELLO	0x01
+#define TLS_RECORD_HDR_LEN		5
+#define TLS_HANDSHAKE_HDR_LEN		4
+#define TLS_RANDOM_LEN			32
+#define TLS_EXT_SERVER_NAME		0x0000
+#define TLS_EXT_ALPN			0x0010
+#define TLS_SNI_HOST_NAME		0x00
 
 
 extern u8 pc_drop_anonymous;
 extern char pc_src_dev[129];
-extern struct list_head pc_app_head;
-extern rwlock_t pc_app_lock;
-extern rwlock_t pc_policy_lock;
+extern struct list_head pc_rule_head;
+extern struct mutex pc_policy_mutex;
 
-#define pc_app_read_lock() read_lock_bh(&pc_app_lock);
-#define pc_app_read_unlock() read_unlock_bh(&pc_app_lock);
-#define pc_app_write_lock() write_lock_bh(&pc_app_lock);
-#define pc_app_write_unlock() write_unlock_bh(&pc_app_lock);
-
-#define pc_policy_read_lock() read_lock_bh(&pc_policy_lock);
-#define pc_policy_read_unlock() read_unlock_bh(&pc_policy_lock);
-#define pc_policy_write_lock() write_lock_bh(&pc_policy_lock);
-#define pc_policy_write_unlock() write_unlock_bh(&pc_policy_lock);
+#define pc_policy_lock() mutex_lock(&pc_policy_mutex);
+#define pc_policy_unlock() mutex_unlock(&pc_policy_mutex);
 
 enum e_http_method {
     HTTP_METHOD_GET = 1,
@@ -74,16 +82,23 @@ typedef struct https_proto {
     int match;
     char *url_pos;
     int url_len;
+    char *alpn_pos;
+    int alpn_len;
 } https_proto_t;
 
 typedef struct flow_info {
     struct nf_conn *ct;
     u8 smac[ETH_ALEN];
+    u_int8_t family;
     u_int32_t src;
     u_int32_t dst;
+    struct in6_addr src6;
+    struct in6_addr dst6;
     int l4_protocol;
     u_int16_t sport;
     u_int16_t dport;
+    u_int32_t seq;
+    u_int8_t syn;       // a TCP SYN without ACK, the first packet of a connection
     unsigned char *l4_data;
     int l4_len;
     http_proto_t http;
@@ -93,8 +108,24 @@ typedef struct flow_info {
     u_int8_t drop;
     u_int8_t dir;
     u_int16_t total_len;
+    char host_buf[MAX_URL_MATCH_LEN];
+    char url_buf[MAX_URL_MATCH_LEN];
+    // sorted matcher positions of the host patterns whose literal is in host_buf, -1: all
+    int host_cand_num;
+    u_int16_t host_cand[MAX_HOST_CANDIDATE_NUM];
 } flow_info_t;
 
+typedef struct pc_reasm {
+    struct hlist_node node;
+    struct nf_conn *ct;
+    unsigned long expires;
+    u_int32_t seq;      // next expected sequence number
+    u_int8_t dir;
+    int len;
+    int need;
+    unsigned char buf[0];
+} pc_reasm_t;
+
 enum PC_FEATURE_PARAM_INDEX {
     PC_PROTO_PARAM_INDEX,
     PC_SRC_PORT_PARAM_INDEX,
@@ -105,36 +136,90 @@ enum PC_FEATURE_PARAM_INDEX {
 };
 
 typedef struct pc_pos_info {
-    int pos;
+    s16 pos;
     unsigned char value;
 } pc_pos_info_t;
 
 typedef struct range_value {
-    int not ;
-    int start;
-    int end;
+    u_int8_t not ;
+    u_int16_t start;
+    u_int16_t end;
 } range_value_t;
 
 typedef struct port_info {
     u_int8_t mode; // 0: match, 1: not match
-    int num;
+    u_int8_t num;
     range_value_t range_list[MAX_PORT_RANGE_NUM];
 } port_info_t;
 
+struct RE;
+
+enum pc_app_match {
+    PC_APP_MATCH_PORT,      // proto and ports only
+    PC_APP_MATCH_URL,       // host or request url
+    PC_APP_MATCH_POS,       // data dictionary
+};
+
+/*
+ * The fields pc_match_one() reads for every candidate come first and fit
+ * in 64 bytes, the strings live in the string arena of the owning table.
+ */
 typedef struct pc_app {
-    struct list_head  		head;
     u_int32_t app_id;
-    char app_name[MAX_APP_NAME_LEN];
-    char feature_str[MAX_FEATURE_NUM_PER_APP][MAX_FEATURE_STR_LEN];
-    u_int32_t proto;
-    u_int32_t sport;
-    u_int32_t dport;
+    u_int8_t proto;
+    u_int8_t match;         // enum pc_app_match
+    u_int8_t pos_num;
+    u_int16_t sport;
     port_info_t dport_info;
-    char host_url[MAX_HOST_URL_LEN];
-    char request_url[MAX_REQUEST_URL_LEN];
-    int pos_num;
+    struct RE *host_re;
+    struct RE *request_re;
     pc_pos_info_t pos_info[MAX_POS_INFO_PER_FEATURE];
-} pc_app_t;
+    const char *app_name;
+    const char *host_url;
+    const char *request_url;
+} ____cacheline_aligned pc_app_t;
+
+typedef struct pc_str_chunk {
+    struct pc_str_chunk *next;
+    int used;
+    char buf[0];
+} pc_str_chunk_t;
+
+/*
+ * Features stored back to back, the whole app library is one table and
+ * every rule with a blacklist owns a small one.
+ */
+typedef struct pc_app_table {
+    int num;
+    int size;
+    pc_str_chunk_t *strs;
+    pc_app_t apps[0];
+} pc_app_table_t;
+
+#define pc_for_each_app(app, t) \
+    for ((app) = (t)->apps; (app) < (t)->apps + (t)->num; (app)++)
+
+typedef struct pc_port_index {
+    int nports;
+    u_int16_t *ports;       // sorted
+    u_int32_t *off;         // features of ports[i] are idx[off[i]..off[i+1])
+    u_int16_t *idx;
+    u_int16_t *any;         // features not bound to a few ports
+    int any_num;
+} pc_port_index_t;
+
+struct pc_host_ac;
+
+typedef struct pc_matcher {
+    int num;
+    int nblist;
+    pc_app_t **apps;        // blacklist entries, then the rule's features
+    pc_port_index_t tcp;
+    pc_port_index_t udp;
+    u_int16_t *host_all;    // host only entries, the fallback when the prefilter overflows
+    int host_num;
+    struct pc_host_ac *host;
+} pc_matcher_t;
 
 typedef struct pc_app_index {
     struct list_head  		head;
@@ -154,8 +239,11 @@ typedef struct pc_rule {
     char id[RULE_ID_SIZE];
     unsigned int refer_count;
     enum pc_action action;
-    struct list_head  		blist;
+    pc_app_table_t *blist;  // NULL without a blacklist
     struct list_head  		applist;
+    u_int32_t *app_ids;     // applist sorted, for lookups from the data path
+    int app_num;
+    pc_matcher_t *matcher;
 } pc_rule_t;
 
 typedef struct pc_mac {
@@ -170,6 +258,47 @@ typedef struct pc_group {
     pc_rule_t *rule;
 } pc_group_t;
 
+typedef struct pc_mac_entry {
+    struct hlist_node hlist;
+    u8 mac[ETH_ALEN];
+    pc_rule_t *rule;
+} pc_mac_entry_t;
+
+/* immutable MAC->rule table read by the data path under RCU */
+typedef struct pc_policy_snap {
+    u_int32_t gen;
+    int num;
+    struct hlist_head mac_hash[MAX_HC_CLIENT_HASH_SIZE];
+    pc_mac_entry_t entries[0];
+} pc_policy_snap_t;
+
+/* per-CPU event counters, summed by /proc/parental-control/stats */
+enum pc_stat_item {
+    PC_STAT_PACKETS,
+    PC_STAT_ACCEPT,
+    PC_STAT_DROP,
+    PC_STAT_CACHE_HIT,
+    PC_STAT_CACHE_MISS,
+    PC_STAT_FINISH,
+    PC_STAT_DPI,
+    PC_STAT_HTTP,
+    PC_STAT_TLS,
+    PC_STAT_QUIC,
+    PC_STAT_TLS_REASM,
+    PC_STAT_MATCH,
+    PC_STAT_MATCH_APP,
+    PC_STAT_REGEXP,
+    PC_STAT_MAX,
+};
+
+struct pc_stats {
+    u64 cnt[PC_STAT_MAX];
+} ____cacheline_aligned_in_smp;
+
+DECLARE_PER_CPU_ALIGNED(struct pc_stats, pc_stats);
+
+#define PC_STAT_INC(item) this_cpu_inc(pc_stats.cnt[item])
+
 #define PC_LOG_LEVEL 2
 
 #define LOG(level, fmt, ...) do { \
@@ -202,22 +331,108 @@ extern int clean_pc_rule(void);
 extern int add_pc_group(const char *id,  cJSON *macs, const char *rule_id);
 extern int set_pc_group(const char *id,  cJSON *macs, const char *rule_id);
 extern int clean_pc_group(void);
-extern pc_group_t *find_group_by_mac(u8 mac[ETH_ALEN]);
-extern enum pc_action get_action_by_mac(u8 mac[ETH_ALEN]);
-extern pc_rule_t *get_rule_by_mac(u8 mac[ETH_ALEN], enum pc_action *action);
+extern pc_policy_snap_t *pc_policy_get(void);
+extern int pc_rule_has_app(pc_rule_t *rule, u_int32_t app);
+extern pc_rule_t *get_rule_by_mac(pc_policy_snap_t *snap, u8 mac[ETH_ALEN], enum pc_action *action);
+extern void pc_policy_changed(void);
 
 
 extern int pc_register_dev(void);
 extern void pc_unregister_dev(void);
 
-extern int pc_set_app_by_str(pc_app_t *app, int appid, const char *name, const char *feature);
+extern pc_app_table_t __rcu *pc_app_table;
+extern pc_app_table_t *pc_new_app_table(int size);
+extern void pc_free_app_table(pc_app_table_t *t);
+extern int pc_add_app_by_str(pc_app_table_t *t, int appid, const char *name, const char *feature);
+extern int pc_load_app_feature_buf(char *feature_buf);
 extern int pc_load_app_feature_list(void);
 extern void pc_clean_app_feature_list(void);
 extern int app_proc_show(struct seq_file *s, void *v);
 
 extern int pc_filter_init(void);
 extern void pc_filter_exit(void);
+extern void pc_filter_set_bridge(int enable);
+extern void pc_filter_sync_hooks(int active);
+extern void pc_filter_flush_verdicts(u_int32_t gen, int keep);
+extern u_int32_t pc_mark_mask;
+extern u_int32_t pc_mark_shift;
+extern u_int32_t pc_gen_mask;
+extern void pc_filter_set_src_dev(const char *devs);
+extern int flow_cache_proc_show(struct seq_file *s, void *v);
+extern int stats_proc_show(struct seq_file *s, void *v);
+extern int latency_proc_show(struct seq_file *s, void *v);
+extern ssize_t latency_proc_write(struct file *file, const char __user *buffer, size_t count, loff_t *pos);
+
+struct sk_buff;
+struct net_device;
+extern u_int32_t pc_filter_hook_handle(struct sk_buff *skb, struct net_device *dev);
+extern int parse_flow_proto(struct sk_buff *skb, flow_info_t *flow);
+extern int dpi_https_proto(flow_info_t *flow);
+extern void dpi_http_proto(flow_info_t *flow);
+extern int dpi_main(struct sk_buff *skb, flow_info_t *flow);
+extern int app_filter_match(flow_info_t *flow, pc_rule_t *rule);
+extern int dpi_tls_client_hello(flow_info_t *flow, unsigned char *p, int len);
+extern int dpi_quic_initial(flow_info_t *flow);
+extern int dpi_quic_proto(flow_info_t *flow);
+
+extern void pc_budget_init(void);
+extern int pc_budget_take(struct nf_conn *ct, int dir);
+extern void pc_budget_done(struct nf_conn *ct);
+extern void pc_budget_exit(void);
+
+extern void pc_tls_reasm_init(void);
+extern int pc_tls_reasm_start(flow_info_t *flow);
+extern int pc_tls_reasm_feed(flow_info_t *flow, pc_reasm_t **done);
+extern void pc_tls_reasm_free(pc_reasm_t *r);
+extern void pc_tls_reasm_exit(void);
+extern int pc_quic_reasm_save(flow_info_t *flow, const void *data, int len);
+extern pc_reasm_t *pc_quic_reasm_take(flow_info_t *flow);
+
+extern pc_matcher_t *pc_new_matcher(pc_app_t **apps, int num, int nblist);
+extern void pc_free_matcher(pc_matcher_t *m);
+extern int pc_port_index_lookup(pc_port_index_t *pi, u_int16_t port, const u_int16_t **list);
+extern void pc_matcher_scan_host(pc_matcher_t *m, flow_info_t *flow);
 
 extern int regexp_match(char *reg, char *text);
+extern struct RE *regexp_compile(const char *reg);
+extern int regexp_exec(struct RE *regexp, char *text);
+extern void regexp_release(struct RE *regexp);
+extern int regexp_literal(const char *reg, char *lit, int size);
+
+extern int pc_match_port(port_info_t *info, int port);
+extern int pc_match_by_pos(flow_info_t *flow, pc_app_t *node);
+
+/*
+ * In-source self tests, each TEST_xxx() lives next to the code it checks and
+ * PC_TEST_BENCH() times a statement when the tests run with benchmarks on,
+ * its result goes to pc_test_sink so the call is not optimized away.
+ */
+extern int pc_test_bench_on;
+extern volatile int pc_test_sink;
+// set by the KUnit suite (pc_kunit.c) while it runs the TEST_xxx() functions
+extern void (*pc_test_fail_hook)(const char *expr, const char *func, int line);
+extern void (*pc_test_bench_hook)(const char *name, u64 ns_per_op);
+extern int pc_test_check(int ok, const char *expr, const char *func, int line);
+extern u64 pc_test_now(void);
+extern void pc_test_bench_report(const char *name, u64 start, int loops);
+extern int pc_selftest(int bench);
+extern void TEST_regexp(void);
+extern void TEST_app(void);
+extern void TEST_dpi(void);
+extern void TEST_quic(void);
+
+#define PC_TEST(expr) pc_test_check(!!(expr), #expr, __func__, __LINE__)
+
+#define PC_TEST_BENCH(name, loops, stmt) do { \
+        u64 __start; \
+        int __i; \
+        if (!pc_test_bench_on) \
+            break; \
+        __start = pc_test_now(); \
+        for (__i = 0; __i < (loops); __i++) { \
+            stmt; \
+        } \
+        pc_test_bench_report(name, __start, loops); \
+    } while (0)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,577 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/in.h>
+#include <net/netfilter/nf_conntrack.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#include <crypto/aes.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#include <crypto/sha2.h>
+#else
+#include <crypto/sha.h>
+#endif
+#endif
+#include "pc_policy.h"
+
+/*
+ * QUIC Initial packets (RFC 9001/9369) carry the ClientHello in CRYPTO
+ * frames, protected with keys derived from the client's destination
+ * connection id only. The client Initial is decrypted here and the
+ * CRYPTO data from offset 0 goes through the same ClientHello walker as
+ * TLS over TCP. Nothing is trusted from the decrypted data, so the AEAD
+ * tag is not checked, the payload is simply run through AES-CTR.
+ *
+ * A ClientHello with post-quantum key shares spans two Initials. When the
+ * first one leaves it incomplete, its CRYPTO data is parked in the
+ * reassembly table and the second Initial is collected on top of it.
+ */
+#define QUIC_V1 0x00000001
+#define QUIC_V2 0x6b3343cf
+#define QUIC_LONG_HEADER 0xc0
+#define QUIC_MIN_INITIAL_LEN 1200
+#define QUIC_MAX_CID_LEN 20
+#define QUIC_TAG_LEN 16
+#define QUIC_SAMPLE_LEN 16
+#define QUIC_MAX_PAYLOAD_LEN 1500
+#define QUIC_HELLO_LEN 4096
+#define QUIC_MAX_CRYPTO_FRAMES 32
+
+#define QUIC_FRAME_PADDING 0x00
+#define QUIC_FRAME_PING 0x01
+#define QUIC_FRAME_ACK 0x02
+#define QUIC_FRAME_ACK_ECN 0x03
+#define QUIC_FRAME_CRYPTO 0x06
+
+struct quic_version {
+    u_int32_t version;
+    u_int8_t initial_type;
+    u_int8_t salt[20];
+    const char *key_label;
+    const char *iv_label;
+    const char *hp_label;
+};
+
+static const struct quic_version quic_versions[] = {
+    {
+        QUIC_V1, 0,
+        {
+            0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+            0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+        },
+        "quic key", "quic iv", "quic hp"
+    },
+    {
+        QUIC_V2, 1,
+        {
+            0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+            0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9
+        },
+        "quicv2 key", "quicv2 iv", "quicv2 hp"
+    },
+};
+
+static const struct quic_version *quic_find_version(unsigned char *p)
+{
+    u_int32_t version = ((u_int32_t)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+    int type = (p[0] >> 4) & 0x3;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(quic_versions); i++) {
+        if (quic_versions[i].version == version && quic_versions[i].initial_type == type)
+            return &quic_versions[i];
+    }
+    return NULL;
+}
+
+/*
+ * Cheap header test, a client Initial is a long header packet padded to at
+ * least QUIC_MIN_INITIAL_LEN bytes, sent in the original direction.
+ */
+int dpi_quic_initial(flow_info_t *flow)
+{
+    unsigned char *p = flow->l4_data;
+    if (flow->l4_protocol != IPPROTO_UDP || flow->l4_len < QUIC_MIN_INITIAL_LEN)
+        return PC_FALSE;
+    if (flow->ct && flow->dir != IP_CT_DIR_ORIGINAL)
+        return PC_FALSE;
+    if ((p[0] & QUIC_LONG_HEADER) != QUIC_LONG_HEADER)
+        return PC_FALSE;
+    return quic_find_version(p) ? PC_TRUE : PC_FALSE;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+typedef struct sha256_ctx quic_sha256_t;
+#else
+typedef struct sha256_state quic_sha256_t;
+#endif
+
+struct quic_keys {
+    u8 key[16];
+    u8 iv[12];
+    u8 hp[16];
+};
+
+struct quic_crypto_range {
+    int start;
+    int end;
+};
+
+// the CRYPTO stream received so far, saved as is between two Initials
+struct quic_hello {
+    int nrange;
+    struct quic_crypto_range range[QUIC_MAX_CRYPTO_FRAMES];
+    u8 data[QUIC_HELLO_LEN];
+};
+
+// decrypted payload and the CRYPTO stream, the sni in flow->https points here
+struct quic_buf {
+    u8 payload[QUIC_MAX_PAYLOAD_LEN];
+    struct quic_hello hello;
+};
+static DEFINE_PER_CPU(struct quic_buf, quic_buf);
+
+// variable-length integer, return the number of bytes used or 0
+static int quic_varint(const u8 *p, const u8 *end, u64 *v)
+{
+    int len, i;
+    if (p >= end)
+        return 0;
+    len = 1 << (p[0] >> 6);
+    if (end - p < len)
+        return 0;
+    *v = p[0] & 0x3f;
+    for (i = 1; i < len; i++)
+        *v = (*v << 8) | p[i];
+    return len;
+}
+
+static void quic_hmac_sha256(const u8 *key, int key_len, const u8 *data, int len,
+                             u8 out[SHA256_DIGEST_SIZE])
+{
+    quic_sha256_t sctx;
+    u8 pad[SHA256_BLOCK_SIZE];
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, key_len);
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36;
+    sha256_init(&sctx);
+    sha256_update(&sctx, pad, SHA256_BLOCK_SIZE);
+    sha256_update(&sctx, data, len);
+    sha256_final(&sctx, out);
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&sctx);
+    sha256_update(&sctx, pad, SHA256_BLOCK_SIZE);
+    sha256_update(&sctx, out, SHA256_DIGEST_SIZE);
+    sha256_final(&sctx, out);
+}
+
+// HKDF-Expand-Label with an empty context, out_len <= SHA256_DIGEST_SIZE
+static void quic_expand_label(const u8 *secret, const char *label, u8 *out, int out_len)
+{
+    u8 info[64];
+    u8 tmp[SHA256_DIGEST_SIZE];
+    int label_len = strlen(label);
+    int n = 0;
+
+    info[n++] = 0;
+    info[n++] = out_len;
+    info[n++] = 6 + label_len;
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, label_len);
+    n += label_len;
+    info[n++] = 0;
+    info[n++] = 1;
+    quic_hmac_sha256(secret, SHA256_DIGEST_SIZE, info, n, tmp);
+    memcpy(out, tmp, out_len);
+}
+
+static void quic_initial_keys(const struct quic_version *v, const u8 *dcid, int dcid_len,
+                              struct quic_keys *k)
+{
+    u8 secret[SHA256_DIGEST_SIZE];
+    u8 client[SHA256_DIGEST_SIZE];
+
+    quic_hmac_sha256(v->salt, sizeof(v->salt), dcid, dcid_len, secret);
+    quic_expand_label(secret, "client in", client, SHA256_DIGEST_SIZE);
+    quic_expand_label(client, v->key_label, k->key, sizeof(k->key));
+    quic_expand_label(client, v->iv_label, k->iv, sizeof(k->iv));
+    quic_expand_label(client, v->hp_label, k->hp, sizeof(k->hp));
+}
+
+// AES-GCM without the tag check is AES-CTR starting at counter 2
+static void quic_aes_ctr(const u8 *key, const u8 *nonce, const u8 *in, u8 *out, int len)
+{
+    struct crypto_aes_ctx ctx;
+    u8 ctr[AES_BLOCK_SIZE];
+    u8 ks[AES_BLOCK_SIZE];
+    u_int32_t n = 2;
+    int i, done;
+
+    aes_expandkey(&ctx, key, 16);
+    memcpy(ctr, nonce, 12);
+    for (done = 0; done < len; done += AES_BLOCK_SIZE, n++) {
+        ctr[12] = n >> 24;
+        ctr[13] = n >> 16;
+        ctr[14] = n >> 8;
+        ctr[15] = n;
+        aes_encrypt(&ctx, ks, ctr);
+        for (i = 0; i < AES_BLOCK_SIZE && done + i < len; i++)
+            out[done + i] = in[done + i] ^ ks[i];
+    }
+}
+
+/*
+ * Remove header protection and decrypt the client Initial into
+ * buf->payload, return the payload length or -1.
+ */
+static int quic_decrypt_initial(flow_info_t *flow, struct quic_buf *buf)
+{
+    const struct quic_version *v;
+    struct crypto_aes_ctx ctx;
+    struct quic_keys k;
+    u8 mask[AES_BLOCK_SIZE];
+    u8 nonce[12];
+    u8 *p = flow->l4_data;
+    u8 *end = p + flow->l4_len;
+    u8 *dcid;
+    int dcid_len, pn_len, i, n;
+    u_int32_t pn = 0;
+    u64 token_len, length;
+
+    v = quic_find_version(p);
+    if (!v)
+        return -1;
+    p += 5;
+    dcid_len = *p++;
+    if (dcid_len > QUIC_MAX_CID_LEN || end - p < dcid_len + 1)
+        return -1;
+    dcid = p;
+    p += dcid_len;
+    n = *p++;
+    if (n > QUIC_MAX_CID_LEN || end - p < n)
+        return -1;
+    p += n;
+    n = quic_varint(p, end, &token_len);
+    if (!n || end - p - n < token_len)
+        return -1;
+    p += n + token_len;
+    n = quic_varint(p, end, &length);
+    if (!n)
+        return -1;
+    p += n;
+    // p is the packet number, the hp sample starts 4 bytes into it
+    if (length > end - p || length < 4 + QUIC_SAMPLE_LEN)
+        return -1;
+
+    quic_initial_keys(v, dcid, dcid_len, &k);
+    aes_expandkey(&ctx, k.hp, sizeof(k.hp));
+    aes_encrypt(&ctx, mask, p + 4);
+    pn_len = ((flow->l4_data[0] ^ mask[0]) & 0x3) + 1;
+    for (i = 0; i < pn_len; i++)
+        pn = (pn << 8) | (p[i] ^ mask[1 + i]);
+
+    memcpy(nonce, k.iv, sizeof(nonce));
+    for (i = 0; i < 4; i++)
+        nonce[11 - i] ^= (pn >> (8 * i)) & 0xff;
+    n = length - pn_len - QUIC_TAG_LEN;
+    if (n <= 0)
+        return -1;
+    n = min(n, QUIC_MAX_PAYLOAD_LEN);
+    quic_aes_ctr(k.key, nonce, p + pn_len, buf->payload, n);
+    return n;
+}
+
+// record [start, end) of the CRYPTO stream, merged with the ranges it touches
+static void quic_add_range(struct quic_hello *h, int start, int end)
+{
+    int i;
+    for (i = 0; i < h->nrange; i++) {
+        if (start <= h->range[i].end && end >= h->range[i].start) {
+            start = min(start, h->range[i].start);
+            end = max(end, h->range[i].end);
+            h->range[i--] = h->range[--h->nrange];
+        }
+    }
+    if (h->nrange < QUIC_MAX_CRYPTO_FRAMES) {
+        h->range[h->nrange].start = start;
+        h->range[h->nrange].end = end;
+        h->nrange++;
+    }
+}
+
+// bytes of the CRYPTO stream that are contiguous from offset 0
+static int quic_hello_len(const struct quic_hello *h)
+{
+    int i;
+    for (i = 0; i < h->nrange; i++) {
+        if (h->range[i].start == 0)
+            return h->range[i].end;
+    }
+    return 0;
+}
+
+// length of the whole ClientHello, as far as it fits in the buffer
+static int quic_hello_need(const struct quic_hello *h, int len)
+{
+    if (len < TLS_HANDSHAKE_HDR_LEN)
+        return QUIC_HELLO_LEN;
+    return min(TLS_HANDSHAKE_HDR_LEN + ((h->data[1] << 16) | (h->data[2] << 8) | h->data[3]),
+               QUIC_HELLO_LEN);
+}
+
+// the part of h worth saving, the data past the last range is stale
+static int quic_hello_size(const struct quic_hello *h)
+{
+    int i, end = 0;
+    for (i = 0; i < h->nrange; i++)
+        end = max(end, h->range[i].end);
+    return offsetof(struct quic_hello, data) + end;
+}
+
+/*
+ * Copy the CRYPTO frames into buf->hello by offset, they may come in any
+ * order, and return how many bytes from offset 0 are contiguous.
+ */
+static int quic_collect_crypto(struct quic_buf *buf, int len)
+{
+    struct quic_hello *h = &buf->hello;
+    u8 *p = buf->payload;
+    u8 *end = p + len;
+    u64 type, off, flen, v, num;
+    int i, n;
+
+    while (p < end) {
+        n = quic_varint(p, end, &type);
+        if (!n)
+            break;
+        p += n;
+        if (type == QUIC_FRAME_PADDING || type == QUIC_FRAME_PING)
+            continue;
+        if (type == QUIC_FRAME_ACK || type == QUIC_FRAME_ACK_ECN) {
+            // largest, delay, range count, first range, ranges, ecn counts
+            for (i = 0; i < 4; i++) {
+                n = quic_varint(p, end, i == 2 ? &num : &v);
+                if (!n)
+                    goto out;
+                p += n;
+            }
+            num = num * 2 + (type == QUIC_FRAME_ACK_ECN ? 3 : 0);
+            while (num--) {
+                n = quic_varint(p, end, &v);
+                if (!n)
+                    goto out;
+                p += n;
+            }
+            continue;
+        }
+        if (type != QUIC_FRAME_CRYPTO)
+            break;
+        n = quic_varint(p, end, &off);
+        if (!n)
+            break;
+        p += n;
+        n = quic_varint(p, end, &flen);
+        if (!n || flen > end - p - n)
+            break;
+        p += n;
+        if (off < QUIC_HELLO_LEN && flen > 0) {
+            flen = min_t(u64, flen, QUIC_HELLO_LEN - off);
+            memcpy(h->data + off, p, flen);
+            quic_add_range(h, off, off + flen);
+        }
+        p += flen;
+    }
+out:
+    return quic_hello_len(h);
+}
+
+int dpi_quic_proto(flow_info_t *flow)
+{
+    struct quic_buf *buf;
+    pc_reasm_t *r;
+    int len, first, ret = -1;
+
+    if (!flow->l4_data || !dpi_quic_initial(flow))
+        return -1;
+    buf = this_cpu_ptr(&quic_buf);
+    r = pc_quic_reasm_take(flow);
+    first = !r;
+    if (r) {
+        memcpy(&buf->hello, r->buf, r->len);
+        pc_tls_reasm_free(r);
+    } else {
+        buf->hello.nrange = 0;
+    }
+    len = quic_decrypt_initial(flow, buf);
+    if (len <= 0)
+        return -1;
+    len = quic_collect_crypto(buf, len);
+    if (len > 0) {
+        PC_LMT_DEBUG("quic initial, %d bytes of client hello\n", len);
+        ret = dpi_tls_client_hello(flow, buf->hello.data, len);
+    }
+    // only the first two Initials are looked at
+    if (first && buf->hello.nrange && flow->https.match != PC_TRUE &&
+            len < quic_hello_need(&buf->hello, len))
+        pc_quic_reasm_save(flow, &buf->hello, quic_hello_size(&buf->hello));
+    return ret;
+}
+
+// build a protected v1 client Initial around frames, return its length
+static int quic_test_initial(u8 *pkt, const u8 *frames, int flen)
+{
+    static const u8 dcid[8] = {0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08};
+    struct crypto_aes_ctx ctx;
+    struct quic_keys k;
+    u8 mask[AES_BLOCK_SIZE];
+    int n = 0, plen, length;
+
+    pkt[n++] = QUIC_LONG_HEADER | 0x01; // 2 byte packet number
+    pkt[n++] = 0;
+    pkt[n++] = 0;
+    pkt[n++] = 0;
+    pkt[n++] = 1;
+    pkt[n++] = sizeof(dcid);
+    memcpy(pkt + n, dcid, sizeof(dcid));
+    n += sizeof(dcid);
+    pkt[n++] = 0; // scid
+    pkt[n++] = 0; // token
+    plen = QUIC_MIN_INITIAL_LEN - n - 2 - 2 - QUIC_TAG_LEN;
+    length = 2 + plen + QUIC_TAG_LEN;
+    pkt[n++] = 0x40 | (length >> 8);
+    pkt[n++] = length & 0xff;
+    // packet number 0, the nonce is the iv itself
+    pkt[n] = 0;
+    pkt[n + 1] = 0;
+    memcpy(pkt + n + 2, frames, flen);
+    memset(pkt + n + 2 + flen, QUIC_FRAME_PADDING, plen - flen + QUIC_TAG_LEN);
+
+    quic_initial_keys(&quic_versions[0], dcid, sizeof(dcid), &k);
+    quic_aes_ctr(k.key, k.iv, pkt + n + 2, pkt + n + 2, plen);
+    aes_expandkey(&ctx, k.hp, sizeof(k.hp));
+    aes_encrypt(&ctx, mask, pkt + n + 4);
+    pkt[0] ^= mask[0] & 0x0f;
+    pkt[n] ^= mask[1];
+    pkt[n + 1] ^= mask[2];
+    return n + length;
+}
+
+static int quic_test_crypto(u8 *p, const u8 *data, int off, int len)
+{
+    p[0] = QUIC_FRAME_CRYPTO;
+    p[1] = 0x40 | (off >> 8);
+    p[2] = off & 0xff;
+    p[3] = 0x40 | (len >> 8);
+    p[4] = len & 0xff;
+    memcpy(p + 5, data + off, len);
+    return 5 + len;
+}
+
+#define QUIC_TEST_KEY_SHARE_LEN 1600
+#define QUIC_TEST_SPLIT 1100
+
+void TEST_quic(void)
+{
+    static const u8 sni[] = {
+        0x00, 0x00, 0x00, 0x14, 0x00, 0x12, 0x00, 0x00, 0x0f,
+        'w', 'w', 'w', '.', 'y', 'o', 'u', 't', 'u', 'b', 'e', '.', 'c', 'o', 'm'
+    };
+    struct quic_buf *buf;
+    struct quic_hello *saved = NULL;
+    flow_info_t flow;
+    u8 *hello, *frames, *pkt;
+    int n, len, hello_len, ext_len;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    hello = kzalloc(QUIC_HELLO_LEN, GFP_KERNEL);
+    frames = kzalloc(QUIC_MAX_PAYLOAD_LEN, GFP_KERNEL);
+    pkt = kzalloc(QUIC_MAX_PAYLOAD_LEN, GFP_KERNEL);
+    if (!PC_TEST(buf && hello && frames && pkt))
+        goto out;
+
+    // a ClientHello whose key share pushes the server name into the second Initial
+    n = TLS_HANDSHAKE_HDR_LEN + 2 + TLS_RANDOM_LEN;
+    hello[n++] = 0;                     // session id
+    hello[n++] = 0;                     // cipher suites, TLS_AES_128_GCM_SHA256
+    hello[n++] = 2;
+    hello[n++] = 0x13;
+    hello[n++] = 0x01;
+    hello[n++] = 1;                     // compression methods
+    hello[n++] = 0;
+    ext_len = 4 + QUIC_TEST_KEY_SHARE_LEN + sizeof(sni);
+    hello[n++] = ext_len >> 8;
+    hello[n++] = ext_len & 0xff;
+    hello[n++] = 0x00;                  // key_share
+    hello[n++] = 0x33;
+    hello[n++] = QUIC_TEST_KEY_SHARE_LEN >> 8;
+    hello[n++] = QUIC_TEST_KEY_SHARE_LEN & 0xff;
+    n += QUIC_TEST_KEY_SHARE_LEN;
+    memcpy(hello + n, sni, sizeof(sni));
+    n += sizeof(sni);
+    hello_len = n;
+    hello[0] = TLS_HANDSHAKE_CLIENT_HELLO;
+    hello[2] = (hello_len - TLS_HANDSHAKE_HDR_LEN) >> 8;
+    hello[3] = (hello_len - TLS_HANDSHAKE_HDR_LEN) & 0xff;
+    hello[4] = 0x03;
+    hello[5] = 0x03;
+
+    // first Initial, the head of the ClientHello in two frames out of order
+    n = quic_test_crypto(frames, hello, 500, QUIC_TEST_SPLIT - 500);
+    n += quic_test_crypto(frames + n, hello, 0, 500);
+    len = quic_test_initial(pkt, frames, n);
+    memset(&flow, 0, sizeof(flow));
+    flow.l4_protocol = IPPROTO_UDP;
+    flow.l4_data = pkt;
+    flow.l4_len = len;
+    PC_TEST(dpi_quic_initial(&flow));
+    len = quic_decrypt_initial(&flow, buf);
+    if (!PC_TEST(len > 0))
+        goto out;
+    len = quic_collect_crypto(buf, len);
+    PC_TEST(len == QUIC_TEST_SPLIT && quic_hello_need(&buf->hello, len) == hello_len);
+    dpi_tls_client_hello(&flow, buf->hello.data, len);
+    PC_TEST(flow.https.match != PC_TRUE);
+
+    // what pc_quic_reasm_save() keeps is enough for the second Initial to complete it
+    n = quic_hello_size(&buf->hello);
+    PC_TEST(n == offsetof(struct quic_hello, data) + QUIC_TEST_SPLIT);
+    saved = kmalloc(n, GFP_KERNEL);
+    if (!PC_TEST(saved != NULL))
+        goto out;
+    memcpy(saved, &buf->hello, n);
+    memset(buf, 0, sizeof(*buf));
+    memcpy(&buf->hello, saved, n);
+    n = quic_test_crypto(frames, hello, QUIC_TEST_SPLIT, hello_len - QUIC_TEST_SPLIT);
+    flow.l4_len = quic_test_initial(pkt, frames, n);
+    len = quic_decrypt_initial(&flow, buf);
+    if (!PC_TEST(len > 0))
+        goto out;
+    len = quic_collect_crypto(buf, len);
+    PC_TEST(len == hello_len && buf->hello.nrange == 1);
+    PC_TEST(dpi_tls_client_hello(&flow, buf->hello.data, len) == 0);
+    PC_TEST(flow.https.match == PC_TRUE && flow.https.url_len == 15 &&
+            !memcmp(flow.https.url_pos, "www.youtube.com", 15));
+out:
+    kfree(saved);
+    kfree(pkt);
+    kfree(frames);
+    kfree(hello);
+    kfree(buf);
+}
+#else
+int dpi_quic_proto(flow_info_t *flow)
+{
+    return -1;
+}
+
+void TEST_quic(void)
+{
+}
+#endif
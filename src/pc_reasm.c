@@ -0,0 +1,314 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <net/tcp.h>
+#include <net/netfilter/nf_conntrack.h>
+#include "pc_policy.h"
+
+/*
+ * A ClientHello that does not fit in one segment (large key shares) is
+ * copied into a small per-flow buffer until the whole handshake record,
+ * at most PC_REASM_MAX_LEN bytes, has arrived. The entry keeps a reference
+ * on the conntrack it is keyed by, and is freed once the record has been
+ * handed to DPI, on a sequence gap or after PC_REASM_TIMEOUT.
+ *
+ * Each hash bucket has its own lock, so flows only contend when they hash
+ * together. Expired entries are dropped by the flow's next segment, by
+ * the other flows of the bucket, and by a delayed work that runs while
+ * any entry is pending, so a stalled handshake does not keep its conntrack.
+ */
+#define PC_REASM_HASH_BITS 6
+#define PC_REASM_MAX_NUM 64
+#define PC_REASM_MAX_LEN 4096
+#define PC_REASM_TIMEOUT (2 * HZ)
+
+typedef struct pc_reasm_bucket {
+    spinlock_t lock;
+    struct hlist_head head;
+} ____cacheline_aligned_in_smp pc_reasm_bucket_t;
+
+static pc_reasm_bucket_t pc_reasm_hash[1 << PC_REASM_HASH_BITS];
+static atomic_t pc_reasm_num = ATOMIC_INIT(0);
+
+static void pc_reasm_gc(struct work_struct *work);
+static DECLARE_DELAYED_WORK(pc_reasm_gc_work, pc_reasm_gc);
+
+static inline pc_reasm_bucket_t *pc_reasm_bucket(struct nf_conn *ct)
+{
+    return &pc_reasm_hash[hash_ptr(ct, PC_REASM_HASH_BITS)];
+}
+
+// called with the bucket lock held
+static pc_reasm_t *pc_reasm_find(pc_reasm_bucket_t *b, struct nf_conn *ct)
+{
+    pc_reasm_t *r;
+    hlist_for_each_entry(r, &b->head, node) {
+        if (r->ct == ct)
+            return r;
+    }
+    return NULL;
+}
+
+static void pc_reasm_unlink(pc_reasm_t *r)
+{
+    hlist_del(&r->node);
+    atomic_dec(&pc_reasm_num);
+}
+
+void pc_tls_reasm_free(pc_reasm_t *r)
+{
+    nf_ct_put(r->ct);
+    kfree(r);
+}
+
+// move the expired entries of a bucket to gc, called with its lock held
+static void pc_reasm_expire(pc_reasm_bucket_t *b, struct hlist_head *gc)
+{
+    pc_reasm_t *r;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(r, n, &b->head, node) {
+        if (time_after(jiffies, r->expires)) {
+            pc_reasm_unlink(r);
+            hlist_add_head(&r->node, gc);
+        }
+    }
+}
+
+static void pc_reasm_free_list(struct hlist_head *gc)
+{
+    pc_reasm_t *r;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(r, n, gc, node) {
+        hlist_del(&r->node);
+        pc_tls_reasm_free(r);
+    }
+}
+
+static void pc_reasm_gc(struct work_struct *work)
+{
+    struct hlist_head gc = HLIST_HEAD_INIT;
+    pc_reasm_bucket_t *b;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pc_reasm_hash); i++) {
+        b = &pc_reasm_hash[i];
+        if (hlist_empty(&b->head))
+            continue;
+        spin_lock_bh(&b->lock);
+        pc_reasm_expire(b, &gc);
+        spin_unlock_bh(&b->lock);
+    }
+    pc_reasm_free_list(&gc);
+    if (atomic_read(&pc_reasm_num))
+        schedule_delayed_work(&pc_reasm_gc_work, PC_REASM_TIMEOUT);
+}
+
+void pc_tls_reasm_init(void)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(pc_reasm_hash); i++) {
+        spin_lock_init(&pc_reasm_hash[i].lock);
+        INIT_HLIST_HEAD(&pc_reasm_hash[i].head);
+    }
+}
+
+static pc_reasm_t *pc_reasm_alloc(flow_info_t *flow, int size)
+{
+    pc_reasm_t *r;
+
+    if (atomic_inc_return(&pc_reasm_num) > PC_REASM_MAX_NUM) {
+        atomic_dec(&pc_reasm_num);
+        return NULL;
+    }
+    r = kmalloc(sizeof(pc_reasm_t) + size, GFP_ATOMIC);
+    if (!r) {
+        atomic_dec(&pc_reasm_num);
+        return NULL;
+    }
+    r->ct = flow->ct;
+    r->dir = flow->dir;
+    r->expires = jiffies + PC_REASM_TIMEOUT;
+    return r;
+}
+
+// add r to the table, or free it when the flow already has an entry
+static int pc_reasm_insert(pc_reasm_t *r)
+{
+    struct hlist_head gc = HLIST_HEAD_INIT;
+    pc_reasm_bucket_t *b = pc_reasm_bucket(r->ct);
+
+    spin_lock_bh(&b->lock);
+    pc_reasm_expire(b, &gc);
+    if (pc_reasm_find(b, r->ct)) {
+        spin_unlock_bh(&b->lock);
+        atomic_dec(&pc_reasm_num);
+        pc_reasm_free_list(&gc);
+        kfree(r);
+        return PC_FALSE;
+    }
+    nf_conntrack_get(&r->ct->ct_general);
+    hlist_add_head(&r->node, &b->head);
+    spin_unlock_bh(&b->lock);
+    pc_reasm_free_list(&gc);
+    schedule_delayed_work(&pc_reasm_gc_work, PC_REASM_TIMEOUT);
+    return PC_TRUE;
+}
+
+/*
+ * Start reassembly when this segment begins a ClientHello record that
+ * continues in later segments.
+ */
+int pc_tls_reasm_start(flow_info_t *flow)
+{
+    unsigned char *p = flow->l4_data;
+    pc_reasm_t *r;
+    int need;
+
+    if (!flow->ct || flow->l4_protocol != IPPROTO_TCP)
+        return PC_FALSE;
+    if (flow->l4_len < TLS_RECORD_HDR_LEN + 1 || flow->l4_len >= PC_REASM_MAX_LEN)
+        return PC_FALSE;
+    if (p[0] != TLS_RECORD_HANDSHAKE || p[1] != 0x03 || p[2] > 0x04 ||
+            p[TLS_RECORD_HDR_LEN] != TLS_HANDSHAKE_CLIENT_HELLO)
+        return PC_FALSE;
+    need = min(TLS_RECORD_HDR_LEN + ((p[3] << 8) | p[4]), PC_REASM_MAX_LEN);
+    if (need <= flow->l4_len)
+        return PC_FALSE;
+
+    r = pc_reasm_alloc(flow, need);
+    if (!r)
+        return PC_FALSE;
+    r->seq = flow->seq + flow->l4_len;
+    r->len = flow->l4_len;
+    r->need = need;
+    memcpy(r->buf, p, flow->l4_len);
+    if (!pc_reasm_insert(r))
+        return PC_FALSE;
+    PC_LMT_DEBUG("tls reasm start, %d of %d bytes\n", flow->l4_len, need);
+    return PC_TRUE;
+}
+
+/*
+ * Append this segment to the flow's pending ClientHello.
+ * Return PC_FALSE when the flow is not being reassembled, PC_TRUE when the
+ * segment was consumed. *done is set to the complete record, which the
+ * caller owns and releases with pc_tls_reasm_free().
+ */
+int pc_tls_reasm_feed(flow_info_t *flow, pc_reasm_t **done)
+{
+    struct hlist_head gc = HLIST_HEAD_INIT;
+    pc_reasm_bucket_t *b;
+    pc_reasm_t *r;
+    u_int32_t off = 0;
+    int n, ret = PC_TRUE;
+
+    *done = NULL;
+    if (!atomic_read(&pc_reasm_num) || !flow->ct || flow->l4_protocol != IPPROTO_TCP)
+        return PC_FALSE;
+
+    b = pc_reasm_bucket(flow->ct);
+    if (hlist_empty(&b->head))
+        return PC_FALSE;
+    spin_lock_bh(&b->lock);
+    // an expired entry of this flow goes too, it then falls back to plain DPI
+    pc_reasm_expire(b, &gc);
+    r = pc_reasm_find(b, flow->ct);
+    if (!r || r->dir != flow->dir) {
+        ret = PC_FALSE;
+        goto unlock;
+    }
+    if (after(flow->seq, r->seq)) {
+        PC_LMT_DEBUG("tls reasm dropped, %d of %d bytes\n", r->len, r->need);
+        pc_reasm_unlink(r);
+        hlist_add_head(&r->node, &gc);
+        ret = PC_FALSE;
+        goto unlock;
+    }
+    // retransmitted data, only the part after r->seq is new
+    if (before(flow->seq, r->seq)) {
+        off = r->seq - flow->seq;
+        if (off >= flow->l4_len)
+            goto unlock;
+    }
+    n = min_t(int, flow->l4_len - off, r->need - r->len);
+    memcpy(r->buf + r->len, flow->l4_data + off, n);
+    r->len += n;
+    r->seq += n;
+    if (r->len >= r->need) {
+        pc_reasm_unlink(r);
+        *done = r;
+    }
+unlock:
+    spin_unlock_bh(&b->lock);
+    pc_reasm_free_list(&gc);
+    return ret;
+}
+
+/*
+ * A post-quantum ClientHello does not fit in one QUIC Initial. The parser
+ * parks what it has of the first Initial here, and takes it back when the
+ * next Initial of the flow arrives.
+ */
+int pc_quic_reasm_save(flow_info_t *flow, const void *data, int len)
+{
+    pc_reasm_t *r;
+
+    if (!flow->ct || flow->l4_protocol != IPPROTO_UDP)
+        return PC_FALSE;
+    r = pc_reasm_alloc(flow, len);
+    if (!r)
+        return PC_FALSE;
+    r->seq = 0;
+    r->len = len;
+    r->need = len;
+    memcpy(r->buf, data, len);
+    return pc_reasm_insert(r);
+}
+
+// the caller releases the entry with pc_tls_reasm_free()
+pc_reasm_t *pc_quic_reasm_take(flow_info_t *flow)
+{
+    pc_reasm_bucket_t *b;
+    pc_reasm_t *r;
+
+    if (!atomic_read(&pc_reasm_num) || !flow->ct || flow->l4_protocol != IPPROTO_UDP)
+        return NULL;
+    b = pc_reasm_bucket(flow->ct);
+    if (hlist_empty(&b->head))
+        return NULL;
+    spin_lock_bh(&b->lock);
+    r = pc_reasm_find(b, flow->ct);
+    if (r && (r->dir != flow->dir || time_after(jiffies, r->expires)))
+        r = NULL;
+    if (r)
+        pc_reasm_unlink(r);
+    spin_unlock_bh(&b->lock);
+    return r;
+}
+
+void pc_tls_reasm_exit(void)
+{
+    struct hlist_head gc = HLIST_HEAD_INIT;
+    pc_reasm_bucket_t *b;
+    pc_reasm_t *r;
+    struct hlist_node *n;
+    int i;
+
+    cancel_delayed_work_sync(&pc_reasm_gc_work);
+    for (i = 0; i < ARRAY_SIZE(pc_reasm_hash); i++) {
+        b = &pc_reasm_hash[i];
+        spin_lock_bh(&b->lock);
+        hlist_for_each_entry_safe(r, n, &b->head, node) {
+            pc_reasm_unlink(r);
+            hlist_add_head(&r->node, &gc);
+        }
+        spin_unlock_bh(&b->lock);
+    }
+    pc_reasm_free_list(&gc);
+}
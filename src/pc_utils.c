@@ -60,7 +60,7 @@ void dump_str(char *name, unsigned char *p, int len)
         len = MAX_DUMP_STR_LEN - 1;
     }
     printk("%s: ", name);
-    strncpy(buf, p, len);
+    strncpy(buf, (char *)p, len);
     printk("[%s]\n", buf);
 }
 
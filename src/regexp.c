@@ -3,229 +3,402 @@
 #include <linux/types.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include "pc_policy.h"
 //#include "regexp.h"
 
-typedef enum {CHAR, DOT, BEGIN, END, STAR, PLUS, QUES, LIST, TYPENUM} TYPE;
+/*
+ * The supported dialect has no alternation or grouping, a pattern is a
+ * sequence of atoms (char, '.', [class], \d, \D), each optionally followed
+ * by '*', '+' or '?', with '^' and '$' anchors. It is compiled into a
+ * position automaton simulated bit-parallel (shift-and): state k means
+ * "atoms 0..k-1 matched", one bit per state. Matching is a single pass over
+ * the text without recursion or allocation, so its cost only depends on
+ * the text length and the pattern size.
+ */
+#define RE_MAX_WORDS 8
+#define RE_MAX_STATES (RE_MAX_WORDS * 64)
 
-typedef struct RE {
-    TYPE type;
-    int ch;
-    char *ccl;
-    int nccl;
-    struct RE *next;
-} RE;
+enum {
+    RE_ONE = 0,     // exactly once
+    RE_OPT,         // '?'
+    RE_STAR,        // '*', a '+' becomes an RE_ONE followed by an RE_STAR
+};
 
-int match_longest = 0;
-char *match_first = NULL;
+typedef struct re_atom {
+    u8 set[32];     // bitmap of the bytes the atom accepts
+    u8 kind;
+} re_atom_t;
 
+typedef struct RE {
+    u8 nwords;
+    u8 anchor_begin;
+    u8 anchor_end;
+    u8 eps_run;     // longest run of optional atoms, bounds the closure
+    u16 accept;     // index of the accepting state
+    u16 ncls;
+    u8 cls_map[256];    // byte -> equivalence class
+    u64 *star;      // states that may stay on their atom
+    u64 *eps;       // states that may skip their atom
+    u64 *init;      // epsilon closure of state 0
+    u64 *cls;       // ncls masks of the states whose atom accepts the class
+    u64 data[0];
+} RE;
 
 static void *getmem(size_t size)
 {
     void *tmp;
-    if ((tmp = kmalloc(size, GFP_ATOMIC)) == NULL) {
+    if ((tmp = kzalloc(size, GFP_KERNEL)) == NULL) {
         printk("malloc failed");
         return NULL;
     }
     return tmp;
 }
 
-static size_t creat_list(char *str, int start, int end)
+static inline void set_add(u8 *set, unsigned char ch)
 {
-    size_t cnt = end - start + 1;
-    for (; start <= end ; start++)
-        *str++ = start;
-    return (cnt > 0) ? cnt : 0;
+    set[ch >> 3] |= 1 << (ch & 7);
 }
 
-static int in_list(char ch, RE *regexp)
+static inline int set_has(const u8 *set, unsigned char ch)
 {
-    char *str = regexp->ccl;
-    if (regexp->type != LIST)
-        return 0;
-    for (; *str && ch != *str; str++)
-        ;
-    return (*str != '\0') ^ regexp->nccl;
+    return set[ch >> 3] & (1 << (ch & 7));
 }
 
-static void regexp_free(RE *regexp)
+static void set_range(u8 *set, int start, int end)
 {
-    RE *tmp;
-    for (; regexp; regexp = tmp) {
-        tmp = regexp->next;
-        kfree(regexp);
+    for (; start <= end; start++)
+        set_add(set, start);
+}
+
+static void set_invert(u8 *set)
+{
+    int i;
+    for (i = 0; i < 32; i++)
+        set[i] = ~set[i];
+}
+
+/* parse a [...] class, returns a pointer to the closing ']' or NULL on error */
+static const char *parse_class(const char *p, re_atom_t *atom)
+{
+    int neg = 0, empty = 1;
+    if (*++p == '^') {
+        neg = 1;
+        p++;
+    }
+    while (*p != '\0' && *p != ']') {
+        if (*p != '-') {
+            set_add(atom->set, *p++);
+            empty = 0;
+            continue;
+        }
+        if (empty || *(p + 1) == ']' || *(p + 1) == '\0')
+            return NULL;
+        set_range(atom->set, (unsigned char)*(p - 1) + 1, (unsigned char)*(p + 1));
+        p += 2;
     }
+    if (*p == '\0')
+        return NULL;
+    if (neg)
+        set_invert(atom->set);
+    return p;
 }
 
-static RE *compile(char *regexp)
+static int parse(const char *p, re_atom_t *atoms, int max, RE *re)
 {
-    RE head, *tail, *tmp;
-    char *pstr;
-    int err_flag = 0;
+    int n = 0, have_atom = 0;
+    re_atom_t *atom;
 
-    for (tail = &head; *regexp != '\0' && err_flag == 0; regexp++) {
-        tmp = getmem(sizeof(RE));
-        switch (*regexp) {
+    if (*p == '^') {
+        re->anchor_begin = 1;
+        p++;
+    }
+    for (; *p != '\0'; p++) {
+        if (*p == '$' && *(p + 1) == '\0') {
+            re->anchor_end = 1;
+            break;
+        }
+        if ((*p == '*' || *p == '+' || *p == '?') && have_atom) {
+            if (*p == '*') {
+                atoms[n - 1].kind = RE_STAR;
+            } else if (*p == '?') {
+                atoms[n - 1].kind = RE_OPT;
+            } else {
+                if (n >= max)
+                    return -1;
+                atoms[n] = atoms[n - 1];
+                atoms[n].kind = RE_STAR;
+                n++;
+            }
+            have_atom = 0;
+            continue;
+        }
+        if (n >= max)
+            return -1;
+        atom = &atoms[n++];
+        memset(atom, 0x0, sizeof(re_atom_t));
+        atom->kind = RE_ONE;
+        switch (*p) {
+            case '.':
+                set_range(atom->set, 1, 255);
+                break;
             case '\\':
-                regexp++;
-                if (*regexp == 'd') {
-                    tmp->type = LIST;
-                    tmp->nccl = 0;
-                    tmp->ccl = getmem(11);
-                    creat_list(tmp->ccl, '0', '9');
-                    tmp->ccl[11] = '\0';
-                } else if (*regexp == 'D') {
-                    tmp->type = LIST;
-                    tmp->nccl = 1;
-                    tmp->ccl = getmem(11);
-                    creat_list(tmp->ccl, '0', '9');
-                    tmp->ccl[11] = '\0';
+                p++;
+                if (*p == '\0')
+                    return -1;
+                if (*p == 'd' || *p == 'D') {
+                    set_range(atom->set, '0', '9');
+                    if (*p == 'D')
+                        set_invert(atom->set);
                 } else {
-                    tmp->type = CHAR;
-                    tmp->ch = *(regexp + 1);
+                    set_add(atom->set, *p);
                 }
                 break;
-            case '.':
-                tmp->type = DOT;
-                break;
-            case '^':
-                tmp->type = BEGIN;
-                tmp->ch = '^';
-                break;
-            case '$':
-                tmp->type = END;
-                tmp->ch = '$';
+            case '[':
+                p = parse_class(p, atom);
+                if (p == NULL)
+                    return -1;
                 break;
             case '*':
-                tmp->type = STAR;
-                break;
             case '+':
-                tmp->type = PLUS;
-                break;
             case '?':
-                tmp->type = QUES;
-                break;
-            case '[':
-                pstr = tmp->ccl = getmem(256);
-                tmp->nccl = 0;
-                if (*++regexp == '^') {
-                    tmp->nccl = 1;
-                    regexp++;
-                }
-                while (*regexp != '\0' && *regexp != ']') {
-                    if (*regexp != '-') {
-                        *pstr++ = *regexp++;
-                        continue;
-                    }
-                    if (pstr == tmp->ccl || *(regexp + 1) == ']') {
-                        err_flag = 1;
-                        break;
-                    }
-                    pstr += creat_list(pstr, *(regexp - 1) + 1, *(regexp + 1));
-                    regexp += 2;
-                }
-                *pstr = '\0';
-                if (*regexp == '\0')
-                    err_flag = 1;
-                tmp->type = LIST;
+                // quantifier without an atom, never matches
                 break;
             default:
-                tmp->type = CHAR;
-                tmp->ch = *regexp;
+                set_add(atom->set, *p);
         }
-
-        tail->next = tmp;
-        tail = tmp;
+        // the text is a C string, NUL never matches
+        atom->set[0] &= ~1;
+        have_atom = 1;
     }
+    return n;
+}
 
-    tail->next = NULL;
-    if (err_flag) {
-        regexp_free(head.next);
+/* compile time scratch, too large for the stack */
+struct re_scratch {
+    re_atom_t atoms[RE_MAX_STATES - 1];
+    u64 masks[256][RE_MAX_WORDS];
+    u8 cls_map[256];
+};
+
+static RE *compile(const char *regexp)
+{
+    RE head, *re = NULL;
+    struct re_scratch *sc;
+    re_atom_t *atoms;
+    u64 (*masks)[RE_MAX_WORDS];
+    u8 *cls_map;
+    int n, i, j, k, run, ncls = 0, nwords;
+
+    sc = kmalloc(sizeof(struct re_scratch), GFP_KERNEL);
+    if (sc == NULL)
         return NULL;
+    atoms = sc->atoms;
+    masks = sc->masks;
+    cls_map = sc->cls_map;
+    memset(&head, 0x0, sizeof(head));
+    n = parse(regexp, atoms, RE_MAX_STATES - 1, &head);
+    if (n < 0)
+        goto out;
+    nwords = n / 64 + 1;
+
+    // group the bytes accepted by the same set of states into classes
+    for (i = 0; i < 256; i++) {
+        u64 col[RE_MAX_WORDS] = {0};
+        for (k = 0; k < n; k++) {
+            if (set_has(atoms[k].set, i))
+                col[k / 64] |= 1ULL << (k % 64);
+        }
+        for (j = 0; j < ncls; j++) {
+            if (0 == memcmp(masks[j], col, nwords * sizeof(u64)))
+                break;
+        }
+        if (j == ncls) {
+            memcpy(masks[ncls], col, nwords * sizeof(u64));
+            ncls++;
+        }
+        cls_map[i] = j;
     }
-    return head.next;
-}
 
-#define MATCH_ONE(reg, text) \
-   	(reg->type == DOT || in_list(*text, reg) || *text == reg->ch)
-#define MATCH_ONE_P(reg, text) \
-   	(in_list(*text++, reg) || *(text - 1) == reg->ch || reg->type == DOT)
+    re = getmem(sizeof(RE) + (3 + ncls) * nwords * sizeof(u64));
+    if (re == NULL)
+        goto out;
+    re->nwords = nwords;
+    re->anchor_begin = head.anchor_begin;
+    re->anchor_end = head.anchor_end;
+    re->accept = n;
+    re->ncls = ncls;
+    memcpy(re->cls_map, cls_map, sizeof(re->cls_map));
+    re->star = re->data;
+    re->eps = re->star + nwords;
+    re->init = re->eps + nwords;
+    re->cls = re->init + nwords;
+    for (j = 0; j < ncls; j++)
+        memcpy(re->cls + j * nwords, masks[j], nwords * sizeof(u64));
 
-static int matchhere(RE *regexp, char *text);
+    run = 0;
+    re->init[0] = 1;
+    for (k = 0; k < n; k++) {
+        if (atoms[k].kind == RE_STAR)
+            re->star[k / 64] |= 1ULL << (k % 64);
+        if (atoms[k].kind != RE_ONE) {
+            re->eps[k / 64] |= 1ULL << (k % 64);
+            if (++run > re->eps_run)
+                re->eps_run = run;
+            if (run == k + 1)
+                re->init[(k + 1) / 64] |= 1ULL << ((k + 1) % 64);
+        } else {
+            run = 0;
+        }
+    }
+out:
+    kfree(sc);
+    return re;
+}
 
-static int matchstar(RE *cur, RE *regexp, char *text)
+void regexp_release(RE *regexp)
 {
-    do {
-        if (matchhere(regexp, text))
-            return 1;
-    } while (*text != '\0' && MATCH_ONE_P(cur, text));
-    return 0;
+    kfree(regexp);
 }
 
-static int matchstar_l(RE *cur, RE *regexp, char *text)
+static int regexp_exec_1(RE *re, const unsigned char *t)
 {
-    char *t;
-    for (t = text; *t != '\0' && MATCH_ONE(cur, t); t++)
-        ;
-    do {
-        if (matchhere(regexp, t))
+    u64 star = re->star[0], eps = re->eps[0], init = re->init[0];
+    u64 acc = 1ULL << re->accept;
+    u64 s = init, m;
+    int i;
+
+    for (; *t != '\0'; t++) {
+        if (!re->anchor_end && (s & acc))
             return 1;
-    } while (t-- > text);
-    return 0;
+        if (!re->anchor_begin)
+            s |= init;
+        else if (!s)
+            return 0;
+        m = s & re->cls[re->cls_map[*t]];
+        s = ((m & ~star) << 1) | (m & star);
+        for (i = 0; i < re->eps_run; i++)
+            s |= (s & eps) << 1;
+    }
+    if (!re->anchor_begin)
+        s |= init;
+    return (s & acc) != 0;
 }
 
-static int matchplus(RE *cur, RE *regexp, char *text)
+static int regexp_exec_n(RE *re, const unsigned char *t)
 {
-    while (*text != '\0' && MATCH_ONE_P(cur, text)) {
-        if (matchhere(regexp, text))
+    u64 s[RE_MAX_WORDS], m;
+    u64 carry;
+    const u64 *cls;
+    int nwords = re->nwords;
+    int acc_word = re->accept / 64;
+    u64 acc = 1ULL << (re->accept % 64);
+    int i, w, any;
+
+    memcpy(s, re->init, nwords * sizeof(u64));
+    for (; *t != '\0'; t++) {
+        if (!re->anchor_end && (s[acc_word] & acc))
             return 1;
+        any = 0;
+        for (w = 0; w < nwords; w++) {
+            if (!re->anchor_begin)
+                s[w] |= re->init[w];
+            any |= s[w] != 0;
+        }
+        if (!any)
+            return 0;
+        cls = re->cls + re->cls_map[*t] * nwords;
+        carry = 0;
+        for (w = 0; w < nwords; w++) {
+            m = s[w] & cls[w];
+            s[w] = ((m & ~re->star[w]) << 1) | carry | (m & re->star[w]);
+            carry = (m & ~re->star[w]) >> 63;
+        }
+        for (i = 0; i < re->eps_run; i++) {
+            carry = 0;
+            for (w = 0; w < nwords; w++) {
+                m = s[w] & re->eps[w];
+                s[w] |= (m << 1) | carry;
+                carry = m >> 63;
+            }
+        }
     }
-    return 0;
+    if (!re->anchor_begin) {
+        for (w = 0; w < nwords; w++)
+            s[w] |= re->init[w];
+    }
+    return (s[acc_word] & acc) != 0;
 }
 
-static int matchplus_l(RE *cur, RE *regexp, char *text)
+/* the only byte an atom accepts, or -1 */
+static int atom_char(const re_atom_t *atom)
 {
-    char *t;
-    for (t = text; *t != '\0' && MATCH_ONE(cur, t); t++)
-        ;
-    for (; t > text; t--) {
-        if (matchhere(regexp, t))
-            return 1;
+    int i, ch = -1;
+    for (i = 1; i < 256; i++) {
+        if (!set_has(atom->set, i))
+            continue;
+        if (ch >= 0)
+            return -1;
+        ch = i;
     }
-    return 0;
+    return ch;
 }
 
-static int matchques(RE *cur, RE *regexp, char *text)
+/*
+ * Copy the longest run of atoms that must appear literally in every match
+ * into lit, used to index patterns for prefiltering. Returns its length,
+ * 0 if the pattern has no such literal, -1 if it is invalid.
+ */
+int regexp_literal(const char *reg, char *lit, int size)
 {
-    int cnt = 1;
-    char *t = text;
-    if (*t != '\0' && cnt-- && MATCH_ONE(cur, t))
-        t++;
-    do {
-        if (matchhere(regexp, t))
-            return 1;
-    } while (t-- > text);
-    return 0;
-}
+    RE head;
+    re_atom_t *atoms;
+    int n, k, start = 0, len = 0, best_start = 0, best_len = 0;
 
-static int (*matchfun[TYPENUM][2])(RE *, RE *, char *) = {
-    0, 0, 0, 0, 0, 0, 0, 0,
-    matchstar, matchstar_l,
-    matchplus, matchplus_l,
-    matchques, matchques,
-};
+    atoms = kmalloc(sizeof(re_atom_t) * (RE_MAX_STATES - 1), GFP_KERNEL);
+    if (atoms == NULL)
+        return -1;
+    memset(&head, 0x0, sizeof(head));
+    n = parse(reg, atoms, RE_MAX_STATES - 1, &head);
+    for (k = 0; k < n; k++) {
+        if (atoms[k].kind != RE_ONE || atom_char(&atoms[k]) < 0) {
+            len = 0;
+            continue;
+        }
+        if (len++ == 0)
+            start = k;
+        if (len > best_len) {
+            best_len = len;
+            best_start = start;
+        }
+    }
+    if (best_len > size - 1)
+        best_len = size - 1;
+    for (k = 0; k < best_len; k++)
+        lit[k] = atom_char(&atoms[best_start + k]);
+    lit[best_len] = '\0';
+    kfree(atoms);
+    return n < 0 ? -1 : best_len;
+}
 
-static int matchhere(RE *regexp, char *text)
+/*
+ * Compile a pattern once, the result is executed with regexp_exec() from
+ * the data path and released with regexp_release(). May sleep.
+ */
+RE *regexp_compile(const char *reg)
 {
-    if (regexp == NULL)
-        return 1;
-    if (regexp->type == END && regexp->next == NULL)
-        return *text == '\0';
-    if (regexp->next && matchfun[regexp->next->type][match_longest])
-        return matchfun[regexp->next->type][match_longest](regexp, regexp->next->next, text);
+    return compile(reg);
+}
 
-    if (*text != '\0' && MATCH_ONE(regexp, text))
-        return matchhere(regexp->next, text + 1);
-    return 0;
+/*
+ * return value:
+ *		0		not match
+ *		1		matched
+ */
+int regexp_exec(RE *regexp, char *text)
+{
+    if (regexp->nwords == 1)
+        return regexp_exec_1(regexp, (const unsigned char *)text);
+    return regexp_exec_n(regexp, (const unsigned char *)text);
 }
 
 /*
@@ -240,47 +413,260 @@ int regexp_match(char *reg, char *text)
     RE *regexp = compile(reg);
     if (regexp == NULL)
         return -1;
+    ret = regexp_exec(regexp, text);
+    regexp_release(regexp);
+    return ret;
+}
 
-    if (regexp->type == BEGIN) {
-        ret = matchhere(regexp->next, text);
-        goto out;
+
+static void TEST_reg_func(char *reg, char *str, int ret)
+{
+    if (!PC_TEST(ret == regexp_match(reg, str)))
+        PC_ERROR("[selftest] reg = %s, str = %s, expected %d\n", reg, str, ret);
+}
+
+/*
+ * Reference matcher with the semantics of the former backtracking engine,
+ * run on the pattern text. '\x' is a literal x here as in compile().
+ */
+static int ref_atom_len(const char *re)
+{
+    const char *p = re;
+    if (*p == '\\' && p[1])
+        return 2;
+    if (*p != '[')
+        return 1;
+    for (p++; *p && *p != ']'; p++)
+        ;
+    return p - re + (*p == ']');
+}
+
+static int ref_atom_match(const char *re, unsigned char c)
+{
+    const char *p;
+    int neg, in = 0;
+
+    if (*re == '.')
+        return 1;
+    if (*re == '\\') {
+        if (re[1] == 'd' || re[1] == 'D')
+            return (c >= '0' && c <= '9') ^ (re[1] == 'D');
+        return c == (unsigned char)re[1];
+    }
+    if (*re != '[')
+        return c == (unsigned char)*re;
+    p = re + 1;
+    neg = (*p == '^');
+    p += neg;
+    for (; *p && *p != ']'; p++) {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            in |= (c >= (unsigned char)p[0] && c <= (unsigned char)p[2]);
+            p += 2;
+        } else {
+            in |= (c == (unsigned char)*p);
+        }
     }
+    return in ^ neg;
+}
+
+static int ref_here(const char *re, const char *t)
+{
+    int n;
+    if (!*re)
+        return 1;
+    if (re[0] == '$' && !re[1])
+        return !*t;
+    n = ref_atom_len(re);
+    switch (re[n]) {
+        case '*':
+            do {
+                if (ref_here(re + n + 1, t))
+                    return 1;
+            } while (*t && ref_atom_match(re, *t++));
+            return 0;
+        case '+':
+            while (*t && ref_atom_match(re, *t++)) {
+                if (ref_here(re + n + 1, t))
+                    return 1;
+            }
+            return 0;
+        case '?':
+            if (*t && ref_atom_match(re, *t) && ref_here(re + n + 1, t + 1))
+                return 1;
+            return ref_here(re + n + 1, t);
+    }
+    if (*t && ref_atom_match(re, *t))
+        return ref_here(re + n, t + 1);
+    return 0;
+}
 
+static int ref_match(const char *re, const char *t)
+{
+    if (*re == '^')
+        return ref_here(re + 1, t);
     do {
-        if ((ret = matchhere(regexp, text))) {
-            goto out;
-        }
-    } while (*text++ != '\0');
+        if (ref_here(re, t))
+            return 1;
+    } while (*t++);
+    return 0;
+}
 
-out:
-    regexp_free(regexp);
-    return ret;
+// a text the pattern matches: anchors dropped, each quantified atom once
+static void reg_sample(const char *reg, char *buf, int size)
+{
+    const char *p = reg + (*reg == '^');
+    int n, len = 0;
+
+    for (; *p && len < size - 1; p += n) {
+        n = ref_atom_len(p);
+        if (*p == '$' && !p[1])
+            break;
+        if (*p == '*' || *p == '+' || *p == '?')
+            continue;
+        buf[len++] = (*p == '\\') ? p[1] : *p;
+    }
+    buf[len] = '\0';
 }
 
+// every host_url and request_url of files/app_feature.cfg and app_feature_en.cfg
+static const char *TEST_reg_lib[] = {
+    "-dy-", "-dy.", ".dangdang.com", ".gifshow.com", ".huoshan.com", ".inke.cn",
+    ".kuwo.cn", ".suning.", ".ximalaya.com", ".yhd.com", "/beacon", "/man/api",
+    "/mediaplatform", "/mmtls", "/sgame/", "12306.cn", "126.com", "163.com",
+    "1688.com", "17173.com", "2345.com", "360buyimg", "37.com", "4399.com",
+    "51job", "520yidui", "58.com", "58cdn", "58pic.com", "7k7k.com",
+    "^/amobile.music.tc.qq.com", "abchina.com", "adobe.com", "aegis.qq.com",
+    "ali213.net", "alibaba", "alicdn.com", "aliexpress.com", "alipay.com",
+    "aliyundrive", "amazon.cn", "amazon.com", "anjuke.com",
+    "apkappdefwsdl.vivo", "appsimg.com", "appstore.vivo", "asos.com",
+    "asphalt9", "autohome.com.cn", "baidu.com", "baihe.com", "baixing.com",
+    "bankcomm.com", "bestbuy.com", "bilivideo", "bitauto.com", "boc.cn",
+    "booking.com", "bosc.cn", "britannica.com", "btrace.qq.com",
+    "cambridge.org", "ccb.com", "changba.com", "china.com", "chinahr.com",
+    "cib.com.cn", "citicbank.com", "cloud.huawei.com", "cmbchina.com",
+    "cnbc.com", "costco.com", "craigslist.org", "cricbuzz.com", "csdn.net",
+    "ctrip.com", "ctyunapi", "cuyana.com", "d?host=", "dailymotion",
+    "dajie.com", "dddja.com", "ddxq.mobi", "dewu.com", "dianping.com",
+    "dict.youdao.com", "dictionary.com", "dingtalk", "dmzj.com", "docin.com",
+    "douban.com", "douban.fm", "doumi", "douyin", "eastmoney.com", "ebay.com",
+    "eleme", "espn.com", "espncricinfo.com", "etsy.com", "facebook.com",
+    "faloo.com", "fandom.com", "fang.com", "fanxing", "flashscore.com",
+    "fliggy.com", "fm.taihe.com", "g37.proxima", "g79mclobt.nie.netease",
+    "gamersky.com", "ganji.com", "globo.com", "gome.com", "gsmarena.com",
+    "gzmiyuan.com", "gzzhitu.com", "hao123.com", "happyelements",
+    "healthline.com", "hexun.com", "hicloud.com", "hitv", "hlmj.huanle",
+    "hs.ixigua.com", "hs.pstatp.com", "huajiao", "hulu", "huya", "hzhstb.com",
+    "ifeng.com", "ikea.cn", "indeed.com", "indiatimes.com", "instagram.com",
+    "investopedia.com", "iosapps.itunes.apple.com", "iqiyi.com", "itemfix",
+    "itunes.apple.com", "jd.com", "jdcdn.com", "jianguoyun", "jiayuan.com",
+    "jiuxian.com", "kanzhun.com", "kaola", "kepler8", "kgimg", "kohls.com",
+    "ksyuncdn.com", "kuaishou", "kugou", "lagou.com", "lazada.com",
+    "lianjia.com", "liepin", "line", "linkedin", "linkedin.com", "lllag.com",
+    "lottery.gov.cn", "lowes.com", "lrs.fp", "lrts.me", "lvmama.com", "ly.com",
+    "ma77.", "mafengwo.cn", "mayoclinic.org", "meituan", "mengtuiapp.com",
+    "merriam-webster.com", "mgtv", "microsoft.com", "mogucdn", "mogujie",
+    "momo", "mop.com", "music.126", "music.163", "music.apple.com",
+    "music.taihe.com", "myhuaweicloud.cn", "nanrenbang", "naver.com", "netflix",
+    "nordstrom.com", "ocj.com", "ocj2.kksmg", "oray.com", "oray.net",
+    "outlook.live.com", "p5w.net", "pan.lanzou.com", "pcauto.com.cn",
+    "people.com.cn", "pinduoduo", "pingtas.qq.com", "play.google.com",
+    "poizon.com", "pornhub.com", "ppkankan", "psbc.com", "pupuapi", "pupumall",
+    "qidian.com", "qiniucdn", "qiyukf", "qqmusic", "qyer.com", "reddit.com",
+    "roblox.com", "rottentomatoes.com", "s1p.cdntip.com", "samsung.com",
+    "sears.com", "shihuo", "shixiseng.com", "shopapi.io.mi.com", "sina.com",
+    "smzdm.com", "snapchat.com", "sohu.com", "soulapp", "spdb.com.cn",
+    "speedtest.net", "sports.cctv.com", "sporttery.cn", "spotify.com",
+    "ssyoutube.com", "steampowered.com", "stockstar.com", "tancdn", "tantanapp",
+    "taobao", "tc.qq.com", "teamviewer", "thefreedictionary.com",
+    "thepiratebay.org", "tianya.cn", "tianyancha.com", "tiktok",
+    "timeanddate.com", "tinder.com", "tmall.com", "tripadvisor.com",
+    "tuniu.com", "twitch", "twitter.com", "update.microsoft.com", "upgcxcode",
+    "v.qq.com", "video.qq.com", "vimeo", "vip.com", "vips-mobile", "vipshop",
+    "vipstatic.com", "vk.com", "vod.300hu.com", "vube", "walmart.com",
+    "weather.com", "webmd.com", "wegame-client", "weibo", "weidian",
+    "weishi.qq.com", "weiyun.com", "whatsapp", "wikipedia.com",
+    "wiktionary.org", "windowsupdate.com", "wish.com", "www.apple.com",
+    "www.bbc.com", "www.google.com", "www.hupu.com", "www.pinterest.com",
+    "xcar.com.cn", "xhscdn", "xiachufang.com", "xiami", "xianyu", "xiaohongshu",
+    "xiaomei", "xiaoxiangyoupin", "xnxx.com", "xssh.qq", "xueqiu.com",
+    "xvideos.com", "xxsy.net", "yahoo", "yangkeduo.com", "yanxuan", "yelp.com",
+    "yicai.com", "yingjiesheng.com", "yinyuetai.com", "ymatou.com", "yoho.cn",
+    "yohobuy.com", "youpin", "youtube", "yuanshen.com", "yunjiglobal",
+    "yunjiweidian", "yximgs.com", "zhaopin", "zhcw.com", "zhe800.com",
+    "zhefengle.com", "zhenai.com", "zhihu.com", "zhipin.com", "zhuanstatic",
+    "zhuanzhuan", "zongheng.com",
+};
+
+static const char *TEST_reg_text[] = {
+    "", "www.baidu.com", "r3---sn-ab5l6nrz.googlevideo.com", "v3-dy-o.zjcdn.com",
+    "/dns?host=qq.com", "/amobile.music.tc.qq.com/C400.m4a", "music.163.com",
+    "api.weibo.cn", "img.alicdn.com", "www.google.com.hk", "ma77.xyz", "a.suning.cn",
+    "/mmtls/0a1b", "/man/api/v2", "update.microsoft.com.cn", "x.y", "-dy.", "d?host",
+};
 
-void TEST_reg_func(char *reg, char *str, int ret)
+// the library patterns give the same result as the former engine
+static void TEST_regexp_lib(void)
 {
+    char hit[128], text[160];
+    RE *re;
+    int i, j, ok;
 
-    if (ret != regexp_match(reg, str)) {
-        if (reg)
-            printk("reg = %s,", reg);
-        else
-            printk("reg = null");
-        if (str)
-            printk("str = %s ", str);
-        else
-            printk("str= null");
-        printk("error, unit test.... failed, ret = %d\n", ret);
-    } else {
-        if (reg && str)
-            printk("[unit test] %s %s......ok,ret = %d\n", reg, str, ret);
+    for (i = 0; i < ARRAY_SIZE(TEST_reg_lib); i++) {
+        re = compile(TEST_reg_lib[i]);
+        if (!PC_TEST(re != NULL)) {
+            PC_ERROR("[selftest] reg = %s does not compile\n", TEST_reg_lib[i]);
+            continue;
+        }
+        reg_sample(TEST_reg_lib[i], hit, sizeof(hit));
+        // the sample matches, also inside a longer host unless anchored
+        ok = regexp_exec(re, hit) == 1;
+        snprintf(text, sizeof(text), "www.%s/x", hit);
+        ok &= regexp_exec(re, text) == (TEST_reg_lib[i][0] != '^');
+        // without its last byte it does not
+        hit[strlen(hit) - 1] = '\0';
+        ok &= regexp_exec(re, hit) == 0;
+        for (j = 0; j < ARRAY_SIZE(TEST_reg_text); j++)
+            ok &= regexp_exec(re, (char *)TEST_reg_text[j]) == ref_match(TEST_reg_lib[i], TEST_reg_text[j]);
+        // and on the hosts the other patterns are written for
+        for (j = 0; j < ARRAY_SIZE(TEST_reg_lib); j++) {
+            reg_sample(TEST_reg_lib[j], text, sizeof(text));
+            ok &= regexp_exec(re, text) == ref_match(TEST_reg_lib[i], text);
+        }
+        if (!PC_TEST(ok))
+            PC_ERROR("[selftest] reg = %s differs from the reference\n", TEST_reg_lib[i]);
+        regexp_release(re);
     }
 }
 
 void TEST_regexp(void)
 {
+    char host[] = "r3---sn-ab5l6nrz.googlevideo.com";
+    RE *re;
+
     TEST_reg_func(".*baidu.com$", "www.baidu.com", 1);
     TEST_reg_func("^sina.com", "www.sina.com.cn", 0);
     TEST_reg_func("^sina.com", "sina.com.cn", 1);
     TEST_reg_func(".*baidu.com$", "www.baidu.com223", 0);
+    TEST_reg_func(".*a.*b", "xxaxxxb", 1);
+    TEST_reg_func(".*a.*b", "xxbxxxa", 0);
+    TEST_reg_func("d?host=", "/dns?host=qq.com", 1);
+    TEST_reg_func("ab+c", "ac", 0);
+    TEST_reg_func("ab+c", "abbbc", 1);
+    TEST_reg_func("^a*$", "", 1);
+    TEST_reg_func("v\\d+\\.qq", "v12.qq.com", 1);
+    TEST_reg_func("[^0-9]x", "1x", 0);
+    TEST_reg_func("[a-c]\\D", "b-", 1);
+    TEST_reg_func("[abc", "abc", -1);
+    // host features of the shipped library
+    TEST_reg_func("googlevideo", host, 1);
+    TEST_reg_func("-dy-", "v3-dy-o.zjcdn.com", 1);
+    TEST_reg_func("^www.google.com$", "www.google.com.hk", 0);
+    TEST_regexp_lib();
+
+    re = compile("googlevideo.com$");
+    if (!PC_TEST(re != NULL))
+        return;
+    PC_TEST_BENCH("regexp_exec", 100000, pc_test_sink = regexp_exec(re, host));
+    PC_TEST_BENCH("regexp_match", 10000, pc_test_sink = regexp_match("googlevideo.com$", host));
+    regexp_release(re);
 }
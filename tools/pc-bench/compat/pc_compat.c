@@ -0,0 +1,317 @@
+/*
+ * Userspace definitions behind pc_compat.h: sk_buff access, the AES and
+ * SHA-256 primitives of lib/crypto used by the QUIC parser, and stubs for
+ * the procfs and file calls the module makes at load time.
+ */
+#include "pc_compat.h"
+
+int pc_compat_verbose;
+
+void ktime_get_real_ts64(struct timespec64 *ts)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts->tv_sec = now.tv_sec;
+    ts->tv_nsec = now.tv_nsec;
+}
+
+ktime_t ktime_get(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (s64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void *pc_compat_vzalloc(size_t size)
+{
+    void *p = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+    if (offset < 0 || len < 0 || offset + len > (int)skb->len)
+        return -EFAULT;
+    memcpy(to, skb->data + offset, len);
+    return 0;
+}
+
+void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer)
+{
+    if (offset < 0 || len < 0 || offset + len > (int)skb->len)
+        return NULL;
+    return skb->data + offset;
+}
+
+#define NEXTHDR_HOP 0
+#define NEXTHDR_ROUTING 43
+#define NEXTHDR_FRAGMENT 44
+#define NEXTHDR_AUTH 51
+#define NEXTHDR_NONE 59
+#define NEXTHDR_DEST 60
+
+static int ipv6_ext_hdr(u8 nexthdr)
+{
+    return nexthdr == NEXTHDR_HOP || nexthdr == NEXTHDR_ROUTING || nexthdr == NEXTHDR_FRAGMENT ||
+           nexthdr == NEXTHDR_AUTH || nexthdr == NEXTHDR_NONE || nexthdr == NEXTHDR_DEST;
+}
+
+// same contract as net/ipv6/exthdrs_core.c
+int ipv6_skip_exthdr(const struct sk_buff *skb, int start, u8 *nexthdrp, __be16 *frag_offp)
+{
+    u8 nexthdr = *nexthdrp;
+    u8 hdr[8], *hp;
+    int hdrlen;
+
+    *frag_offp = 0;
+    while (ipv6_ext_hdr(nexthdr)) {
+        if (nexthdr == NEXTHDR_NONE)
+            return -1;
+        hp = skb_header_pointer(skb, start, sizeof(hdr), hdr);
+        if (!hp)
+            return -1;
+        if (nexthdr == NEXTHDR_FRAGMENT) {
+            memcpy(frag_offp, hp + 2, sizeof(*frag_offp));
+            if (ntohs(*frag_offp) & ~0x7)
+                break;
+            hdrlen = 8;
+        } else if (nexthdr == NEXTHDR_AUTH) {
+            hdrlen = (hp[1] + 2) << 2;
+        } else {
+            hdrlen = (hp[1] + 1) << 3;
+        }
+        nexthdr = hp[0];
+        start += hdrlen;
+    }
+    *nexthdrp = nexthdr;
+    return start;
+}
+
+struct file *filp_open(const char *name, int flags, int mode)
+{
+    return ERR_PTR(-ENOENT);
+}
+
+int filp_close(struct file *fp, void *id)
+{
+    return 0;
+}
+
+ssize_t kernel_read(struct file *fp, void *buf, size_t count, loff_t *pos)
+{
+    return -EINVAL;
+}
+
+ssize_t seq_read(struct file *f, char *buf, size_t size, loff_t *pos)
+{
+    return 0;
+}
+
+loff_t seq_lseek(struct file *f, loff_t off, int whence)
+{
+    return 0;
+}
+
+int seq_release_private(struct inode *inode, struct file *f)
+{
+    return 0;
+}
+
+int single_release(struct inode *inode, struct file *f)
+{
+    return 0;
+}
+
+int single_open(struct file *f, int (*show)(struct seq_file *, void *), void *data)
+{
+    return 0;
+}
+
+struct proc_dir_entry *proc_mkdir(const char *name, struct proc_dir_entry *parent)
+{
+    return NULL;
+}
+
+struct proc_dir_entry *proc_create(const char *name, int mode, struct proc_dir_entry *parent,
+                                   const struct proc_ops *ops)
+{
+    return NULL;
+}
+
+void remove_proc_subtree(const char *name, struct proc_dir_entry *parent)
+{
+}
+
+/* AES encryption, byte oriented, the S-box is built on first use */
+static u8 aes_sbox[256];
+
+static u8 aes_xtime(u8 x)
+{
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+static void aes_init_sbox(void)
+{
+    u8 p = 1, q = 1, x;
+    if (aes_sbox[0])
+        return;
+    do {
+        // p walks the multiplicative group by 3, q by its inverse 0xf6
+        p = p ^ aes_xtime(p);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80)
+            q ^= 0x09;
+        x = q ^ ((q << 1) | (q >> 7)) ^ ((q << 2) | (q >> 6)) ^
+            ((q << 3) | (q >> 5)) ^ ((q << 4) | (q >> 4));
+        aes_sbox[p] = x ^ 0x63;
+    } while (p != 1);
+    aes_sbox[0] = 0x63;
+}
+
+int aes_expandkey(struct crypto_aes_ctx *ctx, const u8 *in_key, unsigned int key_len)
+{
+    u8 *w = (u8 *)ctx->key_enc;
+    int nk = key_len / 4, total, i;
+    u8 rcon = 1, t[4], tmp;
+
+    if (key_len != 16 && key_len != 24 && key_len != 32)
+        return -EINVAL;
+    aes_init_sbox();
+    ctx->key_length = key_len;
+    total = 4 * (nk + 7);
+    memcpy(w, in_key, key_len);
+    for (i = nk; i < total; i++) {
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % nk == 0) {
+            tmp = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon;
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[tmp];
+            rcon = aes_xtime(rcon);
+        } else if (nk > 6 && i % nk == 4) {
+            t[0] = aes_sbox[t[0]];
+            t[1] = aes_sbox[t[1]];
+            t[2] = aes_sbox[t[2]];
+            t[3] = aes_sbox[t[3]];
+        }
+        w[4 * i] = w[4 * (i - nk)] ^ t[0];
+        w[4 * i + 1] = w[4 * (i - nk) + 1] ^ t[1];
+        w[4 * i + 2] = w[4 * (i - nk) + 2] ^ t[2];
+        w[4 * i + 3] = w[4 * (i - nk) + 3] ^ t[3];
+    }
+    return 0;
+}
+
+void aes_encrypt(const struct crypto_aes_ctx *ctx, u8 *out, const u8 *in)
+{
+    const u8 *w = (const u8 *)ctx->key_enc;
+    int rounds = ctx->key_length / 4 + 6;
+    u8 s[16], t[16];
+    int r, i, c;
+
+    for (i = 0; i < 16; i++)
+        s[i] = in[i] ^ w[i];
+    for (r = 1; r <= rounds; r++) {
+        // SubBytes and ShiftRows, the state is column major
+        for (i = 0; i < 16; i++)
+            t[i] = aes_sbox[s[(i + 4 * (i % 4)) % 16]];
+        if (r < rounds) {
+            for (c = 0; c < 4; c++) {
+                u8 *col = t + 4 * c;
+                u8 a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                u8 all = a0 ^ a1 ^ a2 ^ a3;
+                col[0] ^= all ^ aes_xtime(a0 ^ a1);
+                col[1] ^= all ^ aes_xtime(a1 ^ a2);
+                col[2] ^= all ^ aes_xtime(a2 ^ a3);
+                col[3] ^= all ^ aes_xtime(a3 ^ a0);
+            }
+        }
+        for (i = 0; i < 16; i++)
+            s[i] = t[i] ^ w[16 * r + i];
+    }
+    memcpy(out, s, 16);
+}
+
+/* SHA-256, FIPS 180-4 */
+static const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(u32 *h, const u8 *p)
+{
+    u32 w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((u32)p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+    for (i = 16; i < 64; i++)
+        w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += k;
+}
+
+void sha256_init(struct sha256_state *sctx)
+{
+    static const u32 iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sctx->state, iv, sizeof(iv));
+    sctx->count = 0;
+}
+
+void sha256_update(struct sha256_state *sctx, const u8 *data, unsigned int len)
+{
+    unsigned int fill = sctx->count % SHA256_BLOCK_SIZE, n;
+
+    sctx->count += len;
+    while (len) {
+        n = min(len, SHA256_BLOCK_SIZE - fill);
+        memcpy(sctx->buf + fill, data, n);
+        fill += n;
+        data += n;
+        len -= n;
+        if (fill == SHA256_BLOCK_SIZE) {
+            sha256_block(sctx->state, sctx->buf);
+            fill = 0;
+        }
+    }
+}
+
+void sha256_final(struct sha256_state *sctx, u8 *out)
+{
+    u64 bits = sctx->count << 3;
+    u8 pad[SHA256_BLOCK_SIZE + 8] = { 0x80 };
+    unsigned int fill = sctx->count % SHA256_BLOCK_SIZE;
+    unsigned int n = (fill < 56 ? 56 : 120) - fill;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        pad[n + i] = bits >> (56 - 8 * i);
+    sha256_update(sctx, pad, n + 8);
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = sctx->state[i] >> 24;
+        out[4 * i + 1] = sctx->state[i] >> 16;
+        out[4 * i + 2] = sctx->state[i] >> 8;
+        out[4 * i + 3] = sctx->state[i];
+    }
+}
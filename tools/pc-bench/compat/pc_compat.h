@@ -0,0 +1,490 @@
+/*
+ * Just enough of the kernel API for the parsing and matching code in src/
+ * to build as a userspace program. Every <linux/...>, <net/...> and
+ * <crypto/...> header the module includes is generated by the Makefile as
+ * a one line wrapper around this file. The bench is single threaded, so
+ * locks, RCU and per-CPU data collapse to plain memory.
+ */
+#ifndef PC_COMPAT_H
+#define PC_COMPAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#ifndef LINUX_VERSION_CODE
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 1, 0)
+#endif
+#define IS_ENABLED(option) 1
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint16_t __be16;
+typedef uint32_t __be32;
+typedef uint16_t __sum16;
+typedef unsigned int gfp_t;
+typedef int bool;
+#define true 1
+#define false 0
+
+#define __init
+#define __exit
+#define __user
+#define __rcu
+#define __read_mostly
+#define ____cacheline_aligned __attribute__((aligned(64)))
+#define ____cacheline_aligned_in_smp ____cacheline_aligned
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define BITS_PER_LONG (8 * (int)sizeof(long))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) min((t)(a), (t)(b))
+#define max_t(t, a, b) max((t)(a), (t)(b))
+#define swap(a, b) do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define BUILD_BUG_ON(c) ((void)sizeof(char[1 - 2 * !!(c)]))
+#define EXPORT_SYMBOL(s)
+#define EXPORT_SYMBOL_GPL(s)
+
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_VERSION(x)
+#define module_init(fn) int (*pc_compat_module_init)(void) = fn
+#define module_exit(fn) void (*pc_compat_module_exit)(void) = fn
+#define THIS_MODULE NULL
+#define module_param(name, type, perm)
+#define module_param_named(name, var, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+/* logging, KERN_* levels are string prefixes like in the kernel */
+extern int pc_compat_verbose;
+#define KERN_ERR ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define printk(fmt, ...) (pc_compat_verbose ? fprintf(stderr, fmt, ##__VA_ARGS__) : 0)
+#define pr_info_ratelimited(fmt, ...) printk(fmt, ##__VA_ARGS__)
+
+/* memory */
+#define PAGE_SIZE 4096
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+/* keep the alignment of ____cacheline_aligned types, kmalloc and vmalloc give it in the kernel */
+extern void *pc_compat_vzalloc(size_t size);
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) pc_compat_vzalloc(size)
+#define kcalloc(n, size, flags) calloc(n, size)
+#define kmalloc_array(n, size, flags) calloc(n, size)
+#define krealloc(p, size, flags) realloc(p, size)
+#define kfree(p) free((void *)(p))
+#define vmalloc(size) pc_compat_vzalloc(size)
+#define vzalloc(size) pc_compat_vzalloc(size)
+#define vfree(p) free(p)
+#define kvfree(p) free(p)
+#define kstrdup(s, flags) strdup(s)
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline int IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)ptr); }
+
+/* random */
+#define get_random_u32() ((u32)random())
+
+/* bitops */
+#define __ffs(x) ((unsigned long)__builtin_ctzl(x))
+#define hweight32(x) ((unsigned int)__builtin_popcount(x))
+
+/* strings */
+#define simple_strtoul strtoul
+#define simple_strtoull strtoull
+#define simple_strtol strtol
+char *skip_spaces(const char *str);
+
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline int fls(unsigned int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+
+/* locking, single threaded */
+struct mutex { int locked; };
+#define DEFINE_MUTEX(m) struct mutex m = { 0 }
+#define mutex_init(m) ((m)->locked = 0)
+#define mutex_lock(m) ((m)->locked = 1)
+#define mutex_unlock(m) ((m)->locked = 0)
+#define lockdep_is_held(m) 1
+typedef struct { int locked; } spinlock_t;
+typedef struct { int locked; } rwlock_t;
+#define DEFINE_SPINLOCK(l) spinlock_t l = { 0 }
+#define DEFINE_RWLOCK(l) rwlock_t l = { 0 }
+#define spin_lock_init(l) ((l)->locked = 0)
+#define spin_lock_bh(l) ((void)(l))
+#define spin_unlock_bh(l) ((void)(l))
+#define rwlock_init(l) ((l)->locked = 0)
+#define read_lock_bh(l) ((void)(l))
+#define read_unlock_bh(l) ((void)(l))
+#define write_lock_bh(l) ((void)(l))
+#define write_unlock_bh(l) ((void)(l))
+
+/* RCU */
+#define rcu_read_lock() do {} while (0)
+#define rcu_read_unlock() do {} while (0)
+#define synchronize_rcu() do {} while (0)
+#define rcu_dereference(p) (p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+struct rcu_head { void *next; };
+#define kfree_rcu(p, field) kfree(p)
+
+/* per-CPU data, one CPU */
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name
+#define DEFINE_PER_CPU_ALIGNED(type, name) __typeof__(type) name ____cacheline_aligned
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) name
+#define DECLARE_PER_CPU_ALIGNED(type, name) extern __typeof__(type) name
+#define this_cpu_ptr(p) (p)
+#define per_cpu_ptr(p, cpu) (p)
+#define this_cpu_inc(v) ((v)++)
+#define this_cpu_add(v, n) ((v) += (n))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/* lists */
+struct list_head {
+    struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+static inline void __list_add(struct list_head *n, struct list_head *prev, struct list_head *next)
+{
+    next->prev = n;
+    n->next = next;
+    n->prev = prev;
+    prev->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *head)
+{
+    __list_add(n, head, head->next);
+}
+static inline void list_add_tail(struct list_head *n, struct list_head *head)
+{
+    __list_add(n, head->prev, head);
+}
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = entry->prev = NULL;
+}
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+static inline void list_splice_init(struct list_head *list, struct list_head *head)
+{
+    if (!list_empty(list)) {
+        struct list_head *first = list->next, *last = list->prev, *at = head->next;
+        first->prev = head;
+        head->next = first;
+        last->next = at;
+        at->prev = last;
+        INIT_LIST_HEAD(list);
+    }
+}
+static inline void list_replace(struct list_head *old, struct list_head *n)
+{
+    n->next = old->next;
+    n->next->prev = n;
+    n->prev = old->prev;
+    n->prev->next = n;
+}
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+    list_del(list);
+    list_add(list, head);
+}
+#define list_replace_rcu list_replace
+#define list_add_rcu list_add
+#define list_add_tail_rcu list_add_tail
+#define list_del_rcu list_del
+#define list_splice_init_rcu(list, head, sync) list_splice_init(list, head)
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); \
+         &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), n = list_next_entry(pos, member); \
+         &pos->member != (head); pos = n, n = list_next_entry(n, member))
+#define list_prev_entry(pos, member) list_entry((pos)->member.prev, __typeof__(*(pos)), member)
+#define list_for_each_entry_reverse(pos, head, member) \
+    for (pos = list_entry((head)->prev, __typeof__(*pos), member); \
+         &pos->member != (head); pos = list_prev_entry(pos, member))
+#define list_for_each_entry_rcu(pos, head, member) list_for_each_entry(pos, head, member)
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+struct hlist_head {
+    struct hlist_node *first;
+};
+#define HLIST_HEAD_INIT { .first = NULL }
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+    n->next = h->first;
+    if (h->first)
+        h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+static inline void hlist_del(struct hlist_node *n)
+{
+    *n->pprev = n->next;
+    if (n->next)
+        n->next->pprev = n->pprev;
+}
+#define hlist_add_head_rcu hlist_add_head
+#define hlist_del_rcu hlist_del
+#define hlist_entry_safe(ptr, type, member) ((ptr) ? container_of(ptr, type, member) : NULL)
+#define hlist_for_each_entry(pos, head, member) \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos; \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+#define hlist_for_each_entry_rcu hlist_for_each_entry
+
+static inline void sort(void *base, size_t num, size_t size,
+                        int (*cmp)(const void *, const void *), void *swap)
+{
+    qsort(base, num, size, cmp);
+}
+
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+    const u8 *k = key;
+    u32 h = initval ^ 2166136261u;
+    while (length--)
+        h = (h ^ *k++) * 16777619u;
+    return h;
+}
+
+/* time */
+struct timespec64 {
+    s64 tv_sec;
+    long tv_nsec;
+};
+void ktime_get_real_ts64(struct timespec64 *ts);
+typedef s64 ktime_t;
+ktime_t ktime_get(void);
+static inline s64 ktime_to_ns(ktime_t kt) { return kt; }
+
+/* ethernet */
+#define ETH_ALEN 6
+#define ETH_HLEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86DD
+struct ethhdr {
+    unsigned char h_dest[ETH_ALEN];
+    unsigned char h_source[ETH_ALEN];
+    __be16 h_proto;
+} __attribute__((packed));
+static inline int is_zero_ether_addr(const u8 *a)
+{
+    return !(a[0] | a[1] | a[2] | a[3] | a[4] | a[5]);
+}
+static inline int ether_addr_equal(const u8 *a, const u8 *b)
+{
+    return !memcmp(a, b, ETH_ALEN);
+}
+static inline int is_broadcast_ether_addr(const u8 *a)
+{
+    return (a[0] & a[1] & a[2] & a[3] & a[4] & a[5]) == 0xff;
+}
+
+/* IP, TCP and UDP headers, as laid out on the wire */
+struct iphdr {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u8 ihl:4, version:4;
+#else
+    u8 version:4, ihl:4;
+#endif
+    u8 tos;
+    __be16 tot_len;
+    __be16 id;
+    __be16 frag_off;
+    u8 ttl;
+    u8 protocol;
+    __sum16 check;
+    __be32 saddr;
+    __be32 daddr;
+};
+#define IP_OFFSET 0x1FFF
+
+struct ipv6hdr {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u8 priority:4, version:4;
+#else
+    u8 version:4, priority:4;
+#endif
+    u8 flow_lbl[3];
+    __be16 payload_len;
+    u8 nexthdr;
+    u8 hop_limit;
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+};
+
+struct tcphdr {
+    __be16 source;
+    __be16 dest;
+    __be32 seq;
+    __be32 ack_seq;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    u16 res1:4, doff:4, fin:1, syn:1, rst:1, psh:1, ack:1, urg:1, ece:1, cwr:1;
+#else
+    u16 doff:4, res1:4, cwr:1, ece:1, urg:1, ack:1, psh:1, rst:1, syn:1, fin:1;
+#endif
+    __be16 window;
+    __sum16 check;
+    __be16 urg_ptr;
+};
+
+struct udphdr {
+    __be16 source;
+    __be16 dest;
+    __be16 len;
+    __sum16 check;
+};
+
+/* netfilter */
+#define NFPROTO_IPV4 2
+#define NFPROTO_IPV6 10
+enum ip_conntrack_dir {
+    IP_CT_DIR_ORIGINAL,
+    IP_CT_DIR_REPLY,
+    IP_CT_DIR_MAX
+};
+struct nf_conntrack {
+    int use;
+};
+struct nf_conn {
+    struct nf_conntrack ct_general;
+    u32 mark;
+};
+
+/*
+ * A linear sk_buff, data points at the network header. Frames are copied
+ * whole from the capture, so skb_copy_bits is only a bounds checked copy.
+ */
+struct sk_buff {
+    unsigned char *data;
+    unsigned int len;
+    __be16 protocol;
+};
+static inline unsigned int skb_headlen(const struct sk_buff *skb)
+{
+    return skb->len;
+}
+static inline int skb_network_offset(const struct sk_buff *skb)
+{
+    return 0;
+}
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+    return (struct iphdr *)skb->data;
+}
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb)
+{
+    return (struct ipv6hdr *)skb->data;
+}
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len);
+void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer);
+int ipv6_skip_exthdr(const struct sk_buff *skb, int start, u8 *nexthdrp, __be16 *frag_offp);
+
+/* files, the feature list is read by the bench itself */
+struct inode {
+    loff_t i_size;
+};
+struct file {
+    struct inode *f_inode;
+    loff_t f_pos;
+};
+struct file *filp_open(const char *name, int flags, int mode);
+int filp_close(struct file *fp, void *id);
+ssize_t kernel_read(struct file *fp, void *buf, size_t count, loff_t *pos);
+
+/* procfs and seq_file, compiled but never registered */
+struct seq_file {
+    FILE *fp;
+};
+#define seq_printf(s, fmt, ...) fprintf((s)->fp, fmt, ##__VA_ARGS__)
+#define seq_puts(s, str) fputs(str, (s)->fp)
+struct proc_dir_entry;
+#define PROC_ENTRY_PERMANENT 0
+struct proc_ops {
+    int proc_flags;
+    int (*proc_open)(struct inode *, struct file *);
+    ssize_t (*proc_read)(struct file *, char *, size_t, loff_t *);
+    ssize_t (*proc_write)(struct file *, const char *, size_t, loff_t *);
+    loff_t (*proc_lseek)(struct file *, loff_t, int);
+    int (*proc_release)(struct inode *, struct file *);
+};
+ssize_t seq_read(struct file *, char *, size_t, loff_t *);
+loff_t seq_lseek(struct file *, loff_t, int);
+int seq_release_private(struct inode *, struct file *);
+int single_release(struct inode *, struct file *);
+int single_open(struct file *, int (*show)(struct seq_file *, void *), void *);
+struct proc_dir_entry *proc_mkdir(const char *name, struct proc_dir_entry *parent);
+struct proc_dir_entry *proc_create(const char *name, int mode, struct proc_dir_entry *parent,
+                                   const struct proc_ops *ops);
+void remove_proc_subtree(const char *name, struct proc_dir_entry *parent);
+
+/* lib/crypto */
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_KEYLENGTH_U32 60
+struct crypto_aes_ctx {
+    u32 key_enc[AES_MAX_KEYLENGTH_U32];
+    u32 key_length;
+};
+int aes_expandkey(struct crypto_aes_ctx *ctx, const u8 *in_key, unsigned int key_len);
+void aes_encrypt(const struct crypto_aes_ctx *ctx, u8 *out, const u8 *in);
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+struct sha256_state {
+    u32 state[8];
+    u64 count;
+    u8 buf[SHA256_BLOCK_SIZE];
+};
+void sha256_init(struct sha256_state *sctx);
+void sha256_update(struct sha256_state *sctx, const u8 *data, unsigned int len);
+void sha256_final(struct sha256_state *sctx, u8 *out);
+
+#endif
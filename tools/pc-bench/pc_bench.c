@@ -0,0 +1,525 @@
+/*
+ * pc-bench: replay a pcap through the module's parser and matcher
+ * (parse_flow_proto, dpi_main, app_filter_match) built in userspace, and
+ * report the cost per packet and what each app matched.
+ *
+ * Every packet is inspected, as if the conntrack verdict cache and the
+ * DPI budget never kicked in, so the numbers are the worst case of the
+ * hook for that traffic.
+ */
+#include "pc_compat.h"
+#include "pc_policy.h"
+#include "cJSON.h"
+#include <getopt.h>
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+struct pcap_file_hdr {
+    u32 magic;
+    u16 version_major;
+    u16 version_minor;
+    s32 thiszone;
+    u32 sigfigs;
+    u32 snaplen;
+    u32 linktype;
+};
+
+struct pcap_rec_hdr {
+    u32 ts_sec;
+    u32 ts_usec;
+    u32 caplen;
+    u32 len;
+};
+
+struct bench_pkt {
+    u8 smac[ETH_ALEN];
+    unsigned char *data;
+    unsigned int len;
+};
+
+struct bench_app {
+    u_int32_t id;
+    const char *name;
+    u64 accept;
+    u64 drop;
+};
+
+static struct bench_pkt *pkts;
+static int pkt_num;
+static struct bench_app *apps;
+static int app_num;
+
+static char *read_file(const char *path, long *size)
+{
+    FILE *fp = fopen(path, "rb");
+    char *buf;
+    long n;
+
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(n + 1);
+    if (!buf || fread(buf, 1, n, fp) != (size_t)n) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    fclose(fp);
+    buf[n] = '\0';
+    if (size)
+        *size = n;
+    return buf;
+}
+
+static u32 swap32(u32 v, int swap)
+{
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+// strip the link layer, keep the source MAC when there is one
+static int bench_add_packet(unsigned char *p, unsigned int len, u32 linktype)
+{
+    struct bench_pkt *pkt = &pkts[pkt_num];
+    u16 proto = 0;
+    unsigned int off = 0;
+
+    memset(pkt->smac, 0, ETH_ALEN);
+    switch (linktype) {
+        case LINKTYPE_ETHERNET:
+            if (len < ETH_HLEN)
+                return -1;
+            memcpy(pkt->smac, p + ETH_ALEN, ETH_ALEN);
+            proto = (p[12] << 8) | p[13];
+            off = ETH_HLEN;
+            while ((proto == 0x8100 || proto == 0x88a8) && len >= off + 4) {
+                proto = (p[off + 2] << 8) | p[off + 3];
+                off += 4;
+            }
+            if (proto != ETH_P_IP && proto != ETH_P_IPV6)
+                return -1;
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if (len < 16)
+                return -1;
+            if (((p[2] << 8) | p[3]) == ETH_ALEN)
+                memcpy(pkt->smac, p + 6, ETH_ALEN);
+            off = 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if (len < 20)
+                return -1;
+            if (p[11] == ETH_ALEN)
+                memcpy(pkt->smac, p + 12, ETH_ALEN);
+            off = 20;
+            break;
+        case LINKTYPE_NULL:
+            off = 4;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            break;
+        default:
+            return -1;
+    }
+    if (len <= off)
+        return -1;
+    // own buffer so the network header is aligned, as in the kernel
+    pkt->len = len - off;
+    pkt->data = malloc(pkt->len);
+    if (!pkt->data)
+        return -1;
+    memcpy(pkt->data, p + off, pkt->len);
+    pkt_num++;
+    return 0;
+}
+
+static int bench_load_pcap(const char *path)
+{
+    struct pcap_file_hdr fh;
+    struct pcap_rec_hdr rh;
+    long size, off;
+    char *buf;
+    u32 caplen, linktype;
+    int swap, max;
+
+    buf = read_file(path, &size);
+    if (!buf)
+        return -1;
+    if (size < (long)sizeof(fh)) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        return -1;
+    }
+    memcpy(&fh, buf, sizeof(fh));
+    if (fh.magic == PCAP_MAGIC || fh.magic == PCAP_MAGIC_NS) {
+        swap = 0;
+    } else if (fh.magic == __builtin_bswap32(PCAP_MAGIC) ||
+               fh.magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        swap = 1;
+    } else {
+        fprintf(stderr, "%s: not a pcap file (pcapng is not supported, "
+                "convert it with editcap -F pcap)\n", path);
+        return -1;
+    }
+    linktype = swap32(fh.linktype, swap) & 0xffff;
+    max = 1024;
+    pkts = malloc(max * sizeof(*pkts));
+    for (off = sizeof(fh); off + (long)sizeof(rh) <= size; off += sizeof(rh) + caplen) {
+        memcpy(&rh, buf + off, sizeof(rh));
+        caplen = swap32(rh.caplen, swap);
+        if (off + (long)sizeof(rh) + caplen > size)
+            break;
+        if (pkt_num == max) {
+            max *= 2;
+            pkts = realloc(pkts, max * sizeof(*pkts));
+        }
+        bench_add_packet((unsigned char *)buf + off + sizeof(rh), caplen, linktype);
+    }
+    free(buf);
+    if (!pkt_num) {
+        fprintf(stderr, "%s: no IP packets (link type %u)\n", path, linktype);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_load_features(const char *path)
+{
+    char *buf = read_file(path, NULL);
+    if (!buf)
+        return -1;
+    if (pc_load_app_feature_buf(buf)) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    if (pc_app_table->num == 0) {
+        fprintf(stderr, "%s: no app features\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The rule file holds the "rules" and optional "groups" arrays the init
+ * script sends to the module, see load_rule and load_group in
+ * files/parental_control.sh. Without groups the first rule applies to
+ * every packet.
+ */
+static int bench_load_rules(const char *path, char *default_rule, int size)
+{
+    cJSON *root, *arr, *obj, *id, *rule;
+    char *buf = read_file(path, NULL);
+    int i;
+
+    if (!buf)
+        return -1;
+    root = cJSON_Parse(buf);
+    free(buf);
+    if (!root) {
+        fprintf(stderr, "%s: invalid json\n", path);
+        return -1;
+    }
+    arr = cJSON_GetObjectItem(root, "rules");
+    for (i = 0; arr && i < cJSON_GetArraySize(arr); i++) {
+        obj = cJSON_GetArrayItem(arr, i);
+        id = cJSON_GetObjectItem(obj, "id");
+        rule = cJSON_GetObjectItem(obj, "action");
+        if (!id || !rule)
+            continue;
+        add_pc_rule(id->valuestring, cJSON_GetObjectItem(obj, "apps"), rule->valueint,
+                    cJSON_GetObjectItem(obj, "blacklist"));
+        if (!default_rule[0])
+            snprintf(default_rule, size, "%s", id->valuestring);
+    }
+    arr = cJSON_GetObjectItem(root, "groups");
+    for (i = 0; arr && i < cJSON_GetArraySize(arr); i++) {
+        obj = cJSON_GetArrayItem(arr, i);
+        id = cJSON_GetObjectItem(obj, "id");
+        rule = cJSON_GetObjectItem(obj, "rule");
+        if (!id || !rule)
+            continue;
+        add_pc_group(id->valuestring, cJSON_GetObjectItem(obj, "macs"), rule->valuestring);
+        default_rule[0] = '\0';
+    }
+    cJSON_Delete(root);
+    return 0;
+}
+
+// a POLICY_DROP rule with every loaded app, each packet is tried against all features
+static void bench_all_apps_rule(char *default_rule, int size)
+{
+    cJSON *list = cJSON_CreateArray();
+    pc_app_t *app;
+    u_int32_t last = 0;
+
+    pc_for_each_app(app, pc_app_table) {
+        if (app->app_id != last)
+            cJSON_AddItemToArray(list, cJSON_CreateNumber(app->app_id));
+        last = app->app_id;
+    }
+    add_pc_rule("all", list, PC_POLICY_DROP, NULL);
+    cJSON_Delete(list);
+    snprintf(default_rule, size, "all");
+}
+
+static pc_rule_t *bench_find_rule(const char *id)
+{
+    pc_rule_t *rule;
+    list_for_each_entry(rule, &pc_rule_head, head) {
+        if (!strcmp(rule->id, id))
+            return rule;
+    }
+    return NULL;
+}
+
+static void bench_count_app(flow_info_t *flow)
+{
+    pc_app_t *app;
+    int i;
+
+    for (i = 0; i < app_num; i++) {
+        if (apps[i].id == flow->app_id)
+            break;
+    }
+    if (i == app_num) {
+        apps = realloc(apps, (app_num + 1) * sizeof(*apps));
+        memset(&apps[i], 0, sizeof(*apps));
+        apps[i].id = flow->app_id;
+        apps[i].name = "blacklist";
+        pc_for_each_app(app, pc_app_table) {
+            if (app->app_id == flow->app_id) {
+                apps[i].name = app->app_name;
+                break;
+            }
+        }
+        app_num++;
+    }
+    if (flow->drop)
+        apps[i].drop++;
+    else
+        apps[i].accept++;
+}
+
+// the part of pc_filter_hook_handle() after the verdict cache
+static void bench_packet(struct bench_pkt *pkt, pc_policy_snap_t *snap, pc_rule_t *default_rule,
+                         int count)
+{
+    struct sk_buff skb;
+    flow_info_t flow;
+    enum pc_action action = PC_POLICY_DROP;
+    pc_rule_t *rule = default_rule;
+
+    memset(&flow, 0, sizeof(flow));
+    memcpy(flow.smac, pkt->smac, ETH_ALEN);
+    if (!rule) {
+        rule = get_rule_by_mac(snap, flow.smac, &action);
+        if (action != PC_POLICY_DROP && action != PC_POLICY_ACCEPT)
+            return;
+    }
+    if (!rule)
+        return;
+    skb.data = pkt->data;
+    skb.len = pkt->len;
+    if (parse_flow_proto(&skb, &flow) < 0 || flow.l4_len <= 0)
+        return;
+    flow.dir = IP_CT_DIR_ORIGINAL;
+    dpi_main(&skb, &flow);
+    app_filter_match(&flow, rule);
+    if (count && flow.app_id)
+        bench_count_app(&flow);
+}
+
+static u64 bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_app(const void *a, const void *b)
+{
+    const struct bench_app *x = a, *y = b;
+    u64 nx = x->accept + x->drop, ny = y->accept + y->drop;
+    if (nx != ny)
+        return nx < ny ? 1 : -1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -a app_feature.cfg [-r rules.json] [-n loops] [-v] file.pcap\n"
+            "       %s -t [-t]\n"
+            "  -a  app feature library, e.g. files/app_feature.cfg\n"
+            "  -r  rules and groups in the format the init script sends to the module,\n"
+            "      by default one rule holding every app is used for all packets\n"
+            "  -n  replay the capture this many times, default 10\n"
+            "  -v  print the module's debug messages\n"
+            "  -t  run the module's self tests, twice to also time the parsers and matchers\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *feature_file = NULL, *rule_file = NULL;
+    char default_id[RULE_ID_SIZE] = {0};
+    pc_rule_t *default_rule = NULL;
+    pc_policy_snap_t *snap;
+    int loops = 10, selftest = 0, opt, i, l;
+    u64 start, ns, total;
+
+    while ((opt = getopt(argc, argv, "a:r:n:vth")) != -1) {
+        switch (opt) {
+            case 'a':
+                feature_file = optarg;
+                break;
+            case 'r':
+                rule_file = optarg;
+                break;
+            case 'n':
+                loops = atoi(optarg);
+                break;
+            case 'v':
+                pc_compat_verbose = 1;
+                break;
+            case 't':
+                selftest++;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (selftest) {
+        pc_compat_verbose = 1;
+        return pc_selftest(selftest > 1) ? 1 : 0;
+    }
+    if (!feature_file || optind != argc - 1 || loops <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (bench_load_features(feature_file) || bench_load_pcap(argv[optind]))
+        return 1;
+    if (rule_file) {
+        if (bench_load_rules(rule_file, default_id, sizeof(default_id)))
+            return 1;
+    } else {
+        bench_all_apps_rule(default_id, sizeof(default_id));
+    }
+    pc_policy_changed();
+    snap = pc_policy_get();
+    if (default_id[0])
+        default_rule = bench_find_rule(default_id);
+    if (!default_rule && (!snap || !snap->num)) {
+        fprintf(stderr, "no rule or group to replay against\n");
+        return 1;
+    }
+
+    // one counted pass, then the timed ones
+    for (i = 0; i < pkt_num; i++)
+        bench_packet(&pkts[i], snap, default_rule, 1);
+    memset(&pc_stats, 0, sizeof(pc_stats));
+    start = bench_now_ns();
+    for (l = 0; l < loops; l++) {
+        for (i = 0; i < pkt_num; i++)
+            bench_packet(&pkts[i], snap, default_rule, 0);
+    }
+    ns = bench_now_ns() - start;
+    total = (u64)pkt_num * loops;
+
+    printf("packets      %d x %d loops\n", pkt_num, loops);
+    printf("time         %.3f ms\n", ns / 1e6);
+    printf("packets/sec  %.0f\n", total * 1e9 / (ns ? ns : 1));
+    printf("ns/packet    %.1f\n", (double)ns / total);
+    printf("\nper packet:\n");
+    printf("  dpi        %.3f\n", (double)pc_stats.cnt[PC_STAT_DPI] / total);
+    printf("  http       %.3f\n", (double)pc_stats.cnt[PC_STAT_HTTP] / total);
+    printf("  tls        %.3f\n", (double)pc_stats.cnt[PC_STAT_TLS] / total);
+    printf("  quic       %.3f\n", (double)pc_stats.cnt[PC_STAT_QUIC] / total);
+    printf("  match_app  %.3f\n", (double)pc_stats.cnt[PC_STAT_MATCH_APP] / total);
+    printf("  regexp     %.3f\n", (double)pc_stats.cnt[PC_STAT_REGEXP] / total);
+
+    qsort(apps, app_num, sizeof(*apps), bench_cmp_app);
+    printf("\n%-12s%10s%10s  %s\n", "ID", "Accept", "Drop", "App");
+    for (i = 0; i < app_num; i++)
+        printf("%-12u%10llu%10llu  %s\n", apps[i].id,
+               (unsigned long long)apps[i].accept, (unsigned long long)apps[i].drop, apps[i].name);
+    return 0;
+}
+
+/* the module symbols pc_policy.c refers to, the hook itself is not built */
+u8 pc_drop_anonymous;
+char pc_src_dev[MAX_SRC_DEVNAME_SIZE];
+
+int pc_filter_init(void)
+{
+    return 0;
+}
+
+void pc_filter_exit(void)
+{
+}
+
+void pc_filter_sync_hooks(int active)
+{
+}
+
+void pc_filter_flush_verdicts(u_int32_t gen, int keep)
+{
+}
+
+// QUIC Initials are parsed one at a time, there is no conntrack to key on
+int pc_quic_reasm_save(flow_info_t *flow, const void *data, int len)
+{
+    return PC_FALSE;
+}
+
+pc_reasm_t *pc_quic_reasm_take(flow_info_t *flow)
+{
+    return NULL;
+}
+
+void pc_tls_reasm_free(pc_reasm_t *r)
+{
+}
+
+int pc_register_dev(void)
+{
+    return 0;
+}
+
+void pc_unregister_dev(void)
+{
+}
+
+int flow_cache_proc_show(struct seq_file *s, void *v)
+{
+    return 0;
+}
+
+int stats_proc_show(struct seq_file *s, void *v)
+{
+    return 0;
+}
+
+int latency_proc_show(struct seq_file *s, void *v)
+{
+    return 0;
+}
+
+ssize_t latency_proc_write(struct file *file, const char __user *buffer, size_t count, loff_t *pos)
+{
+    return count;
+}
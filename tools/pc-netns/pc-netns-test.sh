@@ -0,0 +1,323 @@
+#!/bin/sh
+#
+# End-to-end test of parental_control on a development host, no router needed.
+#
+#   lan netns (client) --veth-- pc-lan [host, forwarding] pc-wan --veth-- wan netns (servers)
+#
+# The module hooks the host's FORWARD path, so the host itself is the router.
+# Forwarded TCP/UDP throughput and the CPU it costs are measured with the
+# module off, loaded but idle (no group) and with the client under a
+# POLICY_DROP rule, then the verdicts of TLS and HTTP requests are checked
+# under POLICY_DROP, DROP and ACCEPT rules, and under POLICY_DROP again
+# with no src_dev so that replies go through the hook. See readme.md.
+#
+# Needs root, ip, iperf3, curl, openssl and python3.
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+MODULE="$DIR/../../src/parental_control.ko"
+FEATURE="$DIR/../../files/app_feature_en.cfg"
+BLOCK_APP="3003"
+BLOCK_HOST="www.netflix.com"
+ALLOW_HOST="www.example.com"
+DURATION=10
+PARALLEL=1
+OUTPUT=""
+COMPARE=""
+THRESHOLD=10
+
+NS_LAN="pc-test-lan"
+NS_WAN="pc-test-wan"
+LAN_MAC="02:00:00:00:77:02"
+LAN_HOST="198.18.0.1"
+LAN_CLIENT="198.18.0.2"
+WAN_HOST="198.18.1.1"
+WAN_SERVER="198.18.1.2"
+WORK=""
+FORWARD_SAVED=""
+IPTABLES_RULES=0
+FAILED=0
+RESULTS=""
+
+SET_BASE="0"
+ADD_RULE="1"
+ADD_GROUP="2"
+CLEAN_GROUP="4"
+SET_GROUP="6"
+
+usage()
+{
+    cat <<EOF
+usage: $0 [options]
+  -m module     parental_control.ko to test (default $MODULE)
+  -a feature    app feature library (default $FEATURE)
+  -i appid      app blocked by the POLICY_DROP rule (default $BLOCK_APP)
+  -H host       host that matches the blocked app (default $BLOCK_HOST)
+  -A host       host that matches no blocked app (default $ALLOW_HOST)
+  -t seconds    duration of each throughput run (default $DURATION)
+  -P streams    parallel iperf3 streams (default $PARALLEL)
+  -o file       save the throughput results to file
+  -c file       fail if throughput dropped more than -T percent against a saved file
+  -T percent    regression threshold for -c (default $THRESHOLD)
+EOF
+    exit 1
+}
+
+log()
+{
+    echo "$@" >&2
+}
+
+die()
+{
+    log "error: $@"
+    exit 1
+}
+
+pass_fail()
+{
+    if [ "$1" = "$2" ]; then
+        echo "PASS  $3"
+    else
+        echo "FAIL  $3 (expected $2, got $1)"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+pc_config()
+{
+    echo "$1" > /dev/parental_control || die "write to /dev/parental_control failed"
+}
+
+module_loaded()
+{
+    grep -q "^parental_control " /proc/modules 2>/dev/null
+}
+
+module_load()
+{
+    ln -sf "$FEATURE" /tmp/pc_app_feature.cfg
+    insmod "$MODULE"
+    local ret=$?
+    rm -f /tmp/pc_app_feature.cfg
+    [ $ret -eq 0 ] || die "insmod $MODULE failed"
+    local i=0
+    while [ ! -e /dev/parental_control ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    set_src_dev pc-lan
+    pc_config "{\"op\":$ADD_RULE,\"data\":{\"rules\":[{\"id\":\"policy\",\"action\":2,\"apps\":[$BLOCK_APP]},{\"id\":\"drop\",\"action\":0},{\"id\":\"accept\",\"action\":1}]}}"
+}
+
+# inspect packets from this device only, all forwarded packets when empty
+set_src_dev()
+{
+    pc_config "{\"op\":$SET_BASE,\"data\":{\"drop_anonymous\":0,\"src_dev\":\"$1\",\"bridge\":0}}"
+}
+
+module_unload()
+{
+    module_loaded && rmmod parental_control
+}
+
+# put the lan client in a group with the given rule, or in no group at all
+set_group()
+{
+    if [ -z "$1" ]; then
+        pc_config "{\"op\":$CLEAN_GROUP,\"data\":{}}"
+    elif grep -q "^lan[[:space:]]" /proc/parental-control/group 2>/dev/null; then
+        pc_config "{\"op\":$SET_GROUP,\"data\":{\"groups\":[{\"id\":\"lan\",\"rule\":\"$1\",\"macs\":[\"$LAN_MAC\"]}]}}"
+    else
+        pc_config "{\"op\":$ADD_GROUP,\"data\":{\"groups\":[{\"id\":\"lan\",\"rule\":\"$1\",\"macs\":[\"$LAN_MAC\"]}]}}"
+    fi
+}
+
+cleanup()
+{
+    ip netns pids $NS_WAN 2>/dev/null | xargs -r kill 2>/dev/null
+    ip netns del $NS_LAN 2>/dev/null
+    ip netns del $NS_WAN 2>/dev/null
+    if [ $IPTABLES_RULES -eq 1 ]; then
+        iptables -D FORWARD -i pc-lan -o pc-wan -j ACCEPT
+        iptables -D FORWARD -i pc-wan -o pc-lan -m conntrack --ctstate ESTABLISHED,RELATED -j ACCEPT
+    fi
+    [ -n "$FORWARD_SAVED" ] && sysctl -qw net.ipv4.ip_forward=$FORWARD_SAVED
+    module_unload
+    [ -n "$WORK" ] && rm -rf "$WORK"
+}
+
+setup()
+{
+    ip netns add $NS_LAN || die "ip netns add failed"
+    ip netns add $NS_WAN || die "ip netns add failed"
+    ip link add pc-lan type veth peer name eth0 netns $NS_LAN || die "ip link add veth failed"
+    ip link add pc-wan type veth peer name eth0 netns $NS_WAN || die "ip link add veth failed"
+
+    ip addr add $LAN_HOST/24 dev pc-lan
+    ip addr add $WAN_HOST/24 dev pc-wan
+    ip link set pc-lan up
+    ip link set pc-wan up
+
+    ip -n $NS_LAN link set lo up
+    ip -n $NS_LAN link set eth0 address $LAN_MAC
+    ip -n $NS_LAN addr add $LAN_CLIENT/24 dev eth0
+    ip -n $NS_LAN link set eth0 up
+    ip -n $NS_LAN route add default via $LAN_HOST
+
+    ip -n $NS_WAN link set lo up
+    ip -n $NS_WAN addr add $WAN_SERVER/24 dev eth0
+    ip -n $NS_WAN link set eth0 up
+    ip -n $NS_WAN route add default via $WAN_HOST
+
+    FORWARD_SAVED="$(sysctl -n net.ipv4.ip_forward)"
+    sysctl -qw net.ipv4.ip_forward=1
+    # a conntrack match makes the host track forwarded flows, the verdict
+    # cache lives in their mark; it also gets past a FORWARD policy of DROP
+    if command -v iptables >/dev/null; then
+        iptables -I FORWARD -i pc-lan -o pc-wan -j ACCEPT
+        iptables -I FORWARD -i pc-wan -o pc-lan -m conntrack --ctstate ESTABLISHED,RELATED -j ACCEPT
+        IPTABLES_RULES=1
+    else
+        log "warning: no iptables, conntrack may be off and every packet inspected"
+    fi
+
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=pc-test" \
+        -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null || die "openssl req failed"
+    mkdir -p "$WORK/www"
+    echo "pc-test" > "$WORK/www/index.html"
+    ip netns exec $NS_WAN openssl s_server -quiet -accept 443 -www \
+        -cert "$WORK/cert.pem" -key "$WORK/key.pem" >/dev/null 2>&1 &
+    ip netns exec $NS_WAN python3 -m http.server 80 --bind $WAN_SERVER --directory "$WORK/www" >/dev/null 2>&1 &
+    ip netns exec $NS_WAN iperf3 -s -D -B $WAN_SERVER >/dev/null || die "iperf3 -s failed"
+    sleep 1
+}
+
+# busy and total jiffies of all CPUs
+cpu_jiffies()
+{
+    awk '/^cpu / { print $2+$3+$4+$7+$8+$9, $2+$3+$4+$5+$6+$7+$8+$9 }' /proc/stat
+}
+
+# run iperf3 from the lan client, print "Mbit/s cores" where cores is the
+# CPU time of the whole host spent per second of the run
+throughput()
+{
+    local before after mbps
+    before="$(cpu_jiffies)"
+    mbps="$(ip netns exec $NS_LAN iperf3 -c $WAN_SERVER -f m -t $DURATION -P $PARALLEL $1 2>/dev/null | \
+        awk '/receiver/ { for (i = 1; i < NF; i++) if ($(i + 1) == "Mbits/sec") v = $i; if (/SUM/) s = v }
+             END { print s ? s : (v ? v : 0) }')"
+    after="$(cpu_jiffies)"
+    echo "$before $after" | awk -v m="$mbps" -v n="$(nproc)" \
+        '{ t = $4 - $2; printf "%s %.2f\n", m, t ? ($3 - $1) * n / t : 0 }'
+}
+
+measure()
+{
+    local mode=$1 tcp udp
+    tcp="$(throughput)"
+    udp="$(throughput "-u -b 0 -l 1400")"
+    printf "%-8s %12s %8s %12s %8s\n" $mode $tcp $udp
+    RESULTS="$RESULTS$mode tcp ${tcp% *}
+$mode udp ${udp% *}
+"
+}
+
+# prints ok when the request got an answer from the server
+tls_request()
+{
+    ip netns exec $NS_LAN curl -sk -m 3 -o /dev/null --resolve "$1:443:$WAN_SERVER" "https://$1/" && echo ok || echo blocked
+}
+
+http_request()
+{
+    ip netns exec $NS_LAN curl -s -m 3 -o /dev/null -H "Host: $1" "http://$WAN_SERVER/" && echo ok || echo blocked
+}
+
+verdicts()
+{
+    set_group ""
+    pass_fail "$(tls_request $BLOCK_HOST)" ok "no group: https $BLOCK_HOST"
+
+    set_group policy
+    pass_fail "$(tls_request $BLOCK_HOST)" blocked "POLICY_DROP: https $BLOCK_HOST"
+    pass_fail "$(http_request $BLOCK_HOST)" blocked "POLICY_DROP: http $BLOCK_HOST"
+    pass_fail "$(tls_request $ALLOW_HOST)" ok "POLICY_DROP: https $ALLOW_HOST"
+    pass_fail "$(http_request $ALLOW_HOST)" ok "POLICY_DROP: http $ALLOW_HOST"
+
+    set_group drop
+    pass_fail "$(tls_request $ALLOW_HOST)" blocked "DROP: https $ALLOW_HOST"
+
+    set_group accept
+    pass_fail "$(tls_request $BLOCK_HOST)" ok "ACCEPT: https $BLOCK_HOST"
+    pass_fail "$(http_request $BLOCK_HOST)" ok "ACCEPT: http $BLOCK_HOST"
+
+    # with no src_dev the replies are inspected too, the server's SYN-ACK
+    # comes from a MAC in no group and must not leave an ACCEPT on the flow
+    set_src_dev ""
+    set_group policy
+    pass_fail "$(tls_request $BLOCK_HOST)" blocked "POLICY_DROP, any src_dev: https $BLOCK_HOST"
+    pass_fail "$(http_request $BLOCK_HOST)" blocked "POLICY_DROP, any src_dev: http $BLOCK_HOST"
+    pass_fail "$(tls_request $ALLOW_HOST)" ok "POLICY_DROP, any src_dev: https $ALLOW_HOST"
+    set_src_dev pc-lan
+}
+
+compare()
+{
+    echo "$RESULTS" | awk -v t=$THRESHOLD '
+        NR == FNR { base[$1 " " $2] = $3; next }
+        ($1 " " $2) in base && base[$1 " " $2] > 0 {
+            d = ($3 - base[$1 " " $2]) * 100 / base[$1 " " $2]
+            printf "%s  %-8s %s %10.1f -> %10.1f Mbit/s (%+.1f%%)\n", d < -t ? "FAIL" : "PASS", $1, $2, base[$1 " " $2], $3, d
+        }' "$COMPARE" -
+}
+
+while getopts "m:a:i:H:A:t:P:o:c:T:h" opt; do
+    case $opt in
+        m) MODULE="$OPTARG" ;;
+        a) FEATURE="$OPTARG" ;;
+        i) BLOCK_APP="$OPTARG" ;;
+        H) BLOCK_HOST="$OPTARG" ;;
+        A) ALLOW_HOST="$OPTARG" ;;
+        t) DURATION="$OPTARG" ;;
+        P) PARALLEL="$OPTARG" ;;
+        o) OUTPUT="$OPTARG" ;;
+        c) COMPARE="$OPTARG" ;;
+        T) THRESHOLD="$OPTARG" ;;
+        *) usage ;;
+    esac
+done
+
+[ "$(id -u)" -eq 0 ] || die "must be run as root"
+for cmd in ip iperf3 curl openssl python3 insmod; do
+    command -v $cmd >/dev/null || die "$cmd not found"
+done
+[ -f "$MODULE" ] || die "$MODULE not found, build the module first"
+[ -f "$FEATURE" ] || die "$FEATURE not found"
+module_loaded && die "parental_control is already loaded, unload it first"
+modprobe nf_conntrack 2>/dev/null
+
+WORK="$(mktemp -d)"
+trap cleanup EXIT
+trap "exit 1" INT TERM
+setup
+
+printf "%-8s %12s %8s %12s %8s\n" mode "tcp Mbit/s" cores "udp Mbit/s" cores
+measure off
+module_load
+measure idle
+set_group policy
+measure policy
+[ -d /proc/parental-control ] && grep -E "^(packets|cache_hit|cache_miss|dpi|finish)" /proc/parental-control/stats
+echo
+verdicts
+
+if [ -n "$OUTPUT" ]; then
+    echo "$RESULTS" > "$OUTPUT"
+fi
+if [ -n "$COMPARE" ]; then
+    echo
+    compare | tee "$WORK/compare"
+    grep -q "^FAIL" "$WORK/compare" && FAILED=$((FAILED + 1))
+fi
+[ $FAILED -eq 0 ]